@@ -0,0 +1,1690 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+
+Benchmarks for the Console write paths. This file is for measuring and should not be included in
+other projects. Run with --json to print only the write path results, as JSON, for tracking
+regressions between releases.
+*******************************************************************************/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "win_color_async.hh"
+#include "win_color_basic.hh"
+#include "win_color_console.hh"
+#include "win_color_highlight.hh"
+#include "win_color_nonblocking.hh"
+#include "win_color_parser.hh"
+#include "win_color_progress.hh"
+#include "win_color_record.hh"
+#include "win_color_screen.hh"
+#include "win_color_scrollback.hh"
+#include "win_color_styled.hh"
+#include "win_color_table.hh"
+
+using wincc::ConsoleBackend;
+using wincc::ConsoleColor;
+
+// Number of allocations made through operator new, for the allocations per call column.
+static std::atomic<size_t> allocation_count(0);
+
+void *operator new(size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    void *memory = malloc(size ? size : 1);
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+
+    return memory;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+#ifdef _WIN32
+static const char null_device[] = "NUL";
+#else
+static const char null_device[] = "/dev/null";
+#endif
+
+// Sink making one write(2) or writev(2) per call to the null device and counting them.
+class SyscallSink : public wincc::OutputSink
+{
+public:
+    SyscallSink()
+    {
+#ifdef _WIN32
+        m_fd = _open(null_device, _O_WRONLY | _O_BINARY);
+#else
+        m_fd = open(null_device, O_WRONLY);
+#endif
+    }
+
+    ~SyscallSink()
+    {
+#ifdef _WIN32
+        _close(m_fd);
+#else
+        close(m_fd);
+#endif
+    }
+
+    void write(const char *data, size_t size) override
+    {
+#ifdef _WIN32
+        _write(m_fd, data, (unsigned int)size);
+#else
+        ssize_t result = ::write(m_fd, data, size);
+        (void)result;
+#endif
+        ++writes;
+        bytes += size;
+    }
+
+    void writev(const wincc::IoSlice *slices, size_t count) override
+    {
+#ifdef _WIN32
+        for (size_t i = 0; i < count; ++i)
+        {
+            _write(m_fd, slices[i].data, (unsigned int)slices[i].size);
+        }
+#else
+        ssize_t result = ::writev(m_fd, reinterpret_cast<const struct iovec *>(slices), (int)count);
+        (void)result;
+#endif
+        ++writes;
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += slices[i].size;
+        }
+    }
+
+    void reset()
+    {
+        writes = 0;
+        bytes = 0;
+    }
+
+    size_t writes = 0;
+    size_t bytes = 0;
+
+private:
+    int m_fd;
+};
+
+// Sink that discards everything, counting bytes.
+class NullSink : public wincc::OutputSink
+{
+public:
+    void write(const char *, size_t size) override
+    {
+        bytes += size;
+    }
+
+    void writev(const wincc::IoSlice *slices, size_t count) override
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += slices[i].size;
+        }
+    }
+
+    size_t bytes = 0;
+};
+
+// Memory sink counting bytes, emptied whenever it passes a megabyte so it does not grow forever.
+class BoundedMemorySink : public wincc::MemorySink
+{
+public:
+    void write(const char *data, size_t size) override
+    {
+        if (str().size() > (1 << 20))
+        {
+            clear();
+        }
+
+        MemorySink::write(data, size);
+        bytes += size;
+    }
+
+    size_t bytes = 0;
+};
+
+// Buffered descriptor sink on the null device, counting bytes and the bytes copied into its
+// buffer rather than sent from the caller's memory.
+class NullFdSink : public wincc::FdSink
+{
+public:
+    NullFdSink() : FdSink(null_device) {}
+
+    void write(const char *data, size_t size) override
+    {
+        if (size < k_default_threshold)
+        {
+            copied += size;
+        }
+
+        FdSink::write(data, size);
+        bytes += size;
+    }
+
+    void writev(const wincc::IoSlice *slices, size_t count) override
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size += slices[i].size;
+        }
+
+        if (pending() + size < k_default_threshold)
+        {
+            copied += size;
+        }
+
+        FdSink::writev(slices, count);
+        bytes += size;
+    }
+
+    size_t bytes = 0;
+    size_t copied = 0;
+};
+
+// Measurements for one write path against one sink.
+struct PathResult
+{
+    const char *path;
+    const char *sink;
+    double ns_per_call;
+    double bytes_per_call;
+    double switches_per_call;
+    double allocations_per_call;
+};
+
+// One public Console operation. The call number lets colored paths cycle through colors, so
+// switching is measured rather than skipped as redundant.
+struct WritePath
+{
+    const char *name;
+    void (*call)(wincc::Console &console, int n);
+};
+
+static const ConsoleColor path_foregrounds[] = { ConsoleColor::Red, ConsoleColor::Green, ConsoleColor::Cyan, ConsoleColor::Yellow };
+static const ConsoleColor path_backgrounds[] = { ConsoleColor::Default, ConsoleColor::DarkBlue, ConsoleColor::Default, ConsoleColor::DarkGreen };
+
+static const WritePath write_paths[] =
+{
+    { "write(text)", [](wincc::Console &console, int)
+    {
+        console.write("worker finished a unit of work\n");
+    } },
+    { "write(fg, text)", [](wincc::Console &console, int n)
+    {
+        console.write(path_foregrounds[n & 3], "worker finished a unit of work\n");
+    } },
+    { "write(fg, bg, text)", [](wincc::Console &console, int n)
+    {
+        console.write(path_foregrounds[n & 3], path_backgrounds[(n >> 2) & 3], "worker finished a unit of work\n");
+    } },
+    { "writewc(text)", [](wincc::Console &console, int)
+    {
+        console.writewc(L"worker finished a unit of work\n");
+    } },
+    { "writewc(fg, text)", [](wincc::Console &console, int n)
+    {
+        console.writewc(path_foregrounds[n & 3], L"worker finished a unit of work\n");
+    } },
+    { "writewc(fg, bg, text)", [](wincc::Console &console, int n)
+    {
+        console.writewc(path_foregrounds[n & 3], path_backgrounds[(n >> 2) & 3], L"worker finished a unit of work\n");
+    } },
+    { "write(fg, format, args...)", [](wincc::Console &console, int n)
+    {
+        console.write(path_foregrounds[n & 3], "shard {} served {} requests\n", n & 63, (unsigned)n);
+    } },
+    { "write(styled)", [](wincc::Console &console, int)
+    {
+        console.write(wincc::styled<"{red}[ERROR]{/} disk full\n">());
+    } },
+    { "foreground_color(fg)", [](wincc::Console &console, int n)
+    {
+        console.foreground_color(path_foregrounds[n & 3]);
+    } },
+    { "background_color(bg)", [](wincc::Console &console, int n)
+    {
+        console.background_color(path_backgrounds[n & 3]);
+    } },
+    { "reset_colors()", [](wincc::Console &console, int)
+    {
+        console.reset_colors();
+    } },
+    { "foreground_color(fg) + write", [](wincc::Console &console, int n)
+    {
+        console.foreground_color(path_foregrounds[n & 3]);
+        console.write("worker finished a unit of work\n");
+    } },
+};
+
+// Time calls of one write path through an ANSI console writing to sink.
+template <class Sink>
+static PathResult measure_path(const WritePath &path, const char *sink_name, int calls)
+{
+    Sink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    // Warm up so per-thread buffers and sink memory are already allocated.
+    for (int n = 0; n < 1000; ++n)
+    {
+        path.call(console, n);
+    }
+
+    size_t bytes = sink.bytes;
+    size_t switches = console.switch_count();
+    size_t allocations = allocation_count.load(std::memory_order_relaxed);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < calls; ++n)
+    {
+        path.call(console, n);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    PathResult result;
+    result.path = path.name;
+    result.sink = sink_name;
+    result.ns_per_call = elapsed.count() / calls;
+    result.bytes_per_call = (double)(sink.bytes - bytes) / calls;
+    result.switches_per_call = (double)(console.switch_count() - switches) / calls;
+    result.allocations_per_call = (double)(allocation_count.load(std::memory_order_relaxed) - allocations) / calls;
+    return result;
+}
+
+// Run every write path against the null, memory and buffered descriptor sinks.
+static std::vector<PathResult> bench_write_paths(int calls)
+{
+    std::vector<PathResult> results;
+
+    for (const WritePath &path : write_paths)
+    {
+        results.push_back(measure_path<NullSink>(path, "null", calls));
+        results.push_back(measure_path<BoundedMemorySink>(path, "memory", calls));
+        results.push_back(measure_path<NullFdSink>(path, "fd", calls));
+    }
+
+    return results;
+}
+
+// Print write path results as a table.
+static void print_write_paths(const std::vector<PathResult> &results)
+{
+    printf("write paths, ANSI backend            sink    ns/call   bytes/call switches/call allocs/call\n");
+
+    for (const PathResult &result : results)
+    {
+        printf("  %-32s %-6s %9.1f %12.1f %13.2f %11.3f\n", result.path, result.sink, result.ns_per_call,
+            result.bytes_per_call, result.switches_per_call, result.allocations_per_call);
+    }
+}
+
+// Print write path results as JSON.
+static void print_write_paths_json(const std::vector<PathResult> &results)
+{
+    printf("{\n  \"benchmark\": \"write_paths\",\n  \"backend\": \"ansi\",\n  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const PathResult &result = results[i];
+        printf("    { \"path\": \"%s\", \"sink\": \"%s\", \"ns_per_call\": %.2f, \"bytes_per_call\": %.2f, "
+            "\"switches_per_call\": %.4f, \"allocations_per_call\": %.4f }%s\n", result.path, result.sink,
+            result.ns_per_call, result.bytes_per_call, result.switches_per_call, result.allocations_per_call,
+            i + 1 < results.size() ? "," : "");
+    }
+
+    printf("  ]\n}\n");
+}
+
+// Fields of a typical status line.
+struct StatusField
+{
+    ConsoleColor foreground;
+    ConsoleColor background;
+    const char *text;
+};
+
+static const StatusField status_fields[] =
+{
+    { ConsoleColor::White, ConsoleColor::DarkBlue, " api-7 " },
+    { ConsoleColor::Green, ConsoleColor::Default, " OK " },
+    { ConsoleColor::Gray, ConsoleColor::Default, "req/s " },
+    { ConsoleColor::Cyan, ConsoleColor::Default, "18234 " },
+    { ConsoleColor::Gray, ConsoleColor::Default, "p99 " },
+    { ConsoleColor::Yellow, ConsoleColor::Default, "41ms " },
+    { ConsoleColor::Gray, ConsoleColor::Default, "errors " },
+    { ConsoleColor::Red, ConsoleColor::Default, "3\n" },
+};
+
+static const int status_line_count = 200000;
+
+// Print one result row.
+static void report(const char *name, const SyscallSink &sink, double seconds, int lines)
+{
+    printf("  %-28s %12.2f %12.1f %12.1f\n", name, (double)sink.writes / lines, (double)sink.bytes / lines,
+        seconds * 1e9 / lines);
+}
+
+// A status line with several colored fields, written field by field and as one frame.
+static void bench_status_line()
+{
+    const int field_count = (int)(sizeof(status_fields) / sizeof(status_fields[0]));
+
+    printf("status line, %d colored fields   writes/line   bytes/line      ns/line\n", field_count);
+
+    SyscallSink sink;
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < status_line_count; ++line)
+        {
+            for (const StatusField &field : status_fields)
+            {
+                console.write(field.foreground, field.background, field.text);
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("write(fg, bg, text) per field", sink, elapsed.count(), status_line_count);
+    }
+
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::Frame frame;
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < status_line_count; ++line)
+        {
+            frame.clear();
+            for (const StatusField &field : status_fields)
+            {
+                frame.append(field.foreground, field.background, field.text);
+            }
+            console.commit(frame);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("Frame + commit", sink, elapsed.count(), status_line_count);
+    }
+}
+
+// Formatting a log line with sprintf into a buffer and writing it, against the formatted write.
+static void bench_formatted_write()
+{
+    const int line_count = 1000000;
+    static char text_buffer[1024];
+
+    printf("formatted log line                 writes/line   bytes/line      ns/line\n");
+
+    SyscallSink sink;
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            sprintf(text_buffer, "shard %d served %u requests in %.3f s from %s\n", line & 63, (unsigned)line, 0.125,
+                "eu-west");
+            console.write(ConsoleColor::Cyan, text_buffer);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("sprintf + write(fg, text)", sink, elapsed.count(), line_count);
+    }
+
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            console.write(ConsoleColor::Cyan, "shard {} served {} requests in {} s from {}\n", line & 63, (unsigned)line,
+                0.125, "eu-west");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("write(fg, format, args...)", sink, elapsed.count(), line_count);
+    }
+}
+
+// Nested colored sections, as a logger writing a red error with a highlighted field inside it,
+// where the innermost section usually repeats the colors around it. Style scopes against saving and
+// restoring the colors by hand around each section.
+static void bench_style_stack()
+{
+    const int line_count = 2000000;
+
+    printf("nested sections, 3 levels        writes/line   bytes/line      ns/line\n");
+
+    SyscallSink sink;
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            wincc::StyleScope error(console, ConsoleColor::Red);
+            console.write("error in ");
+            {
+                wincc::StyleScope field(console, line % 8 ? ConsoleColor::Red : ConsoleColor::Cyan);
+                console.write("parse_header");
+                {
+                    wincc::StyleScope detail(console, ConsoleColor::Red);
+                    console.write(": bad magic");
+                }
+            }
+            console.write("\n");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("StyleScope", sink, elapsed.count(), line_count);
+    }
+
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            ConsoleColor outer = console.foreground_color();
+            console.foreground_color(ConsoleColor::Red);
+            console.write("error in ");
+            {
+                ConsoleColor saved = console.foreground_color();
+                console.foreground_color(line % 8 ? ConsoleColor::Red : ConsoleColor::Cyan);
+                console.write("parse_header");
+                {
+                    ConsoleColor inner = console.foreground_color();
+                    console.foreground_color(ConsoleColor::Red);
+                    console.write(": bad magic");
+                    console.foreground_color(inner);
+                }
+                console.foreground_color(saved);
+            }
+            console.write("\n");
+            console.foreground_color(outer);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("save and restore by hand", sink, elapsed.count(), line_count);
+    }
+}
+
+// A fixed colored prefix compiled ahead of time, against writing it with a color on every line.
+static void bench_styled_prefix()
+{
+    const int line_count = 2000000;
+
+    printf("[ERROR] prefix + message           writes/line   bytes/line      ns/line\n");
+
+    SyscallSink sink;
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            console.write(ConsoleColor::Red, "[ERROR]");
+            console.write(" disk full\n");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("write(Red, \"[ERROR]\")", sink, elapsed.count(), line_count);
+    }
+
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            console.write(wincc::styled<"{red}[ERROR]{/} ">());
+            console.write("disk full\n");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("styled<\"{red}[ERROR]{/} \">", sink, elapsed.count(), line_count);
+    }
+}
+
+// Colored log lines written to the null device through a stream: a bare fwrite that ignores the
+// colors, consoles with their backend fixed at compile time, and a runtime Console for comparison.
+// The NoColor console should match the bare fwrite, since it compiles to the same code.
+static void bench_basic_console()
+{
+    const int line_count = 2000000;
+    const char *text = "worker finished a unit of work\n";
+
+    printf("colored line to a stream                           ns/line\n");
+
+    FILE *file = fopen(null_device, "wb");
+
+    auto report_lines = [&](const char *name, auto write_line)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int line = 0; line < line_count; ++line)
+        {
+            write_line(line);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("  %-44s %10.1f\n", name, elapsed.count() * 1e9 / line_count);
+    };
+
+    report_lines("fwrite(text)", [&](int)
+    {
+        fwrite(text, 1, strlen(text), file);
+    });
+
+    {
+        wincc::BasicConsole<wincc::backend::NoColor> console{ wincc::backend::NoColor(file) };
+        report_lines("BasicConsole<NoColor>::write(fg, bg, text)", [&](int line)
+        {
+            console.write(path_foregrounds[line & 3], path_backgrounds[(line >> 2) & 3], text);
+        });
+    }
+
+    {
+        wincc::BasicConsole<wincc::backend::Null> console;
+        report_lines("BasicConsole<Null>::write(fg, bg, text)", [&](int line)
+        {
+            console.write(path_foregrounds[line & 3], path_backgrounds[(line >> 2) & 3], text);
+        });
+    }
+
+    {
+        wincc::BasicConsole<wincc::backend::Ansi> console{ wincc::backend::Ansi(file) };
+        report_lines("BasicConsole<Ansi>::write(fg, bg, text)", [&](int line)
+        {
+            console.write(path_foregrounds[line & 3], path_backgrounds[(line >> 2) & 3], text);
+        });
+    }
+
+    {
+        wincc::StreamSink sink(file);
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        report_lines("Console, Plain backend", [&](int line)
+        {
+            console.write(path_foregrounds[line & 3], path_backgrounds[(line >> 2) & 3], text);
+        });
+    }
+
+    {
+        wincc::StreamSink sink(file);
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        report_lines("Console, Ansi backend", [&](int line)
+        {
+            console.write(path_foregrounds[line & 3], path_backgrounds[(line >> 2) & 3], text);
+        });
+    }
+
+    fclose(file);
+}
+
+// Large colored payloads, such as stack traces and JSON dumps, written to the null device: through
+// stdio, copied together with their escape sequences into one buffer for a single write, and
+// through a Console, which gathers the escape sequences and the caller's bytes without copying.
+static void bench_large_payloads()
+{
+    static const char red[] = "\x1b[91m";
+    static const char reset[] = "\x1b[39m";
+    const size_t sizes[] = { 64, 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+    printf("colored payload to %-17s      size     ns/call   copied/call        MB/s\n", null_device);
+
+    for (size_t size : sizes)
+    {
+        std::string payload(size, 'j');
+        int calls = (int)std::min<size_t>(200000, ((size_t)256 << 20) / size);
+
+        auto time = [&](auto fn)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (int n = 0; n < calls; ++n)
+            {
+                fn(n);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count();
+        };
+
+        // Copied bytes are those moved into an intermediate buffer; stdio's are not visible.
+        auto print_row = [&](const char *name, double seconds, const char *copied)
+        {
+            printf("  %-38s %8zu %11.0f %13s %11.0f\n", name, size, seconds / calls * 1e9, copied,
+                (double)size * calls / seconds / 1e6);
+        };
+
+        char copied[32];
+
+        FILE *stream = fopen(null_device, "wb");
+        double seconds = time([&](int)
+        {
+            fputs(red, stream);
+            fputs(payload.c_str(), stream);
+            fputs(reset, stream);
+        });
+        fclose(stream);
+        print_row("stdio fputs", seconds, "-");
+
+        SyscallSink syscall_sink;
+        std::string assembled;
+        size_t assembled_copied = 0;
+        seconds = time([&](int)
+        {
+            assembled.assign(red);
+            assembled.append(payload);
+            assembled.append(reset);
+            assembled_copied += assembled.size();
+            syscall_sink.write(assembled.data(), assembled.size());
+        });
+        snprintf(copied, sizeof(copied), "%.0f", (double)assembled_copied / calls);
+        print_row("assembled buffer, one write(2)", seconds, copied);
+
+        {
+            NullFdSink sink;
+            wincc::Console console(ConsoleBackend::Ansi, &sink);
+            seconds = time([&](int n)
+            {
+                console.write(n % 2 ? ConsoleColor::Red : ConsoleColor::Cyan, payload.c_str());
+            });
+            snprintf(copied, sizeof(copied), "%.0f", (double)sink.copied / calls);
+            print_row("Console, FdSink", seconds, copied);
+        }
+
+        {
+            SyscallSink sink;
+            wincc::Console console(ConsoleBackend::Ansi, &sink);
+            seconds = time([&](int n)
+            {
+                console.write(n % 2 ? ConsoleColor::Red : ConsoleColor::Cyan, payload.c_str());
+            });
+            print_row("Console, one writev(2) per call", seconds, "0");
+        }
+    }
+}
+
+// Run fn repeatedly over input and print the throughput in MB/s.
+template <class Fn>
+static void report_throughput(const char *name, size_t input_size, int repeats, Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; ++i)
+    {
+        fn();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("  %-40s %10.0f MB/s\n", name, (double)input_size * repeats / elapsed.count() / 1e6);
+}
+
+// Run fn once per frame and print the average time per frame.
+template <class Fn>
+static void report_per_frame(const char *name, int frames, Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        fn(frame);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("  %-40s %10.1f us/frame\n", name, elapsed.count() / frames * 1e6);
+}
+
+// A log with colored levels written with and without a 10000 line scrollback attached, and a
+// 240x67 screen of it repainted from the scrollback, as after a resize.
+static void bench_scrollback()
+{
+    const int line_count = 1000000;
+    const int rows = 67;
+
+    std::vector<std::string> messages;
+    for (int i = 0; i < 64; ++i)
+    {
+        char text[240];
+        snprintf(text, sizeof(text), " shard-%d req-%08x customer=acct-%04d latency=%dms %.*s\n", i % 32,
+            i * 2654435761u, i * 37 % 3000, i % 97, i * 3, "................................................"
+            "................................................................................");
+        messages.push_back(text);
+    }
+
+    auto write_log = [&](wincc::Console &console)
+    {
+        for (int line = 0; line < line_count; ++line)
+        {
+            console.write(line % 50 ? ConsoleColor::Green : ConsoleColor::Red, line % 50 ? "INFO " : "ERROR");
+            console.write(messages[line % messages.size()].c_str());
+        }
+    };
+
+    NullSink sink;
+    wincc::Scrollback scrollback(10000);
+    size_t total = 0;
+    for (int line = 0; line < line_count; ++line)
+    {
+        total += 5 + messages[line % messages.size()].size();
+    }
+
+    printf("writing a colored log, MB/s\n");
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        report_throughput("Console", total, 1, [&]() { write_log(console); });
+    }
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        console.scrollback(&scrollback);
+        report_throughput("Console with scrollback", total, 1, [&]() { write_log(console); });
+    }
+
+    printf("scrollback of %zu lines in %zu bytes, %zu bytes of text held\n", scrollback.line_count(),
+        scrollback.memory_usage(), scrollback.text_size());
+
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    report_per_frame("repaint last 67 lines", 10000, [&](int) { scrollback.replay_last(console, rows); });
+    report_per_frame("repaint 67 lines from the middle", 10000,
+        [&](int frame) { scrollback.replay(console, (size_t)frame % 5000, rows); });
+}
+
+// Full-screen 240x67 heatmap of RGB cells: quantizing it to the ConsoleColor palette for legacy
+// consoles, and drawing it as background colors at each color depth.
+static void bench_heatmap()
+{
+    const int width = 240;
+    const int height = 67;
+    const int frames = 200;
+
+    std::vector<wincc::Color> cells((size_t)width * height);
+    std::vector<ConsoleColor> quantized(cells.size());
+
+    auto fill = [&](int frame)
+    {
+        for (int row = 0; row < height; ++row)
+        {
+            for (int column = 0; column < width; ++column)
+            {
+                int heat = (row * 7 + column * 3 + frame * 5) & 0x1FF;
+                heat = heat > 255 ? 511 - heat : heat;
+                cells[(size_t)row * width + column] = wincc::Color::rgb((unsigned char)heat, (unsigned char)(heat / 3),
+                    (unsigned char)(255 - heat));
+            }
+        }
+    };
+    fill(0);
+
+    printf("%dx%d heatmap\n", width, height);
+
+    report_per_frame("nearest color search per cell", frames, [&](int)
+    {
+        for (size_t i = 0; i < cells.size(); ++i)
+        {
+            int best = 0;
+            int best_distance = 1 << 30;
+            for (int c = 0; c < (int)ConsoleColor::Default; ++c)
+            {
+                const unsigned char *rgb = wincc::detail::k_color_rgb[c];
+                int dr = cells[i].red - rgb[0];
+                int dg = cells[i].green - rgb[1];
+                int db = cells[i].blue - rgb[2];
+                int distance = dr * dr + dg * dg + db * db;
+                if (distance < best_distance)
+                {
+                    best = c;
+                    best_distance = distance;
+                }
+            }
+            quantized[i] = (ConsoleColor)best;
+        }
+    });
+
+    report_per_frame("quantize_scalar", frames, [&](int)
+    {
+        wincc::detail::quantize_scalar(cells.data(), cells.size(), quantized.data());
+    });
+
+    report_per_frame("quantize", frames, [&](int)
+    {
+        wincc::quantize(cells.data(), cells.size(), quantized.data());
+    });
+
+    const wincc::ColorDepth depths[] = { wincc::ColorDepth::Basic, wincc::ColorDepth::Indexed, wincc::ColorDepth::TrueColor };
+    const char *const depth_names[] = { "draw, Basic", "draw, Indexed", "draw, TrueColor" };
+
+    for (int d = 0; d < 3; ++d)
+    {
+        NullSink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        console.color_depth(depths[d]);
+
+        report_per_frame(depth_names[d], frames / 4, [&](int frame)
+        {
+            fill(frame);
+            console.move_cursor(0, 0);
+            for (int row = 0; row < height; ++row)
+            {
+                for (int column = 0; column < width; ++column)
+                {
+                    console.write(ConsoleColor::Default, cells[(size_t)row * width + column], " ");
+                }
+                console.write("\n");
+            }
+        });
+    }
+}
+
+// 2000-row table of per-shard stats sent to the null device, written cell by cell with padding
+// computed by hand and rendered with Table, plus display width measurement of ASCII and CJK text.
+static void bench_table()
+{
+    const int row_count = 2000;
+    const int tables = 50;
+
+    std::vector<std::string> names;
+    for (int row = 0; row < row_count; ++row)
+    {
+        names.push_back(row % 4 ? "shard-" + std::to_string(row) : "\xe5\x88\x86\xe7\x89\x87-" + std::to_string(row));
+    }
+
+    printf("%d-row table\n", row_count);
+
+    {
+        SyscallSink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        report_per_frame("write per cell, byte widths", tables, [&](int)
+        {
+            for (int row = 0; row < row_count; ++row)
+            {
+                console.write("{}", names[row]);
+                for (size_t i = names[row].size(); i < 12; ++i)
+                {
+                    console.write(" ");
+                }
+                console.write(ConsoleColor::Cyan, "  {}", row * 37 % 20000);
+                console.write(row % 9 ? ConsoleColor::Green : ConsoleColor::Red, "  {}\n", row % 9 ? "ok" : "slow");
+            }
+        });
+        printf("  %-40s %10.1f\n", "  writes to the sink per table", (double)sink.writes / tables);
+    }
+
+    {
+        SyscallSink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::Table table;
+        char number[16];
+        report_per_frame("Table::render", tables, [&](int)
+        {
+            table.clear();
+            table.add_column("shard");
+            table.add_column("req/s", wincc::Align::Right);
+            table.add_column("status");
+            for (int row = 0; row < row_count; ++row)
+            {
+                int size = snprintf(number, sizeof(number), "%d", row * 37 % 20000);
+                table.add_row();
+                table.add_cell(names[row]);
+                table.add_cell(ConsoleColor::Cyan, std::string_view(number, (size_t)size));
+                table.add_cell(row % 9 ? ConsoleColor::Green : ConsoleColor::Red, row % 9 ? "ok" : "slow");
+            }
+            table.render(console);
+        });
+        printf("  %-40s %10.1f\n", "  writes to the sink per table", (double)sink.writes / tables);
+    }
+
+    const std::string ascii = std::string(64 * 1024, 'x') + "GET /api/v1/shards/17/stats 200 OK";
+    const std::string cjk = []()
+    {
+        std::string text;
+        while (text.size() < 64 * 1024)
+        {
+            text += "\xe7\x8a\xb6\xe6\x80\x81\xe6\xad\xa3\xe5\xb8\xb8 ok ";
+        }
+        return text;
+    }();
+
+    size_t width = 0;
+    report_throughput("display_width, ASCII", ascii.size(), 2000, [&]()
+    {
+        width += wincc::detail::display_width(ascii);
+    });
+    report_throughput("display_width, CJK", cjk.size(), 200, [&]()
+    {
+        width += wincc::detail::display_width(cjk);
+    });
+
+    if (width == 0)
+    {
+        printf("unexpected zero width\n");
+    }
+}
+
+// Markup parsing speed on text without tags and text full of them.
+static void bench_markup()
+{
+    const size_t input_size = 1 << 20;
+    const int repeats = 200;
+
+    std::string plain;
+    while (plain.size() < input_size)
+    {
+        plain += "GET /api/v1/shards/17/stats 200 OK 3.2ms user=alice region=eu-west\n";
+    }
+
+    std::string dense;
+    while (dense.size() < input_size)
+    {
+        dense += "[red]ERR[/] [cyan]shard-17[/] [white on blue]p99[/] [[x]\n";
+    }
+
+    printf("markup parsing\n");
+
+    const char *volatile found;
+    report_throughput("find_byte, SSE2, no tags", plain.size(), repeats, [&]()
+    {
+        found = wincc::detail::find_byte(plain.data(), plain.data() + plain.size(), '[');
+    });
+    report_throughput("find_byte_scalar, no tags", plain.size(), repeats, [&]()
+    {
+        found = wincc::detail::find_byte_scalar(plain.data(), plain.data() + plain.size(), '[');
+    });
+    (void)found;
+
+    wincc::MarkupTemplate markup;
+    report_throughput("MarkupTemplate::parse, no tags", plain.size(), repeats, [&]()
+    {
+        markup.parse(plain);
+    });
+    report_throughput("MarkupTemplate::parse, tag-dense", dense.size(), repeats / 10, [&]()
+    {
+        markup.parse(dense);
+    });
+}
+
+// Draw one frame of an 80x24 dashboard: a fixed layout of labels and a few numbers that change
+// every frame.
+static void draw_dashboard(wincc::Screen &screen, int frame)
+{
+    char value[32];
+
+    screen.clear();
+    screen.write(0, 0, " shard dashboard                                                    q: quit ",
+        ConsoleColor::White, ConsoleColor::DarkBlue);
+
+    for (int row = 2; row < 22; ++row)
+    {
+        int shard = row - 2;
+        snprintf(value, sizeof(value), "shard-%02d", shard);
+        screen.write(row, 1, value, ConsoleColor::Cyan);
+        screen.write(row, 12, shard % 7 == 3 ? "DEGRADED" : "OK", shard % 7 == 3 ? ConsoleColor::Yellow : ConsoleColor::Green);
+        screen.write(row, 24, "req/s", ConsoleColor::Gray);
+        screen.write(row, 44, "p99", ConsoleColor::Gray);
+        screen.write(row, 60, "errors", ConsoleColor::Gray);
+
+        // Only a few shards report new numbers each frame.
+        int tick = (shard + frame) % 8 == 0 ? frame : 0;
+        snprintf(value, sizeof(value), "%6d", 18000 + shard * 37 + tick % 97);
+        screen.write(row, 31, value, ConsoleColor::White);
+        snprintf(value, sizeof(value), "%3dms", 40 + shard + tick % 5);
+        screen.write(row, 49, value, ConsoleColor::Yellow);
+        snprintf(value, sizeof(value), "%d", shard % 5 == 0 ? 3 : 0);
+        screen.write(row, 68, value, ConsoleColor::Red);
+    }
+
+    snprintf(value, sizeof(value), "frame %d", frame);
+    screen.write(23, 0, value, ConsoleColor::Gray);
+}
+
+// Bytes sent per frame by a dashboard redrawing in place, with and without damage tracking.
+static void bench_screen()
+{
+    const int frame_count = 20000;
+
+    printf("80x24 dashboard, small deltas      writes/frame bytes/frame     ns/frame\n");
+
+    SyscallSink sink;
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::Screen screen(80, 24);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frame_count; ++frame)
+        {
+            draw_dashboard(screen, frame);
+            screen.invalidate();
+            screen.present(console);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("full redraw", sink, elapsed.count(), frame_count);
+    }
+
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::Screen screen(80, 24);
+        sink.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frame_count; ++frame)
+        {
+            draw_dashboard(screen, frame);
+            screen.present(console);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("Screen::present, changes only", sink, elapsed.count(), frame_count);
+    }
+}
+
+// Build about size bytes of wide text by repeating a sample.
+static std::wstring repeat_wide(const wchar_t *sample, size_t size)
+{
+    std::wstring text;
+    while (text.size() * sizeof(wchar_t) < size)
+    {
+        text += sample;
+    }
+
+    return text;
+}
+
+// Wide to UTF-8 conversion speed on ASCII, on mixed BMP text and on text outside the BMP, which
+// takes surrogate pairs where wchar_t is 16 bits.
+static void bench_utf8()
+{
+    const size_t input_size = 1 << 20;
+    const int repeats = 200;
+
+    struct Input
+    {
+        const char *name;
+        std::wstring text;
+    };
+
+    const Input inputs[] =
+    {
+        { "ASCII", repeat_wide(L"GET /api/v1/shards/17/stats 200 OK 3.2ms user=alice region=eu-west\n", input_size) },
+        { "Cyrillic", repeat_wide(L"Журнал: сервер отвечает медленно, задержка растёт\n", input_size) },
+        { "mixed BMP", repeat_wide(L"shard-17 状态正常 • café ✓ латентность 3.2ms\n", input_size) },
+        { "surrogate-heavy", repeat_wide(L"\U0001F600\U0001F680 build \U0001F525 ok \U0001F44D\U0001F389\n", input_size) },
+    };
+
+    printf("wide to UTF-8, MB/s of wchar_t input\n");
+
+    std::string out;
+    for (const Input &input : inputs)
+    {
+        size_t size = input.text.size() * sizeof(wchar_t);
+        out.resize(input.text.size() * wincc::detail::k_max_utf8_per_wchar);
+        char name[64];
+
+        snprintf(name, sizeof(name), "utf8_from_wide, %s", input.name);
+        report_throughput(name, size, repeats, [&]()
+        {
+            wincc::detail::utf8_from_wide(input.text.data(), input.text.size(), &out[0]);
+        });
+
+        snprintf(name, sizeof(name), "utf8_from_wide_scalar, %s", input.name);
+        report_throughput(name, size, repeats, [&]()
+        {
+            wincc::detail::utf8_from_wide_scalar(input.text.data(), input.text.size(), &out[0]);
+        });
+    }
+}
+
+// Archiving a colored service log: size of the recording against the ANSI and plain text, and
+// speed of recording, replaying, stripping and seeking.
+static void bench_record()
+{
+    const int line_count = 200000;
+    const int repeats = 20;
+
+    auto write_log = [&](wincc::Console &console)
+    {
+        for (int line = 0; line < line_count; ++line)
+        {
+            bool slow = line % 20 == 0;
+            console.write(ConsoleColor::DarkGray, "2024-05-01T12:{}:{} ", line / 6000 % 60, line / 100 % 60);
+            console.write(slow ? ConsoleColor::Yellow : ConsoleColor::Green, slow ? "WARN " : "INFO ");
+            console.write("shard-{} served ", line % 32);
+            console.write(ConsoleColor::Cyan, "GET /api/v1/items/{}", line);
+            console.write(" in {} ms\n", slow ? 250 : line % 9 + 1);
+        }
+    };
+
+    wincc::MemorySink ansi;
+    wincc::MemorySink plain;
+    wincc::MemorySink recorded;
+    {
+        wincc::Console ansi_console(ConsoleBackend::Ansi, &ansi);
+        wincc::Console plain_console(ConsoleBackend::Plain, &plain);
+        write_log(ansi_console);
+        write_log(plain_console);
+
+        wincc::RecordSink recorder(recorded);
+        wincc::Console console(ConsoleBackend::Ansi, &recorder);
+        write_log(console);
+    }
+
+    printf("%d-line colored log, bytes\n", line_count);
+    printf("  %-40s %10zu\n", "ANSI text", ansi.str().size());
+    printf("  %-40s %10zu\n", "recording", recorded.str().size());
+    printf("  %-40s %10zu\n", "plain text", plain.str().size());
+
+    wincc::Recording recording(recorded.str().data(), recorded.str().size());
+
+    printf("MB/s of plain text\n");
+    {
+        NullSink sink;
+        wincc::RecordSink recorder(sink);
+        report_throughput("RecordSink::write, ANSI input", plain.str().size(), repeats, [&]()
+        {
+            recorder.write(ansi.str().data(), ansi.str().size());
+        });
+    }
+
+    {
+        NullSink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        report_throughput("Recording::replay, Ansi", plain.str().size(), repeats, [&]()
+        {
+            recording.replay(console);
+        });
+    }
+
+    {
+        NullSink sink;
+        report_throughput("Recording::write_text", plain.str().size(), repeats, [&]()
+        {
+            recording.write_text(sink);
+        });
+    }
+
+    {
+        // Ten lines from the middle, found through the index.
+        NullSink sink;
+        const int seeks = 100000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < seeks; ++i)
+        {
+            recording.write_text(sink, (size_t)(i * 7919) % line_count, 10);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("  %-40s %10.2f us\n", "write_text of 10 lines at random", elapsed.count() / seeks * 1e6);
+    }
+}
+
+// Highlighting a tailed service log line by line, against searching for every keyword in turn,
+// for growing numbers of rules. Beyond the level keywords the rules are customer tokens, a few
+// of which appear in the log.
+static void bench_highlight()
+{
+    const size_t input_size = 8 << 20;
+
+    std::vector<std::string> lines;
+    size_t total = 0;
+    for (int line = 0; total < input_size; ++line)
+    {
+        char text[160];
+        snprintf(text, sizeof(text), "2024-05-01T12:00:%02d %s shard-%d req-%08x customer=acct-%04d latency=%dms\n",
+            line % 60, line % 50 ? "INFO" : line % 100 ? "WARN" : "ERROR", line % 32, line * 2654435761u, line % 3000,
+            line % 97);
+        lines.push_back(text);
+        total += lines.back().size();
+    }
+
+    printf("highlighting a log line by line, MB/s\n");
+
+    const int rule_counts[] = { 3, 10, 100, 1000 };
+    for (int rule_count : rule_counts)
+    {
+        std::vector<std::string> keywords = { "ERROR", "WARN", "req-" };
+        for (int i = 0; (int)keywords.size() < rule_count; ++i)
+        {
+            char token[16];
+            snprintf(token, sizeof(token), "acct-%04d", i * 7);
+            keywords.push_back(token);
+        }
+
+        NullSink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        char name[64];
+
+        wincc::Highlighter highlighter;
+        for (size_t k = 0; k < keywords.size(); ++k)
+        {
+            highlighter.add(keywords[k], k == 0 ? ConsoleColor::Red : k == 1 ? ConsoleColor::Yellow : ConsoleColor::Cyan);
+        }
+        highlighter.compile();
+
+        snprintf(name, sizeof(name), "Highlighter, %d rules, %zu states", rule_count, highlighter.state_count());
+        report_throughput(name, total, 4, [&]()
+        {
+            for (const std::string &line : lines)
+            {
+                highlighter.write(console, line);
+            }
+        });
+
+        if (rule_count > 100)
+        {
+            continue;
+        }
+
+        // The earliest of every keyword's next occurrence, then a write per piece.
+        snprintf(name, sizeof(name), "find per rule, %d rules", rule_count);
+        report_throughput(name, total, 1, [&]()
+        {
+            for (const std::string &line : lines)
+            {
+                std::string_view text(line);
+                size_t pos = 0;
+
+                while (true)
+                {
+                    size_t best = std::string_view::npos;
+                    size_t best_keyword = 0;
+                    for (size_t k = 0; k < keywords.size(); ++k)
+                    {
+                        size_t found = text.find(keywords[k], pos);
+                        if (found < best)
+                        {
+                            best = found;
+                            best_keyword = k;
+                        }
+                    }
+
+                    if (best == std::string_view::npos)
+                    {
+                        break;
+                    }
+
+                    std::string piece(text.substr(pos, best - pos));
+                    console.write(piece.c_str());
+                    console.write(ConsoleColor::Cyan, keywords[best_keyword].c_str());
+                    pos = best + keywords[best_keyword].size();
+                }
+
+                console.write(line.c_str() + pos);
+            }
+        });
+    }
+}
+
+// Parsing colored child process output: mostly plain build logs and heavily colored test output.
+static void bench_parser()
+{
+    const size_t input_size = 1 << 20;
+    const int repeats = 200;
+
+    std::string plain;
+    for (int line = 0; plain.size() < input_size; ++line)
+    {
+        plain += "[ 42%] Building CXX object src/CMakeFiles/core.dir/scheduler.cc.o\n";
+        if (line % 50 == 49)
+        {
+            plain += "\x1b[1;33mwarning:\x1b[0m unused variable 'slot'\n";
+        }
+    }
+
+    std::string dense;
+    while (dense.size() < input_size)
+    {
+        dense += "\x1b[32m[ OK ]\x1b[0m \x1b[36mParser.Chunks\x1b[0m (\x1b[38;5;244m3 ms\x1b[0m)\n";
+    }
+
+    printf("ANSI parsing\n");
+
+    wincc::AnsiParser parser;
+    size_t volatile span_count;
+    report_throughput("AnsiParser::feed, mostly plain", plain.size(), repeats, [&]()
+    {
+        span_count = parser.feed(plain.data(), plain.size()).size();
+    });
+    report_throughput("AnsiParser::feed, SGR-dense", dense.size(), repeats / 10, [&]()
+    {
+        span_count = parser.feed(dense.data(), dense.size()).size();
+    });
+    (void)span_count;
+
+    NullSink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    report_throughput("AnsiParser::relay, SGR-dense", dense.size(), repeats / 10, [&]()
+    {
+        parser.relay(console, dense.data(), dense.size());
+    });
+}
+
+// Cost per unit of work of reporting progress from a hot loop: a line written per item, against
+// progress widget updates, with and without the caller ticking redraws.
+static void bench_progress()
+{
+    const int item_count = 10000000;
+
+    printf("progress per item                                  ns/item   redraws\n");
+
+    // Redraws are not counted when a thread of the widget's own does them.
+    auto report_items = [&](const char *name, int items, double seconds, const char *redraws)
+    {
+        printf("  %-44s %10.2f %9s\n", name, seconds * 1e9 / items, redraws);
+    };
+
+    NullSink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    {
+        const int line_count = item_count / 10;
+        auto start = std::chrono::steady_clock::now();
+        for (int item = 0; item < line_count; ++item)
+        {
+            console.write(ConsoleColor::Green, "processed item {}\n", item);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report_items("write(fg, format, item)", line_count, elapsed.count(), "every");
+    }
+
+    {
+        wincc::ProgressBar bar(console, "items", item_count);
+        auto start = std::chrono::steady_clock::now();
+        for (int item = 0; item < item_count; ++item)
+        {
+            bar.add();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report_items("ProgressBar::add", item_count, elapsed.count(), "none");
+    }
+
+    {
+        wincc::ProgressBar bar(console, "items", item_count);
+        uint64_t redraws = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int item = 0; item < item_count; ++item)
+        {
+            bar.add();
+            redraws += bar.tick();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report_items("ProgressBar::add + tick", item_count, elapsed.count(), std::to_string(redraws).c_str());
+    }
+
+    {
+        const int thread_count = 4;
+        wincc::ProgressBar bar(console, "items", item_count);
+        bar.start();
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&bar]()
+            {
+                for (int item = 0; item < item_count / thread_count; ++item)
+                {
+                    bar.add();
+                }
+            });
+        }
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report_items("ProgressBar::add, 4 threads, redraw thread", item_count, elapsed.count() * thread_count, "-");
+    }
+}
+
+// Time every AsyncConsole::write call made by several producer threads and print percentiles.
+static void bench_async_latency(const char *name, size_t capacity, wincc::OverflowPolicy policy)
+{
+    const int thread_count = 4;
+    const int writes_per_thread = 200000;
+
+    SyscallSink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    std::vector<std::vector<double>> samples(thread_count);
+    size_t dropped;
+
+    {
+        wincc::AsyncConsole async(console, capacity, policy);
+        std::vector<std::thread> producers;
+
+        for (int t = 0; t < thread_count; ++t)
+        {
+            producers.emplace_back([&async, &samples, t]()
+            {
+                std::vector<double> &latencies = samples[t];
+                latencies.reserve(writes_per_thread);
+
+                for (int n = 0; n < writes_per_thread; ++n)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    async.write(ConsoleColor::Green, "worker finished a unit of work\n");
+                    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+                    latencies.push_back(elapsed.count());
+                }
+            });
+        }
+
+        for (std::thread &producer : producers)
+        {
+            producer.join();
+        }
+
+        async.flush();
+        dropped = async.dropped_count();
+    }
+
+    std::vector<double> all;
+    for (const std::vector<double> &latencies : samples)
+    {
+        all.insert(all.end(), latencies.begin(), latencies.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    printf("  %-28s %9.0f %9.0f %9.0f %9.0f %9zu\n", name, all[all.size() / 2], all[all.size() * 99 / 100],
+        all[all.size() * 999 / 1000], all.back(), dropped);
+}
+
+#ifndef _WIN32
+// Colored log lines written to a pipe whose reader takes 4 KB every millisecond, about a tenth of
+// the rate they are written at. One line in four is a new message; the rest repeat the line
+// before them, and one message in ten is a warning. Returns the time each line took to write.
+static std::vector<double> write_slow_log(wincc::OutputSink &sink, wincc::NonBlockingSink *nonblocking)
+{
+    const int line_count = 20000;
+
+    std::vector<double> latencies;
+    latencies.reserve(line_count);
+
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    char line[128];
+
+    for (int n = 0; n < line_count; ++n)
+    {
+        int message = n / 4;
+        bool warning = message % 10 == 0;
+        snprintf(line, sizeof(line), " shard-%d req-%08x upstream timed out after %dms, retrying\n", message % 32,
+            message * 2654435761u, message % 997);
+
+        if (nonblocking)
+        {
+            nonblocking->severity(warning ? wincc::Severity::Warning : wincc::Severity::Info);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        console.write(warning ? ConsoleColor::Yellow : ConsoleColor::Green, warning ? "WARN" : "INFO");
+        console.write(line);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        latencies.push_back(elapsed.count());
+    }
+
+    console.flush();
+    return latencies;
+}
+
+// Writing the slow log blocking in an FdSink, or through a NonBlockingSink with the given policy.
+static void bench_slow_pipe(const char *name, bool use_nonblocking, wincc::BackpressurePolicy policy)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return;
+    }
+
+    std::thread reader([&]()
+    {
+        char buffer[4096];
+        while (read(fds[0], buffer, sizeof(buffer)) > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::vector<double> latencies;
+    uint64_t dropped = 0;
+    uint64_t coalesced = 0;
+
+    if (use_nonblocking)
+    {
+        wincc::NonBlockingSink sink(fds[1], policy, 64 * 1024);
+        latencies = write_slow_log(sink, &sink);
+        sink.drain(10.0);
+        dropped = sink.dropped_count();
+        coalesced = sink.coalesced_count();
+    }
+    else
+    {
+        wincc::FdSink sink(fds[1], 0);
+        latencies = write_slow_log(sink, nullptr);
+    }
+
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("  %-28s %9.0f %9.0f %9.0f %9.0f %9llu %9llu\n", name, latencies[latencies.size() / 2],
+        latencies[latencies.size() * 99 / 100], latencies[latencies.size() * 999 / 1000], latencies.back(),
+        (unsigned long long)dropped, (unsigned long long)coalesced);
+}
+#endif
+
+int main(int argc, const char **argv)
+{
+    const int path_calls = 1000000;
+
+    if (argc > 1 && strcmp(argv[1], "--json") == 0)
+    {
+        print_write_paths_json(bench_write_paths(path_calls));
+        return 0;
+    }
+
+    print_write_paths(bench_write_paths(path_calls));
+
+    printf("\n");
+    bench_status_line();
+
+    printf("\n");
+    bench_formatted_write();
+
+    printf("\n");
+    bench_styled_prefix();
+
+    printf("\n");
+    bench_style_stack();
+
+    printf("\n");
+    bench_basic_console();
+
+    printf("\n");
+    bench_large_payloads();
+
+    printf("\n");
+    bench_markup();
+
+    printf("\n");
+    bench_screen();
+
+    printf("\n");
+    bench_utf8();
+
+    printf("\n");
+    bench_parser();
+
+    printf("\n");
+    bench_record();
+
+    printf("\n");
+    bench_highlight();
+
+    printf("\n");
+    bench_scrollback();
+
+    printf("\n");
+    bench_heatmap();
+
+    printf("\n");
+    bench_table();
+
+    printf("\n");
+    bench_progress();
+
+    printf("\nAsyncConsole producer latency, ns   p50       p99     p99.9       max   dropped\n");
+    bench_async_latency("block, 4096 slots", 4096, wincc::OverflowPolicy::Block);
+    bench_async_latency("block, 64 slots", 64, wincc::OverflowPolicy::Block);
+    bench_async_latency("drop, 64 slots", 64, wincc::OverflowPolicy::Drop);
+
+#ifndef _WIN32
+    printf("\nwriting to a throttled pipe, ns    p50       p99     p99.9       max   dropped coalesced\n");
+    bench_slow_pipe("FdSink, blocking", false, wincc::BackpressurePolicy::Coalesce);
+    bench_slow_pipe("NonBlockingSink, coalesce", true, wincc::BackpressurePolicy::Coalesce);
+    bench_slow_pipe("NonBlockingSink, drop low", true, wincc::BackpressurePolicy::DropLowPriority);
+    bench_slow_pipe("NonBlockingSink, 50 ms block", true, wincc::BackpressurePolicy::BlockUntilDeadline);
+#endif
+    return 0;
+}
@@ -3,11 +3,40 @@ See win_color_console.hh for license details.
 
 This file is for testing and should not be included in other projects.
 *******************************************************************************/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "win_color_async.hh"
+#include "win_color_basic.hh"
 #include "win_color_console.hh"
+#include "win_color_highlight.hh"
+#include "win_color_nonblocking.hh"
+#include "win_color_parser.hh"
+#include "win_color_progress.hh"
+#include "win_color_record.hh"
+#include "win_color_screen.hh"
+#include "win_color_scrollback.hh"
+#include "win_color_styled.hh"
+#include "win_color_table.hh"
 
+using wincc::ConsoleBackend;
 using wincc::ConsoleColor;
 
+// Record a failed check without stopping the run.
+#define CHECK(cond) check_result((cond), #cond, __FILE__, __LINE__)
+
 // Static variables for easily testing narrow and wide characters.
 static bool test_wide = false;
 static wchar_t wbuffer[256];
@@ -24,15 +53,104 @@ static void write_test(wincc::Console &console, ConsoleColor foreground, const c
 // Write methods that can switched between wchar_t and char types with foreground and background color.
 static void write_test(wincc::Console &console, ConsoleColor foreground, ConsoleColor background, const char *val);
 
+// Number of failed checks.
+static int check_failures = 0;
+
+// Print a failed check.
+static void check_result(bool passed, const char *expression, const char *file, int line);
+
+// Automated checks against in-memory output. Returns the process exit code.
+static int run_checks();
+
+// Check the bytes produced by the ANSI backend.
+static void check_ansi_backend();
+
+// Check that color switches are deferred until text is written.
+static void check_lazy_switching();
+
+// Check frame merging and single-write commits.
+static void check_frame();
+
+// Check that concurrent writers through an AsyncConsole never interleave or mix colors.
+static void check_async_console();
+
+// Check formatted writes.
+static void check_formatted_write();
+
+// Check markup compiled at compile time.
+static void check_styled();
+
+// Check markup parsed at runtime.
+static void check_markup();
+
+// Check wide to UTF-8 conversion and mixing narrow and wide writes.
+static void check_utf8();
+
+// Check the ANSI parser against chunking, malformed input and round trips through a console.
+static void check_parser();
+
+// Check extended colors and quantizing them to the ConsoleColor palette.
+static void check_colors();
+
+// Check the instrumentation counters, or that they stay zero when compiled out.
+static void check_stats();
+
+// Check consoles with their backend fixed at compile time.
+static void check_basic_console();
+
+// Check progress widgets on a terminal, in a log and updated from several threads.
+static void check_progress();
+
+// Check display widths and table layout, whole and streamed.
+static void check_table();
+
+// Check recording colored output and replaying it whole, by line range and unfinished.
+static void check_record();
+
+// Check keyword highlighting, overlapping keywords and the plain backend.
+static void check_highlight();
+
+// Check the style stack, its guards and that restoring the colors in effect sends nothing.
+static void check_style_stack();
+
+// Check the scrollback ring: recording, dropping old lines, cutting long ones and replaying.
+static void check_scrollback();
+
+// Check the non-blocking sink against a pipe nobody reads until the end.
+static void check_nonblocking_sink();
+
+// Check the fd sink's buffering and the plain backend.
+static void check_sinks();
+
+// Check that presenting a screen keeps a terminal in sync with it while sending only changes.
+static void check_screen();
+
 
 int main(int argc, const char **argv)
 {
-    static char text_buffer[1024];
-    wincc::Console console;
+    ConsoleBackend backend = ConsoleBackend::Auto;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--check")
+        {
+            return run_checks();
+        }
+        else if (arg == "--wide")
+        {
+            test_wide = true;
+        }
+        else if (arg == "--ansi")
+        {
+            backend = ConsoleBackend::Ansi;
+        }
+    }
 
-    if (argc >= 2 && (std::string)argv[1] == "--wide")
+    wincc::Console console(backend);
+
+    if (test_wide)
     {
-        test_wide = true;
         console.writewc(L"Test with wide characters...\n---\n");
     }
     else
@@ -44,8 +162,14 @@ int main(int argc, const char **argv)
     int fg, bg;
     fg = (int)console.foreground_color();
     bg = (int)console.background_color();
-    sprintf(text_buffer, "Default Foreground is %d, Default background is %d\n", fg, bg);
-    write_test(console, text_buffer);
+    if (test_wide)
+    {
+        console.writewc(L"Default Foreground is {}, Default background is {}\n", fg, bg);
+    }
+    else
+    {
+        console.write("Default Foreground is {}, Default background is {}\n", fg, bg);
+    }
 
     // Using functions that set once, foreground.
     write_test(console, ConsoleColor::Blue, "Blue\n");
@@ -66,6 +190,7 @@ int main(int argc, const char **argv)
 
     write_test(console, ConsoleColor::White, "White\n");
     write_test(console, ConsoleColor::Gray, "Gray\n");
+    write_test(console, ConsoleColor::DarkGray, "DarkGray\n");
     write_test(console, ConsoleColor::Black, "Black\n");
 
     write_test(console, ConsoleColor::Default, "Default Console Foreground\n");
@@ -89,6 +214,7 @@ int main(int argc, const char **argv)
 
     write_test(console, ConsoleColor::Black, ConsoleColor::White, "White\n");
     write_test(console, ConsoleColor::Black, ConsoleColor::Gray, "Gray\n");
+    write_test(console, ConsoleColor::White, ConsoleColor::DarkGray, "DarkGray\n");
     write_test(console, ConsoleColor::White, ConsoleColor::Black, "Black\n");
 
     write_test(console, ConsoleColor::Default, ConsoleColor::Default, "Default Background & Foreground \n");
@@ -161,3 +287,2182 @@ static void write_test(wincc::Console &console, ConsoleColor foreground, Console
         console.write(foreground, background, val);
     }
 }
+
+static void check_result(bool passed, const char *expression, const char *file, int line)
+{
+    if (!passed)
+    {
+        ++check_failures;
+        printf("%s(%d): check failed: %s\n", file, line, expression);
+    }
+}
+
+static int run_checks()
+{
+    check_ansi_backend();
+    check_lazy_switching();
+    check_frame();
+    check_async_console();
+    check_formatted_write();
+    check_styled();
+    check_markup();
+    check_screen();
+    check_sinks();
+    check_utf8();
+    check_parser();
+    check_colors();
+    check_stats();
+    check_basic_console();
+    check_progress();
+    check_table();
+    check_record();
+    check_highlight();
+    check_style_stack();
+    check_scrollback();
+    check_nonblocking_sink();
+
+    if (check_failures == 0)
+    {
+        printf("All checks passed.\n");
+        return 0;
+    }
+
+    printf("%d check(s) failed.\n", check_failures);
+    return 1;
+}
+
+static void check_ansi_backend()
+{
+    wincc::MemorySink sink;
+
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        CHECK(console.backend() == ConsoleBackend::Ansi);
+        CHECK(console.foreground_color() == ConsoleColor::Default);
+        CHECK(console.background_color() == ConsoleColor::Default);
+
+        // Uncolored text is passed through untouched.
+        console.write("plain");
+        CHECK(sink.str() == "plain");
+        sink.clear();
+
+        // Colored writes switch, and the default comes back before the next uncolored text.
+        console.write(ConsoleColor::Red, "a");
+        CHECK(sink.str() == "\x1b[91ma");
+        console.write("z");
+        CHECK(sink.str() == "\x1b[91ma\x1b[39mz");
+        sink.clear();
+
+        // Only the part that changes is sent.
+        console.write(ConsoleColor::White, ConsoleColor::DarkBlue, "b");
+        console.write(ConsoleColor::White, ConsoleColor::Gray, "e");
+        CHECK(sink.str() == "\x1b[97;44mb\x1b[47me");
+        sink.clear();
+
+        // Setters wait for text.
+        console.foreground_color(ConsoleColor::Green);
+        CHECK(sink.str().empty());
+        console.write("c");
+        CHECK(sink.str() == "\x1b[92;49mc");
+        sink.clear();
+
+        // Writing in the color already in effect costs nothing extra.
+        console.write(ConsoleColor::Green, "d");
+        console.write("d");
+        CHECK(sink.str() == "dd");
+        sink.clear();
+
+        console.writewc(ConsoleColor::Cyan, L"\u00e9\u4e2d");
+        CHECK(sink.str() == "\x1b[96m\xc3\xa9\xe4\xb8\xad");
+        sink.clear();
+
+        // Empty text never switches colors.
+        console.write(ConsoleColor::Violet, "");
+        CHECK(sink.str().empty());
+
+        console.reset_colors();
+        CHECK(console.foreground_color() == ConsoleColor::Default);
+        console.flush();
+        CHECK(sink.str() == "\x1b[39m");
+        sink.clear();
+
+        console.foreground_color(ConsoleColor::DarkYellow);
+        console.write("x");
+        sink.clear();
+    }
+
+    // Destroying the console leaves the terminal in its default colors.
+    CHECK(sink.str() == "\x1b[39m");
+}
+
+static void check_lazy_switching()
+{
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    // Eagerly this would be set, revert, set, revert. Lazily it is one switch.
+    console.write(ConsoleColor::Red, "a");
+    console.write(ConsoleColor::Red, "b");
+    CHECK(sink.str() == "\x1b[91mab");
+    CHECK(console.switch_count() == 1);
+    CHECK(console.avoided_switch_count() == 3);
+
+    // Setters that are overridden before any text is written are never sent.
+    console.foreground_color(ConsoleColor::Blue);
+    console.foreground_color(ConsoleColor::Yellow);
+    console.background_color(ConsoleColor::Gray);
+    console.reset_colors();
+    console.write("c");
+    CHECK(sink.str() == "\x1b[91mab\x1b[39mc");
+    CHECK(console.switch_count() == 2);
+    CHECK(console.avoided_switch_count() == 6);
+}
+
+// Sink counting how many writes reach it. A gather write counts once.
+class CountingSink : public wincc::MemorySink
+{
+public:
+    void write(const char *data, size_t size) override
+    {
+        ++writes;
+        wincc::MemorySink::write(data, size);
+    }
+
+    void writev(const wincc::IoSlice *slices, size_t count) override
+    {
+        ++writes;
+        for (size_t i = 0; i < count; ++i)
+        {
+            wincc::MemorySink::write(slices[i].data, slices[i].size);
+        }
+    }
+
+    int writes = 0;
+};
+
+static void check_frame()
+{
+    CountingSink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    wincc::Frame frame;
+
+    frame.append(ConsoleColor::Red, "a");
+    frame.append(ConsoleColor::Red, "b", 1);
+    frame.append(ConsoleColor::Blue, ConsoleColor::White, "c");
+    frame.append("");
+    frame.append(" d\n");
+    CHECK(frame.segment_count() == 3);
+    CHECK(frame.size() == 6);
+
+    console.commit(frame);
+    CHECK(sink.writes == 1);
+    CHECK(sink.str() == "\x1b[91mab\x1b[94;107mc\x1b[39;49m d\n");
+
+    // A reused frame starts empty, and the colors the console was left in carry over.
+    frame.clear();
+    CHECK(frame.empty());
+    frame.append(ConsoleColor::Default, ConsoleColor::Default, "e");
+    console.commit(frame);
+    CHECK(sink.writes == 2);
+    CHECK(sink.str() == "\x1b[91mab\x1b[94;107mc\x1b[39;49m d\ne");
+
+    // Segments without a background use the console's current one.
+    sink.clear();
+    console.background_color(ConsoleColor::DarkRed);
+    frame.clear();
+    frame.append(ConsoleColor::Yellow, "f");
+    console.commit(frame);
+    CHECK(sink.str() == "\x1b[93;41mf");
+}
+
+// Line of ANSI output with the foreground SGR parameter it was written in.
+struct ColoredLine
+{
+    std::string foreground;
+    std::string text;
+    bool mixed;
+};
+
+// Split ANSI output into lines, tracking the foreground color. A line whose color changes part
+// way through is marked as mixed.
+static std::vector<ColoredLine> split_colored_lines(const std::string &output)
+{
+    std::vector<ColoredLine> lines;
+    std::string foreground = "39";
+    ColoredLine line = { foreground, "", false };
+    bool line_started = false;
+
+    for (size_t i = 0; i < output.size(); ++i)
+    {
+        if (output[i] == '\x1b')
+        {
+            size_t end = output.find('m', i);
+            std::string parameters = output.substr(i + 2, end - i - 2);
+            i = end;
+
+            // Parameters below 40 or from 90 to 97 are foreground colors.
+            size_t start = 0;
+            while (start <= parameters.size())
+            {
+                size_t next = parameters.find(';', start);
+                if (next == std::string::npos)
+                {
+                    next = parameters.size();
+                }
+
+                std::string parameter = parameters.substr(start, next - start);
+                int value = atoi(parameter.c_str());
+                if (value < 40 || (value >= 90 && value < 100))
+                {
+                    foreground = parameter;
+                }
+
+                start = next + 1;
+            }
+
+            continue;
+        }
+
+        if (!line_started)
+        {
+            line.foreground = foreground;
+            line_started = true;
+        }
+        else if (line.foreground != foreground)
+        {
+            line.mixed = true;
+        }
+
+        if (output[i] == '\n')
+        {
+            lines.push_back(line);
+            line = ColoredLine{ foreground, "", false };
+            line_started = false;
+        }
+        else
+        {
+            line.text += output[i];
+        }
+    }
+
+    return lines;
+}
+
+static void check_async_console()
+{
+    const int thread_count = 8;
+    const int lines_per_thread = 2000;
+    const ConsoleColor thread_colors[thread_count] =
+    {
+        ConsoleColor::Blue, ConsoleColor::Green, ConsoleColor::Red, ConsoleColor::Cyan,
+        ConsoleColor::Violet, ConsoleColor::Yellow, ConsoleColor::White, ConsoleColor::DarkCyan
+    };
+    const char *thread_sgr[thread_count] = { "94", "92", "91", "96", "95", "93", "97", "36" };
+
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    {
+        // A small queue makes producers wait on the flusher, and long lines span several slots.
+        wincc::AsyncConsole async(console, 64);
+        std::vector<std::thread> producers;
+
+        for (int t = 0; t < thread_count; ++t)
+        {
+            producers.emplace_back([&async, &thread_colors, t]()
+            {
+                for (int n = 0; n < lines_per_thread; ++n)
+                {
+                    std::string line = "t" + std::to_string(t) + " " + std::to_string(n) + " ";
+                    line.append((size_t)(n * 37 % 300), (char)('a' + t));
+                    line += '\n';
+                    async.write(thread_colors[t], line.c_str());
+                }
+            });
+        }
+
+        for (std::thread &producer : producers)
+        {
+            producer.join();
+        }
+
+        async.flush();
+        CHECK(async.dropped_count() == 0);
+    }
+
+    std::vector<ColoredLine> lines = split_colored_lines(sink.str());
+    CHECK(lines.size() == (size_t)(thread_count * lines_per_thread));
+
+    int next_line[thread_count] = {};
+    int bad_lines = 0;
+
+    for (const ColoredLine &line : lines)
+    {
+        int t = -1;
+        int n = -1;
+        sscanf(line.text.c_str(), "t%d %d", &t, &n);
+
+        bool good = t >= 0 && t < thread_count && !line.mixed && line.foreground == thread_sgr[t] && n == next_line[t];
+        if (good)
+        {
+            std::string expected = "t" + std::to_string(t) + " " + std::to_string(n) + " ";
+            expected.append((size_t)(n * 37 % 300), (char)('a' + t));
+            good = line.text == expected;
+            ++next_line[t];
+        }
+
+        if (!good)
+        {
+            ++bad_lines;
+        }
+    }
+
+    CHECK(bad_lines == 0);
+
+    // With the drop policy a full queue loses records instead of waiting, and every record is
+    // either written or counted.
+    sink.clear();
+    size_t accepted = 0;
+    {
+        wincc::AsyncConsole async(console, 4, wincc::OverflowPolicy::Drop);
+        for (int n = 0; n < 1000; ++n)
+        {
+            accepted += async.write("x\n") ? 1 : 0;
+        }
+
+        async.flush();
+        CHECK(accepted + async.dropped_count() == 1000);
+    }
+    CHECK(split_colored_lines(sink.str()).size() == accepted);
+
+    // Lines longer than half the queue are written in pieces, which other writers must not get
+    // between, and are kept or dropped whole under every policy.
+    const wincc::OverflowPolicy policies[] = { wincc::OverflowPolicy::Block, wincc::OverflowPolicy::Drop };
+    for (wincc::OverflowPolicy policy : policies)
+    {
+        const int long_threads = 4;
+        const int long_lines = 200;
+        std::atomic<size_t> long_accepted(0);
+
+        sink.clear();
+        {
+            wincc::AsyncConsole async(console, 8, policy);
+            std::vector<std::thread> producers;
+
+            for (int t = 0; t < long_threads; ++t)
+            {
+                producers.emplace_back([&async, &thread_colors, &long_accepted, t]()
+                {
+                    for (int n = 0; n < long_lines; ++n)
+                    {
+                        std::string line = "t" + std::to_string(t) + " " + std::to_string(n) + " ";
+                        line.append(4 * wincc::AsyncConsole::k_slot_payload + (size_t)(n * 131 % 2000), (char)('a' + t));
+                        line += '\n';
+                        long_accepted += async.write(thread_colors[t], line.c_str()) ? 1 : 0;
+                    }
+                });
+            }
+
+            for (std::thread &producer : producers)
+            {
+                producer.join();
+            }
+
+            async.flush();
+            CHECK(long_accepted + async.dropped_count() == (size_t)(long_threads * long_lines));
+            CHECK(policy == wincc::OverflowPolicy::Drop || async.dropped_count() == 0);
+        }
+
+        std::vector<ColoredLine> long_output = split_colored_lines(sink.str());
+        CHECK(long_output.size() == long_accepted);
+
+        int bad_long_lines = 0;
+        for (const ColoredLine &line : long_output)
+        {
+            int t = -1;
+            int n = -1;
+            sscanf(line.text.c_str(), "t%d %d", &t, &n);
+
+            std::string expected;
+            if (t >= 0 && t < long_threads)
+            {
+                expected = "t" + std::to_string(t) + " " + std::to_string(n) + " ";
+                expected.append(4 * wincc::AsyncConsole::k_slot_payload + (size_t)(n * 131 % 2000), (char)('a' + t));
+            }
+
+            if (expected.empty() || line.mixed || line.foreground != thread_sgr[t] || line.text != expected)
+            {
+                ++bad_long_lines;
+            }
+        }
+
+        CHECK(bad_long_lines == 0);
+    }
+}
+
+static void check_formatted_write()
+{
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    // Percent signs are plain text, with or without arguments.
+    console.write("100%d%s\n");
+    CHECK(sink.str() == "100%d%s\n");
+    sink.clear();
+
+    console.write("{} {} {} {} {}", 42, -7, 3.5, true, 'x');
+    CHECK(sink.str() == "42 -7 3.5 true x");
+    sink.clear();
+
+    std::string name = "shard-3";
+    console.write(ConsoleColor::Red, "{{{}}} {}%", name, 18446744073709551615ull);
+    CHECK(sink.str() == "\x1b[91m{shard-3} 18446744073709551615%");
+    sink.clear();
+
+    console.writewc(ConsoleColor::Green, ConsoleColor::Black, L"{}: {}", L"w", 7u);
+    CHECK(sink.str() == "\x1b[92;40mw: 7");
+    sink.clear();
+
+    // Formatting into the per-thread buffer happens before colors are switched, and the result is
+    // one write to the sink.
+    CountingSink counting;
+    wincc::Console counted(ConsoleBackend::Ansi, &counting);
+    counted.write("{}-{}", "a", "b");
+    CHECK(counting.writes == 1);
+    CHECK(counting.str() == "a-b");
+}
+
+static void check_styled()
+{
+    const wincc::StyledText &error = wincc::styled<"{Red}[ERROR]{/} ">();
+    CHECK(error.span_count == 2);
+    CHECK(std::string(error.text, 8) == "[ERROR] ");
+    CHECK(std::string(error.ansi, error.ansi_size) == "\x1b[91;49m[ERROR]\x1b[39m ");
+
+    const wincc::StyledText &merged = wincc::styled<"{white on blue}a{white on blue}{{b}}{/}">();
+    CHECK(merged.span_count == 1);
+    CHECK(std::string(merged.ansi, merged.ansi_size) == "\x1b[97;104ma{b}");
+
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    console.write(error);
+    console.write("disk full\n");
+    CHECK(sink.str() == "\x1b[91;49m[ERROR]\x1b[39m disk full\n");
+    sink.clear();
+
+    // Already in the first span's colors, so the leading escape sequence is skipped.
+    console.write(ConsoleColor::Red, "!");
+    console.write(error);
+    CHECK(sink.str() == "\x1b[91m![ERROR]\x1b[39m ");
+}
+
+static void check_markup()
+{
+    // The byte scan must agree with the plain loop at every alignment and length.
+    std::string haystack(100, 'a');
+    for (size_t length = 0; length <= 40; ++length)
+    {
+        for (size_t at = 0; at <= length; ++at)
+        {
+            std::string text = haystack.substr(0, length);
+            if (at < length)
+            {
+                text[at] = '[';
+            }
+
+            const char *begin = text.data();
+            const char *end = begin + text.size();
+            CHECK(wincc::detail::find_byte(begin, end, '[') == wincc::detail::find_byte_scalar(begin, end, '['));
+        }
+    }
+
+    wincc::MarkupTemplate markup("[red]fail[/] in [cyan]{}[/]: [[x] [unknown] [Red]");
+    CHECK(markup.span_count() == 4);
+    wincc::StyledText styled = markup.styled();
+    CHECK(std::string(styled.text) == "fail in {}: [x] [unknown] ");
+    CHECK(std::string(styled.ansi, styled.ansi_size) == "\x1b[91;49mfail\x1b[39m in \x1b[96m{}\x1b[39m: [x] [unknown] ");
+
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    console.write_markup(markup, "shard-3");
+    CHECK(sink.str() == "\x1b[91mfail\x1b[39m in \x1b[96mshard-3\x1b[39m: [x] [unknown] ");
+    sink.clear();
+
+    // Without arguments the placeholder is kept, and the template text is written as parsed.
+    console.write_markup("[white on blue]{}[/]\n");
+    CHECK(sink.str() == "\x1b[97;104m{}\x1b[39;49m\n");
+    sink.clear();
+
+    // Doubled braces are literal whether or not there are arguments.
+    console.write_markup("[red]{{x}}[/] {}\n");
+    console.write_markup("[red]{{x}}[/] {}\n", 7);
+    CHECK(sink.str() == "\x1b[91m{x}\x1b[39m {}\n\x1b[91m{x}\x1b[39m 7\n");
+}
+
+// Minimal terminal that understands what Screen sends: cursor positioning, SGR colors and UTF-8.
+class TerminalModel
+{
+public:
+    struct Cell
+    {
+        char32_t codepoint;
+        int foreground;
+        int background;
+    };
+
+    TerminalModel(int width, int height) :
+        m_width(width),
+        m_cells((size_t)width * height, Cell{ U'?', 0, 0 })
+    {
+    }
+
+    // Apply output and return false if it contained anything the model does not understand.
+    bool feed(const std::string &output)
+    {
+        size_t i = 0;
+        while (i < output.size())
+        {
+            unsigned char c = (unsigned char)output[i];
+
+            if (c == '\x1b')
+            {
+                size_t end = output.find_first_of("Hm", i);
+                if (end == std::string::npos || output[i + 1] != '[')
+                {
+                    return false;
+                }
+
+                std::vector<int> parameters;
+                for (size_t start = i + 2; start < end;)
+                {
+                    parameters.push_back(atoi(output.c_str() + start));
+                    start = output.find(';', start);
+                    start = start < end ? start + 1 : end;
+                }
+
+                if (output[end] == 'H')
+                {
+                    if (parameters.size() != 2)
+                    {
+                        return false;
+                    }
+
+                    m_row = parameters[0] - 1;
+                    m_column = parameters[1] - 1;
+                }
+                else
+                {
+                    for (int parameter : parameters)
+                    {
+                        if ((parameter >= 40 && parameter < 50) || parameter >= 100)
+                        {
+                            m_background = parameter;
+                        }
+                        else
+                        {
+                            m_foreground = parameter;
+                        }
+                    }
+                }
+
+                i = end + 1;
+                continue;
+            }
+
+            char32_t codepoint = c;
+            size_t extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+            if (extra)
+            {
+                codepoint = c & (0x3F >> extra);
+                for (size_t k = 1; k <= extra; ++k)
+                {
+                    codepoint = (codepoint << 6) | ((unsigned char)output[i + k] & 0x3F);
+                }
+            }
+
+            // A wide character takes two columns, the second of which the screen stores as 0.
+            int width = wincc::detail::codepoint_width(codepoint);
+            if (c < 0x20 || width < 1 || m_column + width > m_width || m_row < 0 ||
+                (size_t)(m_row * m_width + m_column) >= m_cells.size())
+            {
+                return false;
+            }
+
+            m_cells[(size_t)m_row * m_width + m_column++] = Cell{ codepoint, m_foreground, m_background };
+            if (width == 2)
+            {
+                m_cells[(size_t)m_row * m_width + m_column++] = Cell{ 0, m_foreground, m_background };
+            }
+            i += extra + 1;
+        }
+
+        return true;
+    }
+
+    // Get a cell.
+    const Cell &at(int row, int column) const { return m_cells[(size_t)row * m_width + column]; }
+
+private:
+    int m_width;
+    std::vector<Cell> m_cells;
+    int m_row = -1;
+    int m_column = -1;
+    int m_foreground = 39;
+    int m_background = 49;
+};
+
+// True if the terminal shows exactly what the screen holds.
+static bool terminal_matches(const TerminalModel &terminal, const wincc::Screen &screen)
+{
+    for (int row = 0; row < screen.height(); ++row)
+    {
+        for (int column = 0; column < screen.width(); ++column)
+        {
+            const TerminalModel::Cell &cell = terminal.at(row, column);
+            if (cell.codepoint != screen.codepoint(row, column) ||
+                cell.foreground != wincc::detail::k_sgr_color_codes[(int)screen.foreground(row, column)] ||
+                cell.background != wincc::detail::k_sgr_color_codes[(int)screen.background(row, column)] + 10)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void check_screen()
+{
+    const int width = 24;
+    const int height = 8;
+    const char32_t glyphs[] = { U'a', U'Z', U'7', U'中', U'#', U'é', U'█', U'\U0001F600' };
+    const ConsoleColor colors[] = { ConsoleColor::Default, ConsoleColor::Red, ConsoleColor::Cyan, ConsoleColor::DarkBlue };
+
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    wincc::Screen screen(width, height);
+    TerminalModel terminal(width, height);
+
+    // The first present draws every cell.
+    screen.write(0, 0, "status: ok", ConsoleColor::Green);
+    screen.present(console);
+    CHECK(screen.last_changed_cells() == (size_t)width * height);
+    CHECK(terminal.feed(sink.str()));
+    CHECK(terminal_matches(terminal, screen));
+    sink.clear();
+
+    // Random small and large deltas must keep the terminal in sync.
+    unsigned int seed = 12345;
+    auto next = [&seed](unsigned int bound)
+    {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % bound;
+    };
+
+    bool all_fed = true;
+    bool all_matched = true;
+    for (int frame = 0; frame < 200; ++frame)
+    {
+        int changes = frame % 10 == 0 ? width * height : (int)next(12);
+        for (int n = 0; n < changes; ++n)
+        {
+            screen.put((int)next(height), (int)next(width), glyphs[next(8)], colors[next(4)], colors[next(4)]);
+        }
+
+        screen.present(console);
+        all_fed = all_fed && terminal.feed(sink.str());
+        all_matched = all_matched && terminal_matches(terminal, screen);
+        sink.clear();
+    }
+    CHECK(all_fed);
+    CHECK(all_matched);
+
+    // Nothing changed, nothing sent.
+    screen.present(console);
+    CHECK(sink.str().empty());
+
+    // One changed cell costs a cursor move, its colors and itself.
+    screen.clear();
+    screen.present(console);
+    CHECK(terminal.feed(sink.str()));
+    sink.clear();
+    screen.put(3, 5, U'x', ConsoleColor::Red);
+    screen.present(console);
+    CHECK(screen.last_changed_cells() == 1);
+    CHECK(sink.str() == "\x1b[4;6H\x1b[91mx");
+    CHECK(terminal.feed(sink.str()));
+    sink.clear();
+
+    // Nearby changes on a row share one cursor move.
+    screen.put(3, 8, U'y', ConsoleColor::Red);
+    screen.put(3, 10, U'z', ConsoleColor::Red);
+    screen.present(console);
+    CHECK(sink.str() == "\x1b[4;9Hy\x1b[39m \x1b[91mz");
+    CHECK(terminal.feed(sink.str()));
+    sink.clear();
+
+    // Text is clipped at the right edge and control characters become spaces.
+    CHECK(screen.write(1, width - 3, "abcdef", ConsoleColor::Default) == 3);
+    screen.put(2, 0, U'\n', ConsoleColor::Default);
+    CHECK(screen.codepoint(2, 0) == U' ');
+    screen.present(console);
+    CHECK(terminal.feed(sink.str()));
+    CHECK(terminal_matches(terminal, screen));
+    sink.clear();
+
+    // C1 controls and zero-width marks become spaces, and surrogates the replacement character.
+    screen.put(2, 0, (char32_t)0x85, ConsoleColor::Default);
+    screen.put(2, 1, (char32_t)0xD800, ConsoleColor::Default);
+    screen.put(2, 2, U'\u0301', ConsoleColor::Default);
+    CHECK(screen.codepoint(2, 0) == U' ' && screen.codepoint(2, 1) == U'\uFFFD' && screen.codepoint(2, 2) == U' ');
+
+    // Wide characters take two cells and are sent whole, even when only their right half changed.
+    CHECK(screen.write(2, 4, "中x\U0001F600", ConsoleColor::Yellow) == 5);
+    CHECK(screen.codepoint(2, 4) == U'中' && screen.codepoint(2, 5) == 0 && screen.codepoint(2, 6) == U'x');
+    CHECK(screen.write(2, width - 1, "中", ConsoleColor::Yellow) == 1);
+    CHECK(screen.codepoint(2, width - 1) == U' ');
+    screen.present(console);
+    CHECK(terminal.feed(sink.str()));
+    CHECK(terminal_matches(terminal, screen));
+    sink.clear();
+
+    screen.put(2, 5, U'y', ConsoleColor::Red);
+    CHECK(screen.codepoint(2, 4) == U' ');
+    screen.present(console);
+    CHECK(sink.str() == "\x1b[3;5H \x1b[91my");
+    CHECK(terminal.feed(sink.str()));
+    CHECK(terminal_matches(terminal, screen));
+    sink.clear();
+
+    // After invalidate everything is redrawn.
+    screen.invalidate();
+    screen.present(console);
+    CHECK(screen.last_changed_cells() == (size_t)width * height);
+    CHECK(terminal.feed(sink.str()));
+    CHECK(terminal_matches(terminal, screen));
+}
+
+// Read a whole file.
+static std::string read_file(const char *path)
+{
+    std::string contents;
+    FILE *file = fopen(path, "rb");
+
+    if (file)
+    {
+        char buffer[4096];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            contents.append(buffer, size);
+        }
+
+        fclose(file);
+    }
+
+    return contents;
+}
+
+static void check_sinks()
+{
+    const char *path = "wincc_check_sinks.txt";
+
+    {
+        wincc::FdSink sink(path, 64);
+        CHECK(sink.is_open());
+        CHECK(!sink.is_terminal());
+
+        // Small writes stay in the buffer until it reaches the threshold.
+        sink.write("0123456789", 10);
+        CHECK(sink.pending() == 10);
+        CHECK(read_file(path).empty());
+
+        std::string line(60, 'x');
+        sink.write(line.data(), line.size());
+        CHECK(sink.pending() == 60);
+        CHECK(read_file(path).size() == 10);
+
+        // Writes at least as big as the threshold go straight through.
+        std::string block(100, 'y');
+        sink.write(block.data(), block.size());
+        CHECK(sink.pending() == 0);
+        CHECK(read_file(path).size() == 170);
+
+        sink.write("tail", 4);
+        sink.flush();
+        CHECK(read_file(path).size() == 174);
+    }
+
+    {
+        // A file is not a terminal, so Auto drops the colors.
+        wincc::FdSink sink(path);
+        wincc::Console console(ConsoleBackend::Auto, &sink);
+        CHECK(console.backend() == ConsoleBackend::Plain);
+
+        console.write(ConsoleColor::Red, "red ");
+        console.write(ConsoleColor::White, ConsoleColor::DarkBlue, "{} ", 42);
+        console.write(wincc::styled<"{red}[ERROR]{/} ">());
+        console.write_markup("[cyan]cyan[/]\n");
+        console.move_cursor(3, 4);
+
+        wincc::Frame frame;
+        frame.append(ConsoleColor::Green, "frame");
+        frame.move_cursor(0, 0);
+        frame.append(ConsoleColor::Yellow, "\n");
+        console.commit(frame);
+
+        CHECK(sink.pending() > 0);
+        CHECK(read_file(path).empty());
+    }
+
+    // Everything is flushed when the sink goes away.
+    CHECK(read_file(path) == "red 42 [ERROR] cyan\nframe\n");
+
+    {
+        // Small gather writes are buffered like small writes.
+        wincc::FdSink sink(path, 64);
+        const wincc::IoSlice small[] = { { "ab", 2 }, { "", 0 }, { "cde", 3 } };
+        sink.writev(small, 3);
+        CHECK(sink.pending() == 5);
+        CHECK(read_file(path).empty());
+
+        // Large ones go out behind the buffered bytes, in more slices than one writev takes.
+        std::string expected = "abcde";
+        std::vector<std::string> pieces;
+        for (int i = 0; i < 3000; ++i)
+        {
+            pieces.push_back(std::string(1 + i % 3, (char)('a' + i % 26)));
+            expected += pieces.back();
+        }
+
+        std::vector<wincc::IoSlice> slices;
+        for (const std::string &piece : pieces)
+        {
+            slices.push_back(wincc::IoSlice{ piece.data(), piece.size() });
+        }
+
+        sink.writev(slices.data(), slices.size());
+        CHECK(sink.pending() == 0);
+        CHECK(read_file(path) == expected);
+    }
+
+    {
+        // A large colored payload reaches the file as the switch followed by the caller's bytes.
+        wincc::FdSink sink(path, 64);
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        std::string payload(1 << 20, 'p');
+        console.write(ConsoleColor::Red, payload.c_str());
+        CHECK(sink.pending() == 0);
+        CHECK(read_file(path) == "\x1b[91m" + payload);
+    }
+    remove(path);
+
+    wincc::MemorySink memory;
+    wincc::Console console(ConsoleBackend::Auto, &memory);
+    CHECK(console.backend() == ConsoleBackend::Plain);
+}
+
+// Append a code point as UTF-8, the way the converter should.
+static void append_expected_utf8(char32_t cp, std::string &out)
+{
+    char encoded[4];
+    size_t size;
+
+    if (cp < 0x80)
+    {
+        encoded[0] = (char)cp;
+        size = 1;
+    }
+    else if (cp < 0x800)
+    {
+        encoded[0] = (char)(0xC0 | (cp >> 6));
+        encoded[1] = (char)(0x80 | (cp & 0x3F));
+        size = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        encoded[0] = (char)(0xE0 | (cp >> 12));
+        encoded[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        encoded[2] = (char)(0x80 | (cp & 0x3F));
+        size = 3;
+    }
+    else
+    {
+        encoded[0] = (char)(0xF0 | (cp >> 18));
+        encoded[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        encoded[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        encoded[3] = (char)(0x80 | (cp & 0x3F));
+        size = 4;
+    }
+
+    out.append(encoded, size);
+}
+
+// Convert with both converters and check them against the expected bytes.
+static bool converts_to(const std::wstring &text, const std::string &expected)
+{
+    std::string fast(text.size() * wincc::detail::k_max_utf8_per_wchar + 1, '\0');
+    std::string scalar(fast.size(), '\0');
+
+    fast.resize(wincc::detail::utf8_from_wide(text.data(), text.size(), &fast[0]));
+    scalar.resize(wincc::detail::utf8_from_wide_scalar(text.data(), text.size(), &scalar[0]));
+    return fast == expected && scalar == expected;
+}
+
+static void check_utf8()
+{
+    // Blocks of ASCII, of two-byte characters, of mixtures, of wider characters, and of code
+    // points needing surrogate pairs, at every length so each block size and tail is reached.
+    const char32_t samples[][4] =
+    {
+        { U'a', U'Z', U'0', U'~' },
+        { U'é', U'Ω', U'Ж', U'߿' },
+        { U'a', U'é', U'b', U'\u0080' },
+        { U'中', U'ࠀ', U'￮', U'x' },
+        { U'\U0001F600', U'\U00010000', U'\U0010FFFF', U'é' },
+    };
+
+    bool all_converted = true;
+    for (const auto &sample : samples)
+    {
+        for (size_t length = 0; length <= 70; ++length)
+        {
+            std::wstring text;
+            std::string expected;
+
+            for (size_t i = 0; i < length; ++i)
+            {
+                char32_t cp = sample[(i * 7 / 5) % 4];
+
+                // Mostly the sample's first character, so some blocks are uniform.
+                if (i % 19 != 18)
+                {
+                    cp = sample[0];
+                }
+
+                if (sizeof(wchar_t) == 2 && cp >= 0x10000)
+                {
+                    text += (wchar_t)(0xD800 + ((cp - 0x10000) >> 10));
+                    text += (wchar_t)(0xDC00 + ((cp - 0x10000) & 0x3FF));
+                }
+                else
+                {
+                    text += (wchar_t)cp;
+                }
+
+                append_expected_utf8(cp, expected);
+            }
+
+            all_converted = all_converted && converts_to(text, expected);
+        }
+    }
+    CHECK(all_converted);
+
+    // Invalid code units become U+FFFD.
+    std::wstring invalid(20, L'a');
+    invalid[3] = (wchar_t)0xD800;
+    invalid[17] = (wchar_t)0xDC00;
+    CHECK(converts_to(invalid, "aaa\xef\xbf\xbd" + std::string(13, 'a') + "\xef\xbf\xbd" "aa"));
+
+    // Narrow and wide writes mix freely, and formatted wide writes convert too.
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+    console.write("caf");
+    console.writewc(L"é ");
+    console.writewc(ConsoleColor::Red, L"中文");
+    console.write(" ok ");
+    console.writewc(L"{} ✓\n", 42);
+    CHECK(sink.str() == "caf\xc3\xa9 \x1b[91m\xe4\xb8\xad\xe6\x96\x87\x1b[39m ok 42 \xe2\x9c\x93\n");
+}
+
+// A byte of parsed text with its colors.
+struct ParsedChar
+{
+    char c;
+    ConsoleColor foreground;
+    ConsoleColor background;
+
+    bool operator==(const ParsedChar &other) const
+    {
+        return c == other.c && foreground == other.foreground && background == other.background;
+    }
+};
+
+// Feed input to a parser in chunks of random sizes, flattening the spans into characters.
+static std::vector<ParsedChar> parse_in_chunks(const std::string &input, unsigned int &seed, size_t max_chunk)
+{
+    wincc::AnsiParser parser;
+    std::vector<ParsedChar> parsed;
+    size_t pos = 0;
+
+    while (pos < input.size())
+    {
+        seed = seed * 1103515245 + 12345;
+        size_t chunk = 1 + (seed >> 16) % max_chunk;
+        if (chunk > input.size() - pos)
+        {
+            chunk = input.size() - pos;
+        }
+
+        for (const wincc::AnsiSpan &span : parser.feed(input.data() + pos, chunk))
+        {
+            for (size_t i = 0; i < span.size; ++i)
+            {
+                parsed.push_back(ParsedChar{ span.text[i], span.foreground, span.background });
+            }
+        }
+
+        pos += chunk;
+    }
+
+    return parsed;
+}
+
+static void check_parser()
+{
+    wincc::AnsiParser parser;
+
+    const char basic[] = "\x1b[31mred\x1b[0m plain \x1b[1;97;44mX\x1b[39m.";
+    const std::vector<wincc::AnsiSpan> &spans = parser.feed(basic, sizeof(basic) - 1);
+    CHECK(spans.size() == 4);
+    CHECK(spans.size() == 4 && std::string(spans[0].text, spans[0].size) == "red" && spans[0].foreground == ConsoleColor::DarkRed);
+    CHECK(spans.size() == 4 && std::string(spans[1].text, spans[1].size) == " plain " && spans[1].foreground == ConsoleColor::Default);
+    CHECK(spans.size() == 4 && spans[2].foreground == ConsoleColor::White && spans[2].background == ConsoleColor::DarkBlue);
+    CHECK(spans.size() == 4 && spans[3].foreground == ConsoleColor::Default && spans[3].background == ConsoleColor::DarkBlue);
+
+    // Extended colors map to the nearest color, and other sequences are dropped.
+    parser.reset();
+    const char extended[] = "\x1b[38;5;196m\x1b[48;2;0;0;230m\x1b]0;title\x07\x1b[2J\x1b(B\x1b[?25lz";
+    const std::vector<wincc::AnsiSpan> &extended_spans = parser.feed(extended, sizeof(extended) - 1);
+    CHECK(extended_spans.size() == 1 && extended_spans[0].size == 1 && extended_spans[0].text[0] == 'z');
+    CHECK(parser.foreground() == ConsoleColor::Red && parser.background() == ConsoleColor::DarkBlue);
+
+    // Colon sub-parameters stay with their code, with or without the color space field.
+    const char *colon_forms[] =
+    {
+        "\x1b[38:2:255:0:0mr", "\x1b[38:2::255:0:0mr", "\x1b[1;38:2::255:0:0;4:3mr", "\x1b[38:5:196mr"
+    };
+    for (const char *form : colon_forms)
+    {
+        parser.reset();
+        const std::vector<wincc::AnsiSpan> &colon_spans = parser.feed(form, strlen(form));
+        CHECK(colon_spans.size() == 1 && colon_spans[0].foreground == ConsoleColor::Red &&
+            colon_spans[0].background == ConsoleColor::Default);
+    }
+
+    parser.reset();
+    const char colon_background[] = "\x1b[48:2::0:0:230;38:2:255:0:0mb";
+    parser.feed(colon_background, sizeof(colon_background) - 1);
+    CHECK(parser.foreground() == ConsoleColor::Red && parser.background() == ConsoleColor::DarkBlue);
+
+    // Control characters inside a sequence are not swallowed.
+    parser.reset();
+    const char controls[] = "a\x1b\nb\x1b[3\r1mc";
+    const std::vector<wincc::AnsiSpan> &control_spans = parser.feed(controls, sizeof(controls) - 1);
+    std::string control_text;
+    for (const wincc::AnsiSpan &span : control_spans)
+    {
+        control_text.append(span.text, span.size);
+    }
+    CHECK(control_text == "a\nb\rc" && parser.foreground() == ConsoleColor::DarkRed);
+
+    // Output written by a console parses back into the same colors, however it is chunked.
+    const ConsoleColor colors[] =
+    {
+        ConsoleColor::Black, ConsoleColor::Blue, ConsoleColor::Green, ConsoleColor::Red, ConsoleColor::DarkBlue,
+        ConsoleColor::DarkGreen, ConsoleColor::DarkRed, ConsoleColor::Cyan, ConsoleColor::Violet, ConsoleColor::Yellow,
+        ConsoleColor::DarkCyan, ConsoleColor::DarkViolet, ConsoleColor::DarkYellow, ConsoleColor::White,
+        ConsoleColor::Gray, ConsoleColor::DarkGray, ConsoleColor::Default
+    };
+
+    unsigned int seed = 777;
+    auto next = [&seed](unsigned int bound)
+    {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % bound;
+    };
+
+    bool round_trips = true;
+    for (int round = 0; round < 50; ++round)
+    {
+        wincc::MemorySink sink;
+        std::vector<ParsedChar> expected;
+        {
+            wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+            for (int n = 0; n < 40; ++n)
+            {
+                ConsoleColor foreground = colors[next(17)];
+                ConsoleColor background = colors[next(17)];
+                std::string text(1 + next(12), (char)('a' + next(26)));
+
+                console.write(foreground, background, text.c_str());
+                for (char c : text)
+                {
+                    expected.push_back(ParsedChar{ c, foreground, background });
+                }
+            }
+        }
+
+        round_trips = round_trips && parse_in_chunks(sink.str(), seed, 1 + round) == expected;
+    }
+    CHECK(round_trips);
+
+    // RGB colors in the semicolon and both colon forms parse to the same color.
+    bool forms_agree = true;
+    for (int round = 0; round < 200; ++round)
+    {
+        unsigned int red = next(256), green = next(256), blue = next(256);
+        char forms[3][64];
+        snprintf(forms[0], sizeof(forms[0]), "\x1b[38;2;%u;%u;%u;48;5;%umx", red, green, blue, next(256));
+        snprintf(forms[1], sizeof(forms[1]), "\x1b[38:2:%u:%u:%u;48;5;%umx", red, green, blue, next(256));
+        snprintf(forms[2], sizeof(forms[2]), "\x1b[38:2::%u:%u:%u;48;5;%umx", red, green, blue, next(256));
+
+        ConsoleColor expected = wincc::Color::rgb((unsigned char)red, (unsigned char)green, (unsigned char)blue).console_color();
+        for (const char *form : forms)
+        {
+            parser.reset();
+            const std::vector<wincc::AnsiSpan> &form_spans = parser.feed(form, strlen(form));
+            forms_agree = forms_agree && form_spans.size() == 1 && form_spans[0].foreground == expected;
+        }
+    }
+    CHECK(forms_agree);
+
+    // Random bytes heavy in escape characters parse the same however they are chunked, and no
+    // escape byte leaks into the text.
+    const char alphabet[] = "\x1b\x1b\x1b[[[];;;0123456789mmmH\x07\\?:ab\n";
+    bool chunking_agrees = true;
+    bool no_escape_leaks = true;
+    for (int round = 0; round < 500; ++round)
+    {
+        std::string input;
+        size_t length = next(400);
+        for (size_t i = 0; i < length; ++i)
+        {
+            input += next(8) == 0 ? (char)next(256) : alphabet[next(sizeof(alphabet) - 1)];
+        }
+
+        std::vector<ParsedChar> whole = parse_in_chunks(input, seed, input.size() + 1);
+        chunking_agrees = chunking_agrees && parse_in_chunks(input, seed, 1) == whole &&
+            parse_in_chunks(input, seed, 7) == whole;
+
+        for (const ParsedChar &parsed : whole)
+        {
+            no_escape_leaks = no_escape_leaks && parsed.c != '\x1b';
+        }
+    }
+    CHECK(chunking_agrees);
+    CHECK(no_escape_leaks);
+
+    // Relaying re-renders the colors, or strips them on a plain console.
+    const char colored[] = "\x1b[91mfail\x1b[0m ok\n";
+    wincc::MemorySink ansi_sink;
+    wincc::MemorySink plain_sink;
+    {
+        wincc::Console ansi(ConsoleBackend::Ansi, &ansi_sink);
+        wincc::Console plain(ConsoleBackend::Plain, &plain_sink);
+        parser.reset();
+        parser.relay(ansi, colored, sizeof(colored) - 1);
+        parser.reset();
+        parser.relay(plain, colored, sizeof(colored) - 1);
+    }
+    CHECK(ansi_sink.str() == "\x1b[91mfail\x1b[39m ok\n");
+    CHECK(plain_sink.str() == "fail ok\n");
+}
+
+// Distance from an RGB value to a palette color, for comparing against an exhaustive search.
+static double palette_distance(int red, int green, int blue, ConsoleColor color)
+{
+    const unsigned char *rgb = wincc::detail::k_color_rgb[(int)color];
+    return sqrt((double)((red - rgb[0]) * (red - rgb[0]) + (green - rgb[1]) * (green - rgb[1]) +
+        (blue - rgb[2]) * (blue - rgb[2])));
+}
+
+static void check_colors()
+{
+    using wincc::Color;
+
+    // Palette colors quantize to themselves.
+    bool palette_exact = true;
+    for (int i = 0; i < (int)ConsoleColor::Default; ++i)
+    {
+        const unsigned char *rgb = wincc::detail::k_color_rgb[i];
+        palette_exact = palette_exact && Color::rgb(rgb[0], rgb[1], rgb[2]).console_color() == (ConsoleColor)i;
+        palette_exact = palette_exact && Color((ConsoleColor)i).console_color() == (ConsoleColor)i;
+    }
+    CHECK(palette_exact);
+    CHECK(Color().console_color() == ConsoleColor::Default);
+    CHECK(Color::indexed(8).console_color() == ConsoleColor::DarkGray);
+    CHECK(Color::indexed(196).console_color() == ConsoleColor::Red);
+    CHECK(Color::indexed(255).console_color() == ConsoleColor::Gray);
+
+    // The table is never much worse than searching the palette for every color: at most the
+    // distance between a value and the center of its table cell, twice.
+    double worst = 0;
+    for (int red = 0; red < 256; red += 5)
+    {
+        for (int green = 0; green < 256; green += 3)
+        {
+            for (int blue = 0; blue < 256; blue += 7)
+            {
+                double best = 1e9;
+                for (int i = 0; i < (int)ConsoleColor::Default; ++i)
+                {
+                    best = std::min(best, palette_distance(red, green, blue, (ConsoleColor)i));
+                }
+
+                ConsoleColor found = Color::rgb((unsigned char)red, (unsigned char)green, (unsigned char)blue).console_color();
+                worst = std::max(worst, palette_distance(red, green, blue, found) - best);
+            }
+        }
+    }
+    CHECK(worst <= 2 * sqrt(3.0) * 4);
+
+    // Rows quantize the same as single colors, whatever mix of kinds and length they have.
+    std::vector<Color> row;
+    for (int i = 0; i < 61; ++i)
+    {
+        if (i % 13 == 5)
+        {
+            row.push_back(Color::indexed((unsigned char)(i * 4)));
+        }
+        else if (i % 17 == 3)
+        {
+            row.push_back(Color((ConsoleColor)(i % 17)));
+        }
+        else
+        {
+            row.push_back(Color::rgb((unsigned char)(i * 37), (unsigned char)(i * 11), (unsigned char)(255 - i * 3)));
+        }
+    }
+
+    bool rows_match = true;
+    for (size_t length = 0; length <= row.size(); ++length)
+    {
+        std::vector<ConsoleColor> quantized(length), scalar(length);
+        wincc::quantize(row.data(), length, quantized.data());
+        wincc::detail::quantize_scalar(row.data(), length, scalar.data());
+
+        for (size_t i = 0; i < length; ++i)
+        {
+            rows_match = rows_match && quantized[i] == row[i].console_color() && scalar[i] == quantized[i];
+        }
+    }
+    CHECK(rows_match);
+
+    // Terminals with 24-bit color get the exact color. Both colors are set, and the next switch
+    // sets both again since the console no longer knows what the terminal is showing.
+    wincc::MemorySink sink;
+    {
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        console.color_depth(wincc::ColorDepth::TrueColor);
+
+        console.write(ConsoleColor::DarkGray, "g");
+        CHECK(sink.str() == "\x1b[90mg");
+        sink.clear();
+
+        console.write(Color::rgb(1, 2, 3), "a");
+        console.write(Color::rgb(1, 2, 3), "b");
+        CHECK(sink.str() == "\x1b[38;2;1;2;3;49mab");
+        console.write(Color::indexed(208), Color::rgb(255, 0, 128), "c");
+        console.write(ConsoleColor::Red, "d");
+        CHECK(sink.str() == "\x1b[38;2;1;2;3;49mab\x1b[38;5;208;48;2;255;0;128mc\x1b[91;49md");
+        CHECK(console.switch_count() == 4);
+        sink.clear();
+
+        // 256-color terminals get the nearest palette entry.
+        console.color_depth(wincc::ColorDepth::Indexed);
+        console.write(Color::rgb(255, 0, 0), Color::rgb(128, 128, 130), "e");
+        CHECK(sink.str() == "\x1b[38;5;196;48;5;244me");
+        sink.clear();
+
+        // Others get the nearest ConsoleColor.
+        console.color_depth(wincc::ColorDepth::Basic);
+        console.write(Color::rgb(250, 10, 0), "f");
+        CHECK(sink.str() == "\x1b[91;49mf");
+        sink.clear();
+    }
+    CHECK(sink.str() == "\x1b[39m");
+
+    // Plain consoles drop extended colors like any other.
+    sink.clear();
+    {
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        console.color_depth(wincc::ColorDepth::TrueColor);
+        console.write(Color::rgb(1, 2, 3), "plain");
+    }
+    CHECK(sink.str() == "plain");
+}
+
+static void check_stats()
+{
+    CountingSink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    console.write(ConsoleColor::Red, "ab");
+    console.write(ConsoleColor::Red, "cd");
+    console.write("e");
+
+    wincc::Frame frame;
+    frame.append(ConsoleColor::Green, "f");
+    frame.append("g");
+    console.commit(frame);
+    console.flush();
+
+    wincc::ConsoleStats stats = console.stats();
+
+#ifdef WINCC_ENABLE_STATS
+    CHECK(stats.writes == (uint64_t)sink.writes);
+    CHECK(stats.bytes == sink.str().size());
+    CHECK(stats.switches == console.switch_count());
+    CHECK(stats.avoided_switches == console.avoided_switch_count());
+    CHECK(stats.flushes == 1);
+
+    uint64_t timed = 0;
+    for (uint64_t count : stats.latency)
+    {
+        timed += count;
+    }
+    CHECK(timed == stats.writes + stats.flushes);
+    CHECK(stats.latency_percentile(0.5) > 0 && stats.latency_percentile(0.5) <= stats.latency_percentile(1.0));
+
+    // Resetting starts the counters over without touching switch_count.
+    size_t switches = console.switch_count();
+    console.reset_stats();
+    stats = console.stats();
+    CHECK(stats.writes == 0 && stats.bytes == 0 && stats.switches == 0 && stats.flushes == 0);
+    CHECK(stats.latency_percentile(0.99) == 0);
+    CHECK(console.switch_count() == switches);
+
+    console.write(ConsoleColor::Blue, "h");
+    stats = console.stats();
+    CHECK(stats.writes == 1 && stats.bytes == 6 && stats.switches == 1);
+#else
+    CHECK(stats.writes == 0 && stats.bytes == 0 && stats.switches == 0 && stats.flushes == 0);
+    CHECK(stats.latency_percentile(0.5) == 0);
+#endif
+}
+
+static void check_basic_console()
+{
+    // Without colors the console is nothing but the stream.
+    static_assert(sizeof(wincc::BasicConsole<wincc::backend::NoColor>) == sizeof(FILE *));
+
+    const char *path = "wincc_check_basic.txt";
+
+    FILE *file = fopen(path, "wb");
+    {
+        wincc::BasicConsole<wincc::backend::Ansi> console{ wincc::backend::Ansi(file) };
+        console.write(ConsoleColor::Red, "a");
+        console.write(ConsoleColor::Red, "b");
+        console.write("c");
+        console.foreground_color(ConsoleColor::Blue);
+        console.foreground_color(ConsoleColor::Green);
+        console.write(ConsoleColor::Green, ConsoleColor::DarkBlue, "");
+        console.writewc(L"d\u00e9");
+        console.write(ConsoleColor::Default, "{}", 7);
+        CHECK(console.foreground_color() == ConsoleColor::Green);
+    }
+    fclose(file);
+
+    // One switch per change of colors, none for the empty write, and back to default at the end.
+    CHECK(read_file(path) == "\x1b[91mab\x1b[39mc\x1b[92md\xc3\xa9\x1b[39m7");
+
+    file = fopen(path, "wb");
+    {
+        wincc::BasicConsole<wincc::backend::NoColor> console{ wincc::backend::NoColor(file) };
+        console.foreground_color(ConsoleColor::Red);
+        console.write(ConsoleColor::Green, ConsoleColor::DarkBlue, "plain ");
+        console.writewc(ConsoleColor::Cyan, L"{} text", 2);
+        CHECK(console.foreground_color() == ConsoleColor::Default);
+    }
+    fclose(file);
+    CHECK(read_file(path) == "plain 2 text");
+
+    {
+        wincc::BasicConsole<wincc::backend::Null> console;
+        console.write(ConsoleColor::Red, "{} dropped", 1);
+        console.writewc(L"dropped");
+        console.flush();
+    }
+
+    remove(path);
+}
+
+static void check_progress()
+{
+    {
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::ProgressBar bar(console, "job", 10, 4);
+
+        // Updates alone draw nothing.
+        bar.add(5);
+        CHECK(sink.str().empty());
+
+        // The first tick draws, and the next one waits for the frame interval.
+        CHECK(bar.tick());
+        CHECK(!bar.tick());
+        CHECK(sink.str() == "\rjob [\x1b[92m==\x1b[90m--\x1b[39m] \x1b[96m 50%\x1b[39m 5/10");
+
+        // The final redraw rewrites the line and ends it. Later ticks and finishes do nothing.
+        sink.clear();
+        bar.add(5);
+        bar.finish();
+        bar.finish();
+        CHECK(!bar.tick());
+        CHECK(sink.str() == "\rjob [\x1b[92m====\x1b[39m] \x1b[96m100%\x1b[39m 10/10\n");
+    }
+
+    {
+        // A shorter line is padded over what the last one left.
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::ProgressBar bar(console, "", 1000, 1);
+        bar.add(1000);
+        bar.tick();
+        bar.total(1);
+        sink.clear();
+        bar.finish();
+        CHECK(sink.str() == "\r[\x1b[92m=\x1b[39m] \x1b[96m100%\x1b[39m 1/1      \n");
+    }
+
+    {
+        // Without a terminal, widgets write plain summary lines instead.
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        wincc::ProgressBar bar(console, "job", 10);
+        wincc::Spinner spinner(console, "scan");
+
+        bar.add(3);
+        spinner.add(7);
+        CHECK(!bar.tick() && !spinner.tick());
+
+        bar.summary_interval(0);
+        spinner.summary_interval(0);
+        CHECK(bar.tick() && spinner.tick());
+        CHECK(sink.str() == "job: 3/10 (30%)\nscan: 7\n");
+
+        sink.clear();
+        bar.finish();
+        spinner.finish();
+        CHECK(sink.str() == "job: 3/10 (30%)\nscan: 7\n");
+    }
+
+    {
+        // Many threads updating while the widget redraws on its own thread.
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::Spinner spinner(console, "work");
+        spinner.frame_rate(1000);
+        spinner.start();
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&spinner]()
+            {
+                for (int n = 0; n < 100000; ++n)
+                {
+                    spinner.add();
+                    spinner.tick();
+                }
+            });
+        }
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+
+        spinner.finish();
+        CHECK(spinner.done() == 400000);
+
+        const std::string &text = sink.str();
+        CHECK(text.size() > 8 && text.compare(text.size() - 8, 8, " 400000\n") == 0);
+    }
+}
+
+static void check_table()
+{
+    using wincc::detail::display_width;
+
+    CHECK(display_width("") == 0);
+    CHECK(display_width("shard-17 served 18234 requests") == 30);
+    CHECK(display_width("\xe6\xbc\xa2\xe5\xad\x97") == 4);
+    CHECK(display_width("cafe\xcc\x81") == 4);
+    CHECK(display_width("\xf0\x9f\x98\x80 ok") == 5);
+    CHECK(display_width("\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd") == 2);
+    CHECK(display_width("0123456789abcdef\xe4\xb8\xad" "0123456789abcdef") == 34);
+
+    size_t used;
+    CHECK(wincc::detail::fit_width("\xe6\xbc\xa2\xe5\xad\x97x", 3, used) == 3 && used == 2);
+
+    {
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        wincc::Table table;
+        table.add_column("shard");
+        table.add_column("req/s", wincc::Align::Right);
+        table.add_column("region", wincc::Align::Center);
+
+        table.add_row();
+        table.add_cell("api-7");
+        table.add_cell(ConsoleColor::Cyan, "18234");
+        table.add_cell("\xe6\x9d\xb1\xe4\xba\xac");
+
+        table.add_row();
+        table.add_cell("\xe6\xbc\xa2");
+        table.add_cell(ConsoleColor::Red, ConsoleColor::Default, wincc::Align::Left, "3");
+
+        CHECK(table.column_width(0) == 5 && table.column_width(1) == 5 && table.column_width(2) == 6);
+        table.render(console);
+        CHECK(table.row_count() == 0);
+        CHECK(sink.str() ==
+            "shard  req/s  region\n"
+            "-----  -----  ------\n"
+            "api-7  18234   \xe6\x9d\xb1\xe4\xba\xac\n"
+            "\xe6\xbc\xa2     3    \n");
+    }
+
+    {
+        // Neighboring cells in the same colors reach the terminal as one run.
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        wincc::Table table;
+        table.add_column("a");
+        table.add_column("b");
+        table.add_row();
+        table.add_cell(ConsoleColor::White, ConsoleColor::DarkBlue, "x");
+        table.add_cell(ConsoleColor::White, ConsoleColor::DarkBlue, "y");
+        table.render(console);
+        CHECK(sink.str() == "a  b\n\x1b[90m-\x1b[39m  \x1b[90m-\x1b[39m\n\x1b[97;44mx\x1b[39;49m  \x1b[97;44my\x1b[39;49m\n");
+    }
+
+    {
+        // A stream fixes widths from the sample and cuts wider cells after it.
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        wincc::Table table;
+        table.add_column("id", wincc::Align::Right);
+        table.add_column("name");
+        table.stream(console, 2);
+
+        table.add_row();
+        table.add_cell("1");
+        table.add_cell("abc");
+        table.add_row();
+        table.add_cell("2");
+        table.add_cell("abcd");
+        CHECK(sink.str().empty());
+
+        table.add_row();
+        table.add_cell("300");
+        table.add_cell("\xe6\xbc\xa2\xe5\xad\x97\xe5\xad\x97");
+        CHECK(table.row_count() == 1);
+
+        table.finish();
+        CHECK(sink.str() ==
+            "id  name\n"
+            "--  ----\n"
+            " 1  abc\n"
+            " 2  abcd\n"
+            "30  \xe6\xbc\xa2\xe5\xad\x97\n");
+    }
+}
+
+static void check_record()
+{
+    // Write the same lines to a recording, an ANSI console and a plain one.
+    auto write_lines = [](wincc::Console &console)
+    {
+        for (int i = 0; i < 200; ++i)
+        {
+            console.write("line {} ", i);
+            console.write(i % 7 ? ConsoleColor::Green : ConsoleColor::Red, ConsoleColor::DarkBlue, "{}", i % 7 ? "ok" : "failed");
+            console.write("\n");
+        }
+        console.write(ConsoleColor::Cyan, "tail");
+    };
+
+    wincc::MemorySink recorded;
+    std::string unfinished;
+    {
+        wincc::RecordSink recorder(recorded);
+        wincc::Console console(ConsoleBackend::Auto, &recorder);
+        write_lines(console);
+        console.flush();
+        unfinished = recorded.str();
+    }
+
+    wincc::MemorySink ansi;
+    wincc::MemorySink plain;
+    {
+        wincc::Console ansi_console(ConsoleBackend::Ansi, &ansi);
+        wincc::Console plain_console(ConsoleBackend::Plain, &plain);
+        write_lines(ansi_console);
+        write_lines(plain_console);
+    }
+
+    CHECK(recorded.str().size() < ansi.str().size());
+
+    wincc::Recording recording(recorded.str().data(), recorded.str().size());
+    CHECK(recording.is_open() && recording.is_finished() && !recording.has_timestamps());
+    CHECK(recording.line_count() == 201);
+
+    wincc::MemorySink text;
+    recording.write_text(text);
+    CHECK(text.str() == plain.str());
+
+    text.clear();
+    recording.write_text(text, 130, 3);
+    CHECK(text.str() == "line 130 ok\nline 131 ok\nline 132 ok\n");
+
+    text.clear();
+    recording.write_text(text, 199, 10);
+    CHECK(text.str() == "line 199 ok\ntail");
+
+    {
+        // Replaying through another backend sends the same colors as writing directly.
+        wincc::MemorySink replayed;
+        {
+            wincc::Console console(ConsoleBackend::Ansi, &replayed);
+            recording.replay(console);
+        }
+        CHECK(replayed.str() == ansi.str());
+
+        replayed.clear();
+        wincc::Console console(ConsoleBackend::Ansi, &replayed);
+        recording.replay(console, 70, 1);
+        CHECK(replayed.str() == "line 70 \x1b[91;44mfailed\x1b[39;49m\n");
+    }
+
+    size_t runs = 0;
+    bool colors_match = true;
+    recording.for_each(63, 2, [&](const wincc::RecordedRun &run)
+    {
+        std::string_view view(run.text, run.size);
+        colors_match = colors_match && (view == "failed" ? run.foreground == ConsoleColor::Red && run.background == ConsoleColor::DarkBlue
+                                                         : view == "ok" ? run.foreground == ConsoleColor::Green
+                                                                        : run.foreground == ConsoleColor::Default);
+        ++runs;
+    });
+    CHECK(runs == 6 && colors_match);
+
+    {
+        // Without the footer the index is rebuilt, and a record cut short is left out.
+        wincc::Recording rebuilt(unfinished.data(), unfinished.size());
+        CHECK(rebuilt.is_open() && !rebuilt.is_finished());
+        CHECK(rebuilt.line_count() == 201);
+
+        wincc::MemorySink cut_text;
+        rebuilt.write_text(cut_text, 130, 3);
+        CHECK(cut_text.str() == "line 130 ok\nline 131 ok\nline 132 ok\n");
+
+        wincc::Recording cut(unfinished.data(), unfinished.size() - 2);
+        CHECK(cut.is_open() && cut.line_count() == 200);
+    }
+
+    {
+        wincc::Recording garbage("not a recording", 15);
+        CHECK(!garbage.is_open() && garbage.line_count() == 0);
+    }
+
+    const char *path = "wincc_check_record.bin";
+    {
+        wincc::FdSink file(path);
+        wincc::RecordSink recorder(file, true);
+        wincc::Console console(ConsoleBackend::Auto, &recorder);
+        console.write(ConsoleColor::Yellow, "first\n");
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        console.write("second\n");
+    }
+
+    {
+        wincc::Recording mapped(path);
+        CHECK(mapped.is_open() && mapped.is_finished() && mapped.has_timestamps() && mapped.line_count() == 2);
+
+        std::vector<uint64_t> times;
+        mapped.for_each(0, wincc::Recording::k_all_lines, [&](const wincc::RecordedRun &run) { times.push_back(run.time); });
+        CHECK(times.size() == 2 && times[1] >= times[0] + 1000);
+    }
+    remove(path);
+}
+
+static void check_highlight()
+{
+    wincc::Highlighter highlighter;
+    highlighter.add("ERROR", ConsoleColor::Red);
+    highlighter.add("WARN", ConsoleColor::Yellow);
+    highlighter.add("req-", ConsoleColor::Cyan);
+    highlighter.add("", ConsoleColor::Green);
+    highlighter.add("WARN", ConsoleColor::Black, ConsoleColor::Yellow);
+    CHECK(highlighter.rule_count() == 3);
+
+    {
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        highlighter.write(console, "12:00 ERROR req-7 failed\n12:01 WARN slow\n");
+        highlighter.write(console, "plain line\n");
+        CHECK(sink.str() == "12:00 \x1b[91mERROR\x1b[39m \x1b[96mreq-\x1b[39m7 failed\n12:01 \x1b[30;103mWARN\x1b[39;49m slow\n"
+            "plain line\n");
+        CHECK(highlighter.state_count() == 14);
+    }
+
+    {
+        // Of overlapping keywords the leftmost wins, then the longest.
+        wincc::Highlighter overlapping;
+        overlapping.add("he", ConsoleColor::Red);
+        overlapping.add("she", ConsoleColor::Green);
+        overlapping.add("hers", ConsoleColor::Blue);
+        overlapping.add("RR", ConsoleColor::Cyan);
+        overlapping.add("ERROR", ConsoleColor::Yellow);
+
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        overlapping.write(console, "ushers hehe ERRR ERROR");
+        CHECK(sink.str() == "u\x1b[92mshe\x1b[39mrs \x1b[91mhehe\x1b[39m E\x1b[96mRR\x1b[39mR \x1b[93mERROR");
+    }
+
+    {
+        // A shorter keyword ending where a dropped one does is still found.
+        wincc::Highlighter suffixes;
+        suffixes.add("ABC", ConsoleColor::Red);
+        suffixes.add("CDE", ConsoleColor::Green);
+        suffixes.add("DE", ConsoleColor::Cyan);
+
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        suffixes.write(console, "ABCDE xCDE");
+        CHECK(sink.str() == "\x1b[91mABC\x1b[96mDE\x1b[39m x\x1b[92mCDE");
+    }
+
+    {
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        highlighter.write(console, "ERROR and WARN stay as text");
+        CHECK(sink.str() == "ERROR and WARN stay as text");
+    }
+
+    {
+        // Every byte value in some keyword needs a class beyond what fits in a byte.
+        wincc::Highlighter every_byte;
+        for (int c = 0; c < 256; ++c)
+        {
+            char text[2] = { (char)c, 'z' };
+            every_byte.add(std::string_view(text, 2), ConsoleColor::Green);
+        }
+
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        every_byte.write(console, std::string_view("\xffz", 2));
+        CHECK(sink.str() == "\x1b[92m\xffz");
+    }
+}
+
+static void check_style_stack()
+{
+    wincc::MemorySink sink;
+    wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+    {
+        wincc::StyleScope error(console, ConsoleColor::Red);
+        console.write("error in ");
+        {
+            wincc::StyleScope identifier(console, ConsoleColor::Cyan, ConsoleColor::DarkBlue);
+            console.write("parse_header");
+            CHECK(console.style_depth() == 2);
+        }
+        console.write(": ");
+        {
+            // Same colors as the enclosing scope, so neither the push nor the pop sends anything.
+            wincc::StyleScope same(console, ConsoleColor::Red);
+            console.write("bad magic");
+        }
+        console.write("\n");
+    }
+    CHECK(console.style_depth() == 0);
+    CHECK(console.style() == wincc::Style());
+    console.write("done");
+
+    CHECK(sink.str() == "\x1b[91merror in \x1b[96;44mparse_header\x1b[91;49m: bad magic\n\x1b[39mdone");
+    CHECK(console.switch_count() == 4);
+
+    {
+        // A push and pop with no text between them leaves the console as it was.
+        sink.clear();
+        size_t switches = console.switch_count();
+        for (int i = 0; i < 1000; ++i)
+        {
+            wincc::StyleScope scope(console, ConsoleColor::Yellow, ConsoleColor::DarkRed);
+        }
+        console.write("x");
+        CHECK(sink.str() == "x" && console.switch_count() == switches);
+    }
+
+    {
+        // Levels past the capacity change colors but are not saved.
+        for (size_t i = 0; i < wincc::Console::k_style_stack_capacity + 2; ++i)
+        {
+            console.push_style(i % 2 ? ConsoleColor::Green : ConsoleColor::Blue);
+        }
+        console.pop_style();
+        CHECK(console.foreground_color() == ConsoleColor::Green);
+        console.pop_style();
+        CHECK(console.foreground_color() == ConsoleColor::Green);
+        console.pop_style();
+        CHECK(console.foreground_color() == ConsoleColor::Blue);
+
+        while (console.style_depth() > 0)
+        {
+            console.pop_style();
+        }
+        console.pop_style();
+        CHECK(console.style() == wincc::Style());
+    }
+}
+
+static void check_scrollback()
+{
+    {
+        // Colored writes of every kind are recorded and replayed in their colors, with
+        // neighboring runs in the same colors merged.
+        wincc::Scrollback scrollback(3);
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Ansi, &sink);
+        console.scrollback(&scrollback);
+
+        console.write(ConsoleColor::Red, "one");
+        console.write(ConsoleColor::Red, " two\n");
+        wincc::Frame frame;
+        frame.append(ConsoleColor::Green, "three");
+        frame.append(ConsoleColor::Black, ConsoleColor::Yellow, " four\nfive\n");
+        console.commit(frame);
+        console.write(wincc::styled<"{cyan}six{/}">());
+
+        CHECK(scrollback.line_count() == 3 && scrollback.dropped_line_count() == 1);
+
+        wincc::MemorySink replayed;
+        {
+            wincc::Console replay_console(ConsoleBackend::Ansi, &replayed);
+            scrollback.replay_last(replay_console, 2);
+        }
+        CHECK(replayed.str() == "\x1b[30;103mfive\n\x1b[96;49msix\x1b[39m");
+
+        // Replaying through the recording console does not record the replay.
+        size_t memory = scrollback.memory_usage();
+        scrollback.replay(console, 0, wincc::Scrollback::k_default_line_bytes);
+        CHECK(scrollback.line_count() == 3 && scrollback.memory_usage() == memory);
+        CHECK(console.scrollback() == &scrollback);
+
+        scrollback.clear();
+        CHECK(scrollback.line_count() == 0 && scrollback.text_size() == 0);
+    }
+
+    {
+        // Lines of many lengths, so the text ring wraps in the middle of runs over and over.
+        wincc::Scrollback scrollback(8, 100, 40);
+        wincc::MemorySink sink;
+        wincc::Console console(ConsoleBackend::Plain, &sink);
+        console.scrollback(&scrollback);
+
+        std::vector<std::string> lines;
+        bool all_match = true;
+        for (int i = 0; i < 500; ++i)
+        {
+            std::string line(i % 23, (char)('a' + i % 26));
+            console.write(i % 3 ? ConsoleColor::Red : ConsoleColor::Blue, line.c_str());
+            console.write("\n");
+            lines.push_back(line + "\n");
+
+            CHECK(scrollback.text_size() <= 100 && scrollback.line_count() <= 8);
+
+            wincc::MemorySink replayed;
+            wincc::Console replay_console(ConsoleBackend::Plain, &replayed);
+            scrollback.replay(replay_console, 0, scrollback.line_count());
+
+            std::string expected;
+            for (size_t l = lines.size() - scrollback.line_count(); l < lines.size(); ++l)
+            {
+                expected += lines[l];
+            }
+            all_match = all_match && replayed.str() == expected;
+        }
+        CHECK(all_match);
+        CHECK(scrollback.dropped_line_count() + scrollback.line_count() == 500);
+    }
+
+    {
+        // A line longer than the text ring is cut short but still ends.
+        wincc::Scrollback scrollback(4, 16, 16);
+        std::string long_line(40, 'x');
+        scrollback.append(ConsoleColor::Default, ConsoleColor::Default, long_line.data(), long_line.size());
+        scrollback.append(ConsoleColor::Default, ConsoleColor::Default, "y\n", 2);
+        CHECK(scrollback.line_count() == 1 && scrollback.text_size() == 16);
+
+        wincc::MemorySink replayed;
+        {
+            wincc::Console replay_console(ConsoleBackend::Plain, &replayed);
+            scrollback.replay(replay_console, 0, 1);
+            scrollback.append(ConsoleColor::Default, ConsoleColor::Default, "ok\n", 3);
+            scrollback.replay(replay_console, 0, 1);
+        }
+        CHECK(replayed.str() == std::string(15, 'x') + "\nok\n");
+        CHECK(scrollback.line_count() == 1 && scrollback.dropped_line_count() == 1);
+    }
+
+    {
+        // A run longer than a replay frame is split, and replays on several threads at once each
+        // write every line.
+        wincc::Scrollback scrollback(16, 1 << 20, 64);
+        std::string long_line(200 * 1024, 'z');
+        scrollback.append(ConsoleColor::Green, ConsoleColor::Default, long_line.data(), long_line.size());
+        scrollback.append(ConsoleColor::Green, ConsoleColor::Default, "\nend\n", 5);
+
+        std::string replayed[4];
+        std::vector<std::thread> threads;
+        for (std::string &output : replayed)
+        {
+            threads.emplace_back([&scrollback, &output]()
+            {
+                wincc::MemorySink sink;
+                wincc::Console replay_console(ConsoleBackend::Plain, &sink);
+                scrollback.replay(replay_console, 0, scrollback.line_count());
+                output = sink.str();
+            });
+        }
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+
+        for (const std::string &output : replayed)
+        {
+            CHECK(output == long_line + "\nend\n");
+        }
+    }
+}
+
+#ifndef _WIN32
+// Fill a pipe until it would block, so the next write has to wait.
+static void fill_pipe(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    char block[4096] = {};
+    while (write(fd, block, sizeof(block)) > 0)
+    {
+    }
+
+    // Single bytes fill whatever room a full block did not fit in.
+    while (write(fd, block, 1) > 0)
+    {
+    }
+
+    fcntl(fd, F_SETFL, flags);
+}
+
+// Read a pipe until every writer has closed it.
+static std::string read_pipe(int fd)
+{
+    std::string result;
+    char buffer[4096];
+    ssize_t size;
+    while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        result.append(buffer, (size_t)size);
+    }
+
+    return result;
+}
+
+// Text written after the bytes fill_pipe put in front of it.
+static std::string after_fill(const std::string &output)
+{
+    size_t start = output.find_first_not_of('\0');
+    return start == std::string::npos ? std::string() : output.substr(start);
+}
+#endif
+
+static void check_nonblocking_sink()
+{
+#ifndef _WIN32
+    {
+        // Repeated lines are counted while the pipe is full.
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        fill_pipe(fds[1]);
+
+        std::string output;
+        std::thread reader;
+        {
+            wincc::NonBlockingSink sink(fds[1], wincc::BackpressurePolicy::Coalesce, 64 * 1024);
+            wincc::Console console(ConsoleBackend::Ansi, &sink);
+
+            for (int i = 0; i < 100; ++i)
+            {
+                console.write(ConsoleColor::Red, "disk full\n");
+            }
+            console.write("done\n");
+            console.flush();
+
+            CHECK(sink.coalesced_count() == 98 && sink.dropped_count() == 0);
+            CHECK(sink.pending() > 0);
+
+            reader = std::thread([&]() { output = read_pipe(fds[0]); });
+            CHECK(sink.drain(5.0));
+            CHECK(sink.pending() == 0);
+        }
+
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+
+        CHECK(after_fill(output) == "\x1b[91mdisk full\ndisk full\n(repeated x98)\n\x1b[39mdone\n");
+    }
+
+    {
+        // A dropped write that changed colors is made up for before the next write that goes out.
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        fill_pipe(fds[1]);
+
+        std::string output;
+        std::thread reader;
+        {
+            wincc::NonBlockingSink sink(fds[1], wincc::BackpressurePolicy::BlockUntilDeadline, 64);
+            sink.deadline(0.01);
+
+            sink.write("start\n", 6);
+            CHECK(sink.pending() == 6);
+
+            std::string red = "\x1b[91m" + std::string(100, 'r') + "\n";
+            auto start = std::chrono::steady_clock::now();
+            sink.write(red.data(), red.size());
+            std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+            CHECK(waited.count() >= 0.01);
+            CHECK(sink.dropped_count() == 1 && sink.dropped_bytes() == red.size());
+
+            sink.write("plain\n", 6);
+
+            reader = std::thread([&]() { output = read_pipe(fds[0]); });
+            CHECK(sink.drain(5.0));
+        }
+
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+
+        CHECK(after_fill(output) == "start\n\x1b[91;49mplain\n");
+    }
+
+    {
+        // Low priority writes stop at three quarters of the buffer, warnings go on to the end.
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        fill_pipe(fds[1]);
+
+        std::string line(99, 'x');
+        line += '\n';
+
+        {
+            wincc::NonBlockingSink sink(fds[1], wincc::BackpressurePolicy::DropLowPriority, 1000);
+            sink.deadline(0);
+
+            sink.severity(wincc::Severity::Debug);
+            for (int i = 0; i < 10; ++i)
+            {
+                sink.write(line.data(), line.size());
+            }
+            CHECK(sink.pending() == 700 && sink.dropped_count() == 3);
+
+            sink.severity(wincc::Severity::Warning);
+            for (int i = 0; i < 10; ++i)
+            {
+                sink.write(line.data(), line.size());
+            }
+            CHECK(sink.pending() == 1000 && sink.dropped_count() == 10);
+        }
+
+        // The descriptor is blocking again.
+        CHECK((fcntl(fds[1], F_GETFL) & O_NONBLOCK) == 0);
+        close(fds[1]);
+        close(fds[0]);
+    }
+
+    // Writes bigger than the buffer keep it within its capacity. The first goes out as far as the
+    // buffer holds and the rest of it is dropped; the second is dropped whole, as output is
+    // pending.
+    const wincc::BackpressurePolicy policies[] =
+    {
+        wincc::BackpressurePolicy::Coalesce, wincc::BackpressurePolicy::DropLowPriority,
+        wincc::BackpressurePolicy::BlockUntilDeadline
+    };
+    for (wincc::BackpressurePolicy policy : policies)
+    {
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        fill_pipe(fds[1]);
+
+        const size_t capacity = 1024;
+        std::string first(8 * capacity, 'a');
+        std::string second = std::string(8 * capacity, 'b') + "\n";
+
+        std::string output;
+        std::thread reader;
+        {
+            wincc::NonBlockingSink sink(fds[1], policy, capacity);
+            sink.deadline(0.001);
+            sink.severity(wincc::Severity::Warning);
+
+            sink.write(first.data(), first.size());
+            CHECK(sink.pending() == capacity);
+            sink.write(second.data(), second.size());
+            CHECK(sink.pending() == capacity);
+            CHECK(sink.dropped_count() == 2 && sink.dropped_bytes() == first.size() + second.size() - capacity);
+
+            reader = std::thread([&]() { output = read_pipe(fds[0]); });
+            CHECK(sink.drain(5.0));
+        }
+
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+
+        CHECK(after_fill(output) == first.substr(0, capacity));
+    }
+
+    {
+        // A write many times the buffer reaches a slow reader whole when the policy waits.
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+
+        std::string text;
+        for (int i = 0; text.size() < 1024 * 1024; ++i)
+        {
+            text += "\x1b[9" + std::to_string(i % 7 + 1) + "mline " + std::to_string(i) + "\n";
+        }
+
+        std::string output;
+        std::thread reader([&]() { output = read_pipe(fds[0]); });
+        {
+            wincc::NonBlockingSink sink(fds[1], wincc::BackpressurePolicy::BlockUntilDeadline, 16 * 1024);
+            sink.deadline(5.0);
+
+            sink.write(text.data(), text.size());
+            CHECK(sink.pending() <= 16 * 1024);
+            CHECK(sink.dropped_count() == 0);
+        }
+
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+
+        CHECK(output == text);
+    }
+#endif
+}
@@ -0,0 +1,300 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <assert.h>
+#include <chrono>
+#include <string.h>
+
+#include "win_color_async.hh"
+
+// Batch size at which the flusher commits to the console without waiting for the queue to empty.
+#define WINCC_ASYNC_BATCH_BYTES (64 * 1024)
+
+// Longest the flusher sleeps before checking the queue again. Wake ups are not missed, so this is
+// only a safety net.
+#define WINCC_ASYNC_IDLE_WAIT std::chrono::milliseconds(100)
+
+wincc::AsyncConsole::AsyncConsole(Console &console, size_t capacity, OverflowPolicy policy)
+    : m_console(console), m_policy(policy), m_enqueue_pos(0), m_dequeue_pos(0), m_written_pos(0), m_dropped(0),
+      m_stopping(false), m_sleeping(false)
+{
+    size_t rounded = 2;
+    while (rounded < capacity)
+    {
+        rounded <<= 1;
+    }
+
+    static_assert(sizeof(Slot) == 128, "a slot must fill exactly two cache lines");
+
+    m_slots = new Slot[rounded];
+    m_mask = rounded - 1;
+
+    for (size_t i = 0; i < rounded; ++i)
+    {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    m_thread = std::thread(&AsyncConsole::_run, this);
+}
+
+wincc::AsyncConsole::~AsyncConsole()
+{
+    m_stopping.store(true, std::memory_order_release);
+    _wake();
+    m_thread.join();
+
+    delete[] m_slots;
+}
+
+bool wincc::AsyncConsole::write(const char *msg, Severity severity)
+{
+    return _push(Frame::k_current_color, Frame::k_current_color, msg, strlen(msg), severity);
+}
+
+bool wincc::AsyncConsole::write(ConsoleColor foreground, const char *msg, Severity severity)
+{
+    return _push((unsigned char)foreground, Frame::k_current_color, msg, strlen(msg), severity);
+}
+
+bool wincc::AsyncConsole::write(ConsoleColor foreground, ConsoleColor background, const char *msg, Severity severity)
+{
+    return _push((unsigned char)foreground, (unsigned char)background, msg, strlen(msg), severity);
+}
+
+bool wincc::AsyncConsole::write(ConsoleColor foreground, ConsoleColor background, const char *msg, size_t size,
+    Severity severity)
+{
+    return _push((unsigned char)foreground, (unsigned char)background, msg, size, severity);
+}
+
+void wincc::AsyncConsole::flush()
+{
+    size_t target = m_enqueue_pos.load(std::memory_order_acquire);
+
+    while (m_written_pos.load(std::memory_order_acquire) < target)
+    {
+        _wake();
+        std::this_thread::yield();
+    }
+}
+
+bool wincc::AsyncConsole::_push(unsigned char foreground, unsigned char background, const char *msg, size_t size,
+    Severity severity)
+{
+    const size_t capacity = m_mask + 1;
+
+    if (size == 0)
+    {
+        return true;
+    }
+
+    // Records are claimed as one run of positions so the flusher sees them whole. A record longer
+    // than half the queue is written as several pieces within that run, so no other record can
+    // come between them, but only the first piece needs free slots for the claim to succeed.
+    const size_t max_slots = capacity / 2;
+    const size_t slot_count = (size + k_slot_payload - 1) / k_slot_payload;
+    const size_t first_slots = slot_count < max_slots ? slot_count : max_slots;
+    const bool low_severity = severity < Severity::Warning;
+
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        if (m_policy == OverflowPolicy::DropLowestSeverity && low_severity)
+        {
+            // pos may be stale and already behind the flusher.
+            size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            size_t used = pos > dequeue_pos ? pos - dequeue_pos : 0;
+            if (used + first_slots > capacity / 4 * 3)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        // Every slot of the first piece must be free for this lap of the ring.
+        size_t free_slots = 0;
+        bool full = false;
+
+        for (; free_slots < first_slots; ++free_slots)
+        {
+            size_t sequence = m_slots[(pos + free_slots) & m_mask].sequence.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)(sequence - (pos + free_slots));
+
+            if (diff != 0)
+            {
+                // Behind the position means the flusher has not released the slot yet. Ahead of it
+                // means another producer got there first and pos is stale.
+                full = diff < 0;
+                break;
+            }
+        }
+
+        if (free_slots == first_slots)
+        {
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + slot_count, std::memory_order_relaxed))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        if (full)
+        {
+            if (m_policy == OverflowPolicy::Drop || (m_policy == OverflowPolicy::DropLowestSeverity && low_severity))
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            _wake();
+            std::this_thread::yield();
+        }
+
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+
+    // The positions are ours now and the flusher stops at the first one left empty, so the pieces
+    // after the first wait for their slots under every policy rather than being dropped.
+    for (size_t piece = 0; piece < slot_count; piece += max_slots)
+    {
+        size_t piece_slots = slot_count - piece < max_slots ? slot_count - piece : max_slots;
+        size_t piece_pos = pos + piece;
+
+        for (size_t i = 0; i < piece_slots; ++i)
+        {
+            while (m_slots[(piece_pos + i) & m_mask].sequence.load(std::memory_order_acquire) != piece_pos + i)
+            {
+                _wake();
+                std::this_thread::yield();
+            }
+        }
+
+        // Publish the continuation slots first and the head last, so once the flusher sees the
+        // head the whole piece is there.
+        for (size_t i = piece_slots; i-- > 0;)
+        {
+            Slot &slot = m_slots[(piece_pos + i) & m_mask];
+            size_t offset = (piece + i) * k_slot_payload;
+            size_t chunk = size - offset < k_slot_payload ? size - offset : k_slot_payload;
+
+            slot.foreground = foreground;
+            slot.background = background;
+            slot.size = (unsigned short)chunk;
+            slot.slot_count = (unsigned int)piece_slots;
+            memcpy(slot.data, msg + offset, chunk);
+
+            slot.sequence.store(piece_pos + i + 1, std::memory_order_release);
+        }
+    }
+
+    _wake();
+    return true;
+}
+
+bool wincc::AsyncConsole::_drain()
+{
+    const size_t capacity = m_mask + 1;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    bool wrote = false;
+
+    m_batch.clear();
+
+    for (;;)
+    {
+        Slot &head = m_slots[pos & m_mask];
+        if (head.sequence.load(std::memory_order_acquire) != pos + 1)
+        {
+            break;
+        }
+
+        size_t slot_count = head.slot_count;
+
+        for (size_t i = 0; i < slot_count; ++i)
+        {
+            Slot &slot = m_slots[(pos + i) & m_mask];
+
+            m_batch.append(slot.foreground, slot.background, slot.data, slot.size);
+
+            // The text is copied into the batch, so the slot can go back to the producers.
+            slot.sequence.store(pos + i + capacity, std::memory_order_release);
+        }
+
+        pos += slot_count;
+        m_dequeue_pos.store(pos, std::memory_order_relaxed);
+
+        if (m_batch.size() >= WINCC_ASYNC_BATCH_BYTES)
+        {
+            m_console.commit(m_batch);
+            m_batch.clear();
+            wrote = true;
+        }
+    }
+
+    if (!m_batch.empty())
+    {
+        m_console.commit(m_batch);
+        wrote = true;
+    }
+
+    if (wrote)
+    {
+        m_console.flush();
+        m_written_pos.store(pos, std::memory_order_release);
+    }
+
+    return wrote;
+}
+
+bool wincc::AsyncConsole::_has_record() const
+{
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    return m_slots[pos & m_mask].sequence.load(std::memory_order_acquire) == pos + 1;
+}
+
+void wincc::AsyncConsole::_wake()
+{
+    // Pairs with the fence in _run so either the flusher sees the new record or we see it asleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_sleeping.load(std::memory_order_relaxed))
+    {
+        // The flusher holds the mutex from checking the queue until it waits, so taking it here
+        // keeps the notification from landing in between and being lost.
+        {
+            std::lock_guard<std::mutex> lock(m_wakeup_mutex);
+        }
+
+        m_wakeup.notify_one();
+    }
+}
+
+void wincc::AsyncConsole::_run()
+{
+    for (;;)
+    {
+        if (_drain())
+        {
+            continue;
+        }
+
+        if (m_stopping.load(std::memory_order_acquire))
+        {
+            // Producers are done by the time the destructor runs, so one last pass empties the queue.
+            _drain();
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wakeup_mutex);
+        m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (!_has_record() && !m_stopping.load(std::memory_order_acquire))
+        {
+            m_wakeup.wait_for(lock, WINCC_ASYNC_IDLE_WAIT);
+        }
+
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+}
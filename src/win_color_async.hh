@@ -0,0 +1,146 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_ASYNC_HH
+#define _WIN_COLOR_ASYNC_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // What a producer does when the queue of an AsyncConsole is full.
+    enum class OverflowPolicy
+    {
+        // Wait for the flusher thread to make room.
+        Block,
+
+        // Discard the record.
+        Drop,
+
+        // Once the queue is three quarters full, discard records below Severity::Warning to keep
+        // room for the rest. Warnings and errors wait if the queue fills completely.
+        DropLowestSeverity
+    };
+
+    // Importance of a record, used by OverflowPolicy::DropLowestSeverity.
+    enum class Severity
+    {
+        Debug,
+        Info,
+        Warning,
+        Error
+    };
+
+    // Thread-safe front end for a Console. Any number of threads push colored records into a
+    // lock-free ring buffer, and one flusher thread drains it in batches through the Console, so
+    // each record is written whole and in its own colors. The Console must not be used directly
+    // while an AsyncConsole is attached to it.
+    //
+    // A record longer than half the queue, capacity / 2 * k_slot_payload bytes, is still written
+    // whole and uninterrupted. The overflow policy applies only until its first half queue of text
+    // is accepted; from then on the producer waits for the flusher to make room for the rest.
+    class AsyncConsole
+    {
+    public:
+        // Start a flusher thread writing to console. The queue holds capacity slots, rounded up to
+        // a power of two, and each slot carries up to k_slot_payload bytes of text.
+        explicit AsyncConsole(Console &console, size_t capacity = 4096, OverflowPolicy policy = OverflowPolicy::Block);
+
+        AsyncConsole(const AsyncConsole &) = delete;
+
+        AsyncConsole &operator=(const AsyncConsole &) = delete;
+
+        // Write everything still queued, then stop the flusher thread.
+        ~AsyncConsole();
+
+        // Queue text in the console's current colors. Returns false if the record was dropped.
+        bool write(const char *msg, Severity severity = Severity::Info);
+
+        // Queue text with the given foreground color. Returns false if the record was dropped.
+        bool write(ConsoleColor foreground, const char *msg, Severity severity = Severity::Info);
+
+        // Queue text with the given foreground and background color. Returns false if the record
+        // was dropped.
+        bool write(ConsoleColor foreground, ConsoleColor background, const char *msg, Severity severity = Severity::Info);
+
+        // Queue size bytes of text with the given foreground and background color. Returns false if
+        // the record was dropped.
+        bool write(ConsoleColor foreground, ConsoleColor background, const char *msg, size_t size,
+            Severity severity = Severity::Info);
+
+        // Wait until everything queued before this call has been written and flushed.
+        void flush();
+
+        // Number of records discarded by the overflow policy.
+        size_t dropped_count() const { return m_dropped.load(std::memory_order_relaxed); }
+
+        // Text bytes carried by one slot. Longer records take several consecutive slots.
+        static const size_t k_slot_payload = 112;
+
+    private:
+        // One cell of the ring buffer, two cache lines in size and aligned to them, so producers
+        // filling neighboring slots never share a line. The sequence number says whose turn it
+        // is: equal to the position when free for a producer, position + 1 when holding data for
+        // the flusher.
+        struct alignas(64) Slot
+        {
+            std::atomic<size_t> sequence;
+            unsigned char foreground;
+            unsigned char background;
+            unsigned short size;
+            unsigned int slot_count;
+            char data[k_slot_payload];
+        };
+
+        // Claim and fill slots for one record. Returns false if it was dropped.
+        bool _push(unsigned char foreground, unsigned char background, const char *msg, size_t size, Severity severity);
+
+        // Drain everything available into the console. Returns true if anything was written.
+        bool _drain();
+
+        // True if a complete record is waiting for the flusher.
+        bool _has_record() const;
+
+        // Wake the flusher thread if it is sleeping.
+        void _wake();
+
+        // Body of the flusher thread.
+        void _run();
+
+        Console &m_console;
+        OverflowPolicy m_policy;
+
+        Slot *m_slots;
+        size_t m_mask;
+
+        // The two positions are kept on separate cache lines from each other and the fields above.
+        char m_pad0[64];
+        std::atomic<size_t> m_enqueue_pos;
+        char m_pad1[64];
+        std::atomic<size_t> m_dequeue_pos;
+        char m_pad2[64];
+
+        // Position up to which records have been written and flushed.
+        std::atomic<size_t> m_written_pos;
+
+        std::atomic<size_t> m_dropped;
+        std::atomic<bool> m_stopping;
+
+        // Lets the flusher sleep while the queue is empty.
+        std::atomic<bool> m_sleeping;
+        std::mutex m_wakeup_mutex;
+        std::condition_variable m_wakeup;
+
+        // Batch being assembled by the flusher. Only touched by the flusher thread.
+        Frame m_batch;
+
+        std::thread m_thread;
+    };
+}
+
+#endif /* _WIN_COLOR_ASYNC_HH */
@@ -0,0 +1,400 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_BASIC_HH
+#define _WIN_COLOR_BASIC_HH
+
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // Backend policies for BasicConsole, chosen at compile time. Each one says whether it shows
+    // colors and whether it writes text at all, and BasicConsole leaves out whatever it does not
+    // need. Console is the runtime-selected equivalent.
+    namespace backend
+    {
+        // Text only, written to a C stream. A BasicConsole with this backend keeps no color state
+        // and each write is a bare fwrite.
+        class NoColor
+        {
+        public:
+            static constexpr bool k_colors = false;
+            static constexpr bool k_text = true;
+
+            explicit NoColor(FILE *stream = stdout) : m_stream(stream) {}
+
+            void write(const char *data, size_t size) { fwrite(data, 1, size, m_stream); }
+
+            void flush() { fflush(m_stream); }
+
+        private:
+            FILE *m_stream;
+        };
+
+        // Discards everything. Writes, formatting included, compile to nothing.
+        class Null
+        {
+        public:
+            static constexpr bool k_colors = false;
+            static constexpr bool k_text = false;
+
+            void write(const char *, size_t) {}
+
+            void flush() {}
+        };
+
+        // ANSI/VT SGR escape sequences written inline with the text to a C stream. Like the ANSI
+        // backend of Console, only the part of the colors that changed is sent, and the terminal
+        // is assumed to start in its own default colors.
+        class Ansi
+        {
+        public:
+            static constexpr bool k_colors = true;
+            static constexpr bool k_text = true;
+
+            explicit Ansi(FILE *stream = stdout) : m_stream(stream) {}
+
+            // Write text, after the escape sequence of the last color change if there is one.
+            void write(const char *data, size_t size)
+            {
+                if (m_pending.empty())
+                {
+                    fwrite(data, 1, size, m_stream);
+                }
+                else
+                {
+                    _write_switched(data, size);
+                }
+            }
+
+            // Write any pending escape sequence and flush the stream.
+            void flush()
+            {
+                _write_switched(nullptr, 0);
+                fflush(m_stream);
+            }
+
+            // Switch the terminal to the given colors. Does nothing if they are already in effect.
+            // The escape sequence goes out with the next write.
+            void apply(ConsoleColor foreground, ConsoleColor background)
+            {
+                if (foreground != m_foreground || background != m_background)
+                {
+                    _switch(foreground, background);
+                }
+            }
+
+        private:
+            // Make the escape sequence switching to the given colors pending.
+            void _switch(ConsoleColor foreground, ConsoleColor background);
+
+            // Write the pending escape sequence and then the text under one lock of the stream.
+            void _write_switched(const char *data, size_t size);
+
+            FILE *m_stream;
+            ConsoleColor m_foreground = ConsoleColor::Default;
+            ConsoleColor m_background = ConsoleColor::Default;
+
+            // Escape sequence not yet written, pointing into a static table, and the attribute it
+            // switches from.
+            std::string_view m_pending;
+            int m_pending_from = 0;
+        };
+
+#ifdef _WIN32
+        // SetConsoleTextAttribute on the process console, with text written to stdout as UTF-8.
+        // ConsoleColor::Default stands for the colors the console had when this was created.
+        class Win32
+        {
+        public:
+            static constexpr bool k_colors = true;
+            static constexpr bool k_text = true;
+
+            Win32();
+
+            Win32(const Win32 &) = delete;
+
+            Win32 &operator=(const Win32 &) = delete;
+
+            ~Win32();
+
+            void write(const char *data, size_t size) { fwrite(data, 1, size, stdout); }
+
+            void flush() { fflush(stdout); }
+
+            // Switch the console to the given colors. Does nothing if they are already in effect.
+            void apply(ConsoleColor foreground, ConsoleColor background)
+            {
+                if (foreground != m_foreground || background != m_background)
+                {
+                    _switch(foreground, background);
+                }
+            }
+
+        private:
+            // Flush stdout and set the console attribute for the given colors.
+            void _switch(ConsoleColor foreground, ConsoleColor background);
+
+            void *m_console_handle;
+            int m_default_attribute;
+            unsigned int m_saved_code_page;
+            ConsoleColor m_foreground = ConsoleColor::Default;
+            ConsoleColor m_background = ConsoleColor::Default;
+        };
+#endif
+    }
+
+    namespace detail
+    {
+        // Colors a BasicConsole writes in. Backends without colors get the empty specialization,
+        // so the console carries no color state at all.
+        template <bool Colors>
+        struct ConsoleColorState
+        {
+            ConsoleColor foreground = ConsoleColor::Default;
+            ConsoleColor background = ConsoleColor::Default;
+        };
+
+        template <>
+        struct ConsoleColorState<false>
+        {
+        };
+    }
+
+    // Console with its backend fixed at compile time, for programs that know where their output
+    // goes. Has the writing API of Console, but everything is inline and work a backend does not
+    // need is compiled out: with backend::NoColor a colored write is strlen and fwrite, and with
+    // backend::Null it is nothing. As with Console, colors are switched lazily right before text
+    // that needs them. Leaves the terminal in its default colors when destroyed.
+    template <class Backend>
+    class BasicConsole : private detail::ConsoleColorState<Backend::k_colors>
+    {
+    public:
+        BasicConsole() {}
+
+        // Create a console writing through the given backend, such as backend::Ansi(stderr).
+        explicit BasicConsole(const Backend &backend) : m_backend(backend) {}
+
+        BasicConsole(const BasicConsole &) = delete;
+
+        BasicConsole &operator=(const BasicConsole &) = delete;
+
+        ~BasicConsole()
+        {
+            if constexpr (Backend::k_colors)
+            {
+                m_backend.apply(ConsoleColor::Default, ConsoleColor::Default);
+            }
+
+            m_backend.flush();
+        }
+
+        // Get the backend.
+        Backend &backend() { return m_backend; }
+
+        // Get the current background color. Always ConsoleColor::Default without colors.
+        ConsoleColor background_color() const
+        {
+            if constexpr (Backend::k_colors)
+            {
+                return this->background;
+            }
+            else
+            {
+                return ConsoleColor::Default;
+            }
+        }
+
+        // Set the current background color.
+        void background_color(ConsoleColor value)
+        {
+            if constexpr (Backend::k_colors)
+            {
+                this->background = value;
+            }
+        }
+
+        // Get the current foreground color. Always ConsoleColor::Default without colors.
+        ConsoleColor foreground_color() const
+        {
+            if constexpr (Backend::k_colors)
+            {
+                return this->foreground;
+            }
+            else
+            {
+                return ConsoleColor::Default;
+            }
+        }
+
+        // Set the current foreground color.
+        void foreground_color(ConsoleColor value)
+        {
+            if constexpr (Backend::k_colors)
+            {
+                this->foreground = value;
+            }
+        }
+
+        // Reset colors back to default.
+        void reset_colors()
+        {
+            foreground_color(ConsoleColor::Default);
+            background_color(ConsoleColor::Default);
+        }
+
+        // Apply any pending color change and push buffered output to the console.
+        void flush()
+        {
+            if constexpr (Backend::k_colors)
+            {
+                m_backend.apply(this->foreground, this->background);
+            }
+
+            m_backend.flush();
+        }
+
+        // Write to the console without setting new colors.
+        void write(const char *msg) { _write_text(foreground_color(), background_color(), msg); }
+
+        // Write to the console with the given foreground color.
+        void write(ConsoleColor foreground, const char *msg) { _write_text(foreground, background_color(), msg); }
+
+        // Write to the console with the given foreground and background color.
+        void write(ConsoleColor foreground, ConsoleColor background, const char *msg)
+        {
+            _write_text(foreground, background, msg);
+        }
+
+        // Write wide characters to the console without setting new colors.
+        void writewc(const wchar_t *msg) { _write_text(foreground_color(), background_color(), msg); }
+
+        // Write wide characters to the console with the given foreground color.
+        void writewc(ConsoleColor foreground, const wchar_t *msg) { _write_text(foreground, background_color(), msg); }
+
+        // Write wide characters to the console with the given foreground and background color.
+        void writewc(ConsoleColor foreground, ConsoleColor background, const wchar_t *msg)
+        {
+            _write_text(foreground, background, msg);
+        }
+
+        // Write formatted text to the console without setting new colors. See Console::write.
+        template <class... Args>
+        void write(FormatString<Args...> format, const Args &... args)
+        {
+            _write_formatted(foreground_color(), background_color(), format.get(), args...);
+        }
+
+        // Write formatted text to the console with the given foreground color.
+        template <class... Args>
+        void write(ConsoleColor foreground, FormatString<Args...> format, const Args &... args)
+        {
+            _write_formatted(foreground, background_color(), format.get(), args...);
+        }
+
+        // Write formatted text to the console with the given foreground and background color.
+        template <class... Args>
+        void write(ConsoleColor foreground, ConsoleColor background, FormatString<Args...> format, const Args &... args)
+        {
+            _write_formatted(foreground, background, format.get(), args...);
+        }
+
+        // Write formatted wide characters to the console without setting new colors.
+        template <class... Args>
+        void writewc(WideFormatString<Args...> format, const Args &... args)
+        {
+            _write_formatted(foreground_color(), background_color(), format.get(), args...);
+        }
+
+        // Write formatted wide characters to the console with the given foreground color.
+        template <class... Args>
+        void writewc(ConsoleColor foreground, WideFormatString<Args...> format, const Args &... args)
+        {
+            _write_formatted(foreground, background_color(), format.get(), args...);
+        }
+
+        // Write formatted wide characters to the console with the given foreground and background color.
+        template <class... Args>
+        void writewc(ConsoleColor foreground, ConsoleColor background, WideFormatString<Args...> format,
+            const Args &... args)
+        {
+            _write_formatted(foreground, background, format.get(), args...);
+        }
+
+    private:
+        // Write a null-terminated narrow or wide string in the given colors.
+        template <class Char>
+        void _write_text(ConsoleColor foreground, ConsoleColor background, const Char *msg)
+        {
+            if constexpr (!Backend::k_text)
+            {
+                return;
+            }
+            else if constexpr (std::is_same_v<Char, char>)
+            {
+                _write_bytes(foreground, background, msg, strlen(msg));
+            }
+            else
+            {
+                _write_wide(foreground, background, msg, wcslen(msg));
+            }
+        }
+
+        // Format into the per-thread buffer and write the result in the given colors.
+        template <class Char, class... Args>
+        void _write_formatted(ConsoleColor foreground, ConsoleColor background, std::basic_string_view<Char> format,
+            const Args &... args)
+        {
+            if constexpr (Backend::k_text)
+            {
+                // One extra element so the array is never empty.
+                const detail::FormatValue<Char> values[sizeof...(Args) + 1] = { detail::make_format_value<Char>(args)... };
+
+                std::basic_string<Char> &buffer = detail::format_buffer<Char>();
+                detail::format_to(buffer, format, values, sizeof...(Args));
+
+                if constexpr (std::is_same_v<Char, char>)
+                {
+                    _write_bytes(foreground, background, buffer.data(), buffer.size());
+                }
+                else
+                {
+                    _write_wide(foreground, background, buffer.data(), buffer.size());
+                }
+            }
+        }
+
+        // Convert wide text to UTF-8 in the per-thread narrow buffer and write it.
+        void _write_wide(ConsoleColor foreground, ConsoleColor background, const wchar_t *text, size_t size)
+        {
+            std::string &buffer = detail::format_buffer<char>();
+            buffer.resize(size * detail::k_max_utf8_per_wchar);
+            size_t length = detail::utf8_from_wide(text, size, &buffer[0]);
+            _write_bytes(foreground, background, buffer.data(), length);
+        }
+
+        // Write size bytes in the given colors. Colors are switched only if there is text to write.
+        void _write_bytes(ConsoleColor foreground, ConsoleColor background, const char *data, size_t size)
+        {
+            if constexpr (Backend::k_colors)
+            {
+                if (size == 0)
+                {
+                    return;
+                }
+
+                m_backend.apply(foreground, background);
+            }
+
+            m_backend.write(data, size);
+        }
+
+        Backend m_backend;
+    };
+}
+
+#endif // _WIN_COLOR_BASIC_HH
@@ -21,26 +21,1483 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 *******************************************************************************/
+#include <algorithm>
 #include <assert.h>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WINCC_HAVE_SSE2 1
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WINCC_HAVE_AVX2 1
+#endif
+
+// Blocks converted one character at a time after a block the vector path cannot handle.
+#define WINCC_UTF8_SCALAR_STRETCH 4
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
 #include <Windows.h>
+#else
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Attribute bits from Windows.h. The same attribute model is used by every backend.
+#define FOREGROUND_BLUE 0x0001
+#define FOREGROUND_GREEN 0x0002
+#define FOREGROUND_RED 0x0004
+#define FOREGROUND_INTENSITY 0x0008
+#endif
+
+#include "win_color_basic.hh"
+#include "win_color_console.hh"
+#include "win_color_scrollback.hh"
+
+// Mask for the foreground color part CONSOLE_SCREEN_BUFFER_INFO wAttributes.
+#define WINCC_FOREGROUND_MASK 0x0F
+
+// Mask for the background color part from CONSOLE_SCREEN_BUFFER_INFO wAttributes.
+#define WINCC_BACKGROUND_MASK 0xF0
+
+// Number of bits to shift for background part of number for CONSOLE_SCREEN_BUFFER_INFO wAttributes.
+#define WINCC_BG_SHIFT 4
+
+// Flag for the terminal's own default foreground. Only used by the ANSI backend, which cannot ask
+// the terminal what its default colors are.
+#define WINCC_DEFAULT_FOREGROUND 0x0100
+
+// Flag for the terminal's own default background. This is the foreground flag shifted into the
+// background position so the same conversions work for both.
+#define WINCC_DEFAULT_BACKGROUND (WINCC_DEFAULT_FOREGROUND << WINCC_BG_SHIFT)
+
+// Index of the default color in the SGR tables.
+#define WINCC_SGR_DEFAULT_INDEX 16
+
+// Longest SGR sequence produced: ESC [ fg ; bg m
+#define WINCC_MAX_SGR_LENGTH 16
+
+// Entries in the SGR tables: sixteen colors and the terminal default.
+#define WINCC_SGR_TABLE_SIZE (WINCC_SGR_DEFAULT_INDEX + 1)
+
+// Longest SGR sequence setting two extended colors: ESC [ 38;2;r;g;b ; 48;2;r;g;b m
+#define WINCC_MAX_EXTENDED_SGR_LENGTH 40
+
+// Applied attribute after extended colors were written, which the attribute model cannot hold.
+// It never matches a real attribute, so the next switch sets both colors.
+#define WINCC_UNKNOWN_ATTRIBUTE -1
+
+// Bits kept from each RGB channel to index the quantization table.
+#define WINCC_QUANTIZE_BITS 5
+
+// Longest cursor move sequence: ESC [ row ; column H
+#define WINCC_MAX_CURSOR_MOVE_LENGTH 32
+
+// Longest markup tag, brackets included. "[darkviolet on darkyellow]" is the longest valid one.
+#define WINCC_MAX_TAG_LENGTH 32
+
+// SGR parameters for each foreground attribute nibble, followed by the terminal default.
+static constexpr const char *k_sgr_foreground[] =
+{
+    "30", "34", "32", "36", "31", "35", "33", "37",
+    "90", "94", "92", "96", "91", "95", "93", "97",
+    "39"
+};
+
+// SGR parameters for each background attribute nibble, followed by the terminal default.
+static constexpr const char *k_sgr_background[] =
+{
+    "40", "44", "42", "46", "41", "45", "43", "47",
+    "100", "104", "102", "106", "101", "105", "103", "107",
+    "49"
+};
+
+// Windows attribute nibble for each color, in enum order. Blue is 1, green 2, red 4 and intensity 8.
+static const int k_color_attributes[] = { 0, 9, 10, 12, 1, 2, 4, 11, 13, 14, 3, 5, 6, 15, 7, 8 };
+
+// Color for each Windows attribute nibble.
+static const wincc::ConsoleColor k_attribute_colors[] =
+{
+    wincc::ConsoleColor::Black, wincc::ConsoleColor::DarkBlue, wincc::ConsoleColor::DarkGreen,
+    wincc::ConsoleColor::DarkCyan, wincc::ConsoleColor::DarkRed, wincc::ConsoleColor::DarkViolet,
+    wincc::ConsoleColor::DarkYellow, wincc::ConsoleColor::Gray, wincc::ConsoleColor::DarkGray,
+    wincc::ConsoleColor::Blue, wincc::ConsoleColor::Green, wincc::ConsoleColor::Cyan, wincc::ConsoleColor::Red,
+    wincc::ConsoleColor::Violet, wincc::ConsoleColor::Yellow, wincc::ConsoleColor::White
+};
+
+// Index into the SGR foreground table for an attribute.
+static int sgr_foreground_index(int attribute)
+{
+    return (attribute & WINCC_DEFAULT_FOREGROUND) ? WINCC_SGR_DEFAULT_INDEX : (attribute & WINCC_FOREGROUND_MASK);
+}
+
+// Index into the SGR background table for an attribute.
+static int sgr_background_index(int attribute)
+{
+    return (attribute & WINCC_DEFAULT_BACKGROUND) ? WINCC_SGR_DEFAULT_INDEX : ((attribute & WINCC_BACKGROUND_MASK) >> WINCC_BG_SHIFT);
+}
+
+// Append an SGR parameter to dst, returning the new end.
+static constexpr char *append_sgr_parameter(char *dst, const char *parameter)
+{
+    while (*parameter)
+    {
+        *dst++ = *parameter++;
+    }
+
+    return dst;
+}
+
+// Every escape sequence switching between attributes: the foreground alone for each foreground
+// index, then the background alone for each background index, then both for every pair. Built at
+// compile time, so a switch is a lookup and gather writes can point straight at it.
+struct SgrSwitchTable
+{
+    char text[WINCC_SGR_TABLE_SIZE * (WINCC_SGR_TABLE_SIZE + 2)][WINCC_MAX_SGR_LENGTH];
+    unsigned char size[WINCC_SGR_TABLE_SIZE * (WINCC_SGR_TABLE_SIZE + 2)];
+};
+
+// Entry of the switch table setting the given foreground and background indexes. -1 leaves
+// that part alone.
+static constexpr int sgr_switch_entry(int foreground, int background)
+{
+    if (background < 0)
+    {
+        return foreground;
+    }
+
+    if (foreground < 0)
+    {
+        return WINCC_SGR_TABLE_SIZE + background;
+    }
+
+    return WINCC_SGR_TABLE_SIZE * (2 + foreground) + background;
+}
+
+static constexpr SgrSwitchTable build_sgr_switches()
+{
+    SgrSwitchTable table = {};
+
+    for (int foreground = -1; foreground < WINCC_SGR_TABLE_SIZE; ++foreground)
+    {
+        for (int background = -1; background < WINCC_SGR_TABLE_SIZE; ++background)
+        {
+            if (foreground < 0 && background < 0)
+            {
+                continue;
+            }
+
+            int entry = sgr_switch_entry(foreground, background);
+            char *out = table.text[entry];
+            *out++ = '\x1b';
+            *out++ = '[';
+
+            if (foreground >= 0)
+            {
+                out = append_sgr_parameter(out, k_sgr_foreground[foreground]);
+            }
+
+            if (background >= 0)
+            {
+                if (foreground >= 0)
+                {
+                    *out++ = ';';
+                }
+
+                out = append_sgr_parameter(out, k_sgr_background[background]);
+            }
+
+            *out++ = 'm';
+            table.size[entry] = (unsigned char)(out - table.text[entry]);
+        }
+    }
+
+    return table;
+}
+
+static constexpr SgrSwitchTable k_sgr_switches = build_sgr_switches();
+
+// Escape sequence switching from one attribute to another. Only the parts that differ are set.
+// Empty if nothing differs.
+static std::string_view sgr_switch(int from, int to)
+{
+    int fg_to = sgr_foreground_index(to);
+    int bg_to = sgr_background_index(to);
+
+    // Nothing is known after extended colors, so both colors are set.
+    bool unknown = from == WINCC_UNKNOWN_ATTRIBUTE;
+    int foreground = unknown || sgr_foreground_index(from) != fg_to ? fg_to : -1;
+    int background = unknown || sgr_background_index(from) != bg_to ? bg_to : -1;
+
+    if (foreground < 0 && background < 0)
+    {
+        return std::string_view();
+    }
+
+    int entry = sgr_switch_entry(foreground, background);
+    return std::string_view(k_sgr_switches.text[entry], k_sgr_switches.size[entry]);
+}
+
+// Attribute nibble for a color in the palette, black for anything else.
+static int color_attribute(wincc::ConsoleColor color)
+{
+    return (size_t)color < sizeof(k_color_attributes) / sizeof(k_color_attributes[0]) ? k_color_attributes[(int)color] : 0;
+}
+
+// Attribute the ANSI backend uses for a pair of colors, with the terminal's defaults flagged.
+static int ansi_attribute(wincc::ConsoleColor foreground, wincc::ConsoleColor background)
+{
+    int fg = foreground == wincc::ConsoleColor::Default ? WINCC_DEFAULT_FOREGROUND : color_attribute(foreground);
+    int bg = background == wincc::ConsoleColor::Default ? WINCC_DEFAULT_BACKGROUND : color_attribute(background) << WINCC_BG_SHIFT;
+    return fg | bg;
+}
+
+// Append a number to dst, which needs room for eleven bytes, returning the new end.
+static char *append_number(char *dst, int value)
+{
+    return std::to_chars(dst, dst + 11, value).ptr;
+}
+
+// Build the escape sequence moving the cursor to a zero-based row and column. Returns the number
+// of bytes written to dst.
+static size_t format_cursor_move(int row, int column, char *dst)
+{
+    char *out = dst;
+    *out++ = '\x1b';
+    *out++ = '[';
+    out = append_number(out, row + 1);
+    *out++ = ';';
+    out = append_number(out, column + 1);
+    *out++ = 'H';
+    return (size_t)(out - dst);
+}
+
+// Encode the wide character at text[i] as UTF-8 at out and advance i past it. UTF-16 surrogate
+// pairs are combined where wchar_t is 16 bits. Anything that is not a valid code point becomes
+// U+FFFD. Returns the end of the bytes written.
+static inline char *encode_wide_char(const wchar_t *text, size_t size, size_t &i, char *out)
+{
+    unsigned long cp = (unsigned long)text[i++];
+
+    if (cp < 0x80)
+    {
+        *out++ = (char)cp;
+        return out;
+    }
+
+    if (cp < 0x800)
+    {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+        return out;
+    }
+
+    if (cp >= 0xD800 && cp <= 0xDFFF)
+    {
+        unsigned long next = i < size ? (unsigned long)text[i] : 0;
+
+        if (sizeof(wchar_t) == 2 && cp <= 0xDBFF && next >= 0xDC00 && next <= 0xDFFF)
+        {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (next - 0xDC00);
+            ++i;
+        }
+        else
+        {
+            cp = 0xFFFD;
+        }
+    }
+    else if (cp > 0x10FFFF)
+    {
+        cp = 0xFFFD;
+    }
+
+    if (cp < 0x10000)
+    {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+
+    return out;
+}
+
+#ifdef WINCC_HAVE_SSE2
+// Load eight wide characters into 16-bit lanes. Returns false if any of them is U+0800 or above.
+static inline bool load_short_wide_chars(const wchar_t *text, __m128i &lanes)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        lanes = _mm_loadu_si128((const __m128i *)text);
+        __m128i high = _mm_and_si128(lanes, _mm_set1_epi16((short)0xF800));
+        return _mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) == 0xFFFF;
+    }
+    else
+    {
+        __m128i low = _mm_loadu_si128((const __m128i *)text);
+        __m128i high = _mm_loadu_si128((const __m128i *)(text + 4));
+        __m128i over = _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi32((int)0xFFFFF800));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(over, zero)) != 0xFFFF)
+        {
+            return false;
+        }
+
+        lanes = _mm_packs_epi32(low, high);
+        return true;
+    }
+}
+
+// Store the one or two byte encodings of the lanes one after another. Each lane stores two bytes
+// but only advances past the ones it needs, so a one-byte lane's spare byte is overwritten by the
+// next lane. ascii_mask has two bits set per one-byte lane, as from a byte movemask. The spare
+// byte of a last one-byte lane lands in room reserved for wider characters, so it stays in dst.
+static inline char *compact_short_pairs(const uint16_t *pairs, size_t count, unsigned ascii_mask, char *out)
+{
+    for (size_t k = 0; k < count; ++k)
+    {
+        memcpy(out, &pairs[k], 2);
+        out += 2 - ((ascii_mask >> (2 * k)) & 1);
+    }
+
+    return out;
+}
+
+// Encode eight characters below U+0800.
+static inline void encode_short_block(__m128i lanes, char *&out)
+{
+    __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(lanes, _mm_set1_epi16((short)0xFF80)), _mm_setzero_si128());
+    unsigned ascii_mask = (unsigned)_mm_movemask_epi8(ascii);
+
+    if (ascii_mask == 0xFFFF)
+    {
+        _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(lanes, lanes));
+        out += 8;
+        return;
+    }
+
+    // Two-byte lanes become their lead byte followed by their trail byte.
+    __m128i lead = _mm_or_si128(_mm_srli_epi16(lanes, 6), _mm_set1_epi16(0xC0));
+    __m128i trail = _mm_or_si128(_mm_and_si128(lanes, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+    __m128i pairs = _mm_or_si128(lead, _mm_slli_epi16(trail, 8));
+
+    if (ascii_mask == 0)
+    {
+        _mm_storeu_si128((__m128i *)out, pairs);
+        out += 16;
+        return;
+    }
+
+    uint16_t mixed[8];
+    _mm_storeu_si128((__m128i *)mixed, _mm_or_si128(_mm_and_si128(ascii, lanes), _mm_andnot_si128(ascii, pairs)));
+    out = compact_short_pairs(mixed, 8, ascii_mask, out);
+}
+#endif
+
+#ifdef WINCC_HAVE_AVX2
+// Load sixteen wide characters into 16-bit lanes. Returns false if any of them is U+0800 or above.
+static inline bool load_short_wide_chars(const wchar_t *text, __m256i &lanes)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        lanes = _mm256_loadu_si256((const __m256i *)text);
+        return _mm256_testz_si256(lanes, _mm256_set1_epi16((short)0xF800)) != 0;
+    }
+    else
+    {
+        __m256i low = _mm256_loadu_si256((const __m256i *)text);
+        __m256i high = _mm256_loadu_si256((const __m256i *)(text + 8));
+
+        if (!_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_set1_epi32((int)0xFFFFF800)))
+        {
+            return false;
+        }
+
+        // Packing works within each 128-bit half, so put the quarters back in order.
+        lanes = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+        return true;
+    }
+}
+
+// Encode sixteen characters below U+0800.
+static inline void encode_short_block(__m256i lanes, char *&out)
+{
+    __m256i ascii = _mm256_cmpeq_epi16(_mm256_and_si256(lanes, _mm256_set1_epi16((short)0xFF80)), _mm256_setzero_si256());
+    unsigned ascii_mask = (unsigned)_mm256_movemask_epi8(ascii);
+
+    if (ascii_mask == 0xFFFFFFFF)
+    {
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lanes, lanes), 0x08);
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(packed));
+        out += 16;
+        return;
+    }
+
+    __m256i lead = _mm256_or_si256(_mm256_srli_epi16(lanes, 6), _mm256_set1_epi16(0xC0));
+    __m256i trail = _mm256_or_si256(_mm256_and_si256(lanes, _mm256_set1_epi16(0x3F)), _mm256_set1_epi16(0x80));
+    __m256i pairs = _mm256_or_si256(lead, _mm256_slli_epi16(trail, 8));
+
+    if (ascii_mask == 0)
+    {
+        _mm256_storeu_si256((__m256i *)out, pairs);
+        out += 32;
+        return;
+    }
+
+    uint16_t mixed[16];
+    _mm256_storeu_si256((__m256i *)mixed, _mm256_blendv_epi8(pairs, lanes, ascii));
+    out = compact_short_pairs(mixed, 16, ascii_mask, out);
+}
+#endif
+
+// Append the digits of a number formatted into a narrow buffer.
+template <class Char>
+static void append_digits(std::basic_string<Char> &out, const char *begin, const char *end)
+{
+    for (const char *c = begin; c != end; ++c)
+    {
+        out += (Char)*c;
+    }
+}
+
+// Append one type-erased formatting argument.
+template <class Char>
+static void append_format_value(std::basic_string<Char> &out, const wincc::detail::FormatValue<Char> &value)
+{
+    using Kind = typename wincc::detail::FormatValue<Char>::Kind;
+
+    // Big enough for any integer, pointer, or shortest round-trip double.
+    char digits[32];
+    std::to_chars_result result = { digits, std::errc() };
+
+    switch (value.kind)
+    {
+    case Kind::Bool:
+    {
+        const char *text = value.boolean ? "true" : "false";
+        append_digits(out, text, text + strlen(text));
+        return;
+    }
+    case Kind::Character:
+        out += value.character;
+        return;
+    case Kind::String:
+        out.append(value.string.data, value.string.size);
+        return;
+    case Kind::Signed:
+        result = std::to_chars(digits, digits + sizeof(digits), value.signed_value);
+        break;
+    case Kind::Unsigned:
+        result = std::to_chars(digits, digits + sizeof(digits), value.unsigned_value);
+        break;
+    case Kind::Floating:
+        result = std::to_chars(digits, digits + sizeof(digits), value.floating);
+        break;
+    case Kind::Pointer:
+        digits[0] = '0';
+        digits[1] = 'x';
+        result = std::to_chars(digits + 2, digits + sizeof(digits), (unsigned long long)(size_t)value.pointer, 16);
+        break;
+    }
+
+    append_digits(out, digits, result.ptr);
+}
+
+template <class Char>
+size_t wincc::detail::format_to(std::basic_string<Char> &out, std::basic_string_view<Char> format, const FormatValue<Char> *values,
+    size_t count)
+{
+    size_t next_value = 0;
+    size_t literal_start = 0;
+
+    for (size_t i = 0; i < format.size(); ++i)
+    {
+        Char c = format[i];
+        if ((c != Char('{') && c != Char('}')) || i + 1 >= format.size())
+        {
+            continue;
+        }
+
+        Char following = format[i + 1];
+        bool escaped_brace = following == c;
+        bool placeholder = c == Char('{') && following == Char('}') && next_value < count;
+
+        if (escaped_brace || placeholder)
+        {
+            // Copy the literal text up to here, keeping one brace of an escaped pair.
+            out.append(format.data() + literal_start, i - literal_start + (escaped_brace ? 1 : 0));
+
+            if (placeholder)
+            {
+                append_format_value(out, values[next_value++]);
+            }
+
+            ++i;
+            literal_start = i + 1;
+        }
+    }
+
+    out.append(format.data() + literal_start, format.size() - literal_start);
+    return next_value;
+}
+
+template <class Char>
+std::basic_string<Char> &wincc::detail::format_buffer()
+{
+    thread_local std::basic_string<Char> buffer;
+    buffer.clear();
+    return buffer;
+}
+
+template size_t wincc::detail::format_to<char>(std::string &, std::string_view, const FormatValue<char> *, size_t);
+template size_t wincc::detail::format_to<wchar_t>(std::wstring &, std::wstring_view, const FormatValue<wchar_t> *, size_t);
+template std::string &wincc::detail::format_buffer<char>();
+template std::wstring &wincc::detail::format_buffer<wchar_t>();
+
+const char *wincc::detail::find_byte(const char *begin, const char *end, char c)
+{
+#ifdef WINCC_HAVE_SSE2
+    const __m128i needle = _mm_set1_epi8(c);
+
+    while (end - begin >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)begin);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+        if (mask)
+        {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return begin + index;
+#else
+            return begin + __builtin_ctz(mask);
+#endif
+        }
+
+        begin += 16;
+    }
+#endif
+
+    return find_byte_scalar(begin, end, c);
+}
+
+const char *wincc::detail::find_byte_scalar(const char *begin, const char *end, char c)
+{
+    while (begin != end && *begin != c)
+    {
+        ++begin;
+    }
+
+    return begin;
+}
+
+size_t wincc::detail::utf8_from_wide(const wchar_t *text, size_t size, char *dst)
+{
+    char *out = dst;
+    size_t i = 0;
+
+#ifdef WINCC_HAVE_AVX2
+    const size_t block = 16;
+#elif defined(WINCC_HAVE_SSE2)
+    const size_t block = 8;
+#endif
+
+#if defined(WINCC_HAVE_AVX2) || defined(WINCC_HAVE_SSE2)
+    while (size - i >= block)
+    {
+#ifdef WINCC_HAVE_AVX2
+        __m256i lanes;
+#else
+        __m128i lanes;
+#endif
+        if (load_short_wide_chars(text + i, lanes))
+        {
+            encode_short_block(lanes, out);
+            i += block;
+            continue;
+        }
+
+        // Text that defeats one block usually defeats the next few, so skip checking them.
+        size_t scalar_end = size - i >= WINCC_UTF8_SCALAR_STRETCH * block ? i + WINCC_UTF8_SCALAR_STRETCH * block : i + block;
+        while (i < scalar_end)
+        {
+            out = encode_wide_char(text, size, i, out);
+        }
+    }
+#endif
+
+    while (i < size)
+    {
+        out = encode_wide_char(text, size, i, out);
+    }
+
+    return (size_t)(out - dst);
+}
+
+size_t wincc::detail::utf8_from_wide_scalar(const wchar_t *text, size_t size, char *dst)
+{
+    char *out = dst;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        out = encode_wide_char(text, size, i, out);
+    }
+
+    return (size_t)(out - dst);
+}
+
+char32_t wincc::detail::decode_utf8(std::string_view text, size_t &pos)
+{
+    unsigned char lead = (unsigned char)text[pos++];
+
+    if (lead < 0x80)
+    {
+        return lead;
+    }
+
+    size_t extra;
+    char32_t cp;
+    char32_t minimum;
+
+    if ((lead & 0xE0) == 0xC0)
+    {
+        extra = 1;
+        cp = lead & 0x1F;
+        minimum = 0x80;
+    }
+    else if ((lead & 0xF0) == 0xE0)
+    {
+        extra = 2;
+        cp = lead & 0x0F;
+        minimum = 0x800;
+    }
+    else if ((lead & 0xF8) == 0xF0)
+    {
+        extra = 3;
+        cp = lead & 0x07;
+        minimum = 0x10000;
+    }
+    else
+    {
+        return 0xFFFD;
+    }
+
+    if (pos + extra > text.size())
+    {
+        return 0xFFFD;
+    }
+
+    for (size_t i = 0; i < extra; ++i)
+    {
+        unsigned char next = (unsigned char)text[pos + i];
+        if ((next & 0xC0) != 0x80)
+        {
+            return 0xFFFD;
+        }
+
+        cp = (cp << 6) | (next & 0x3F);
+    }
+
+    if (cp < minimum || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+    {
+        return 0xFFFD;
+    }
+
+    pos += extra;
+    return cp;
+}
+
+int64_t wincc::detail::steady_ns()
+{
+    return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Levels of the 6x6x6 color cube in the 256-color palette.
+static const unsigned char k_cube_levels[] = { 0, 95, 135, 175, 215, 255 };
+
+// Color of each of the first sixteen entries of the 256-color palette, which are the colors of SGR
+// codes 30 to 37 followed by 90 to 97.
+static const wincc::ConsoleColor k_basic_index_colors[] =
+{
+    wincc::ConsoleColor::Black, wincc::ConsoleColor::DarkRed, wincc::ConsoleColor::DarkGreen,
+    wincc::ConsoleColor::DarkYellow, wincc::ConsoleColor::DarkBlue, wincc::ConsoleColor::DarkViolet,
+    wincc::ConsoleColor::DarkCyan, wincc::ConsoleColor::Gray, wincc::ConsoleColor::DarkGray,
+    wincc::ConsoleColor::Red, wincc::ConsoleColor::Green, wincc::ConsoleColor::Yellow, wincc::ConsoleColor::Blue,
+    wincc::ConsoleColor::Violet, wincc::ConsoleColor::Cyan, wincc::ConsoleColor::White
+};
+
+// Squared distance between an RGB value and a palette entry.
+static int rgb_distance(int red, int green, int blue, const unsigned char rgb[3])
+{
+    int dr = red - rgb[0];
+    int dg = green - rgb[1];
+    int db = blue - rgb[2];
+    return dr * dr + dg * dg + db * db;
+}
+
+// Nearest ConsoleColor to an RGB value, searching the whole palette.
+static unsigned char nearest_console_color(int red, int green, int blue)
+{
+    int best = 0;
+
+    for (int i = 1; i < (int)(sizeof(wincc::detail::k_color_rgb) / sizeof(wincc::detail::k_color_rgb[0])); ++i)
+    {
+        if (rgb_distance(red, green, blue, wincc::detail::k_color_rgb[i]) <
+            rgb_distance(red, green, blue, wincc::detail::k_color_rgb[best]))
+        {
+            best = i;
+        }
+    }
+
+    return (unsigned char)best;
+}
+
+// Nearest entry of the 256-color palette to an RGB value, from either the color cube or the gray
+// ramp. The first sixteen entries are left out, as terminals often change their colors.
+static int index_from_rgb(int red, int green, int blue)
+{
+    auto level = [](int value) { return value < 48 ? 0 : value < 115 ? 1 : (value - 35) / 40; };
+
+    int r = level(red);
+    int g = level(green);
+    int b = level(blue);
+    const unsigned char cube[3] = { k_cube_levels[r], k_cube_levels[g], k_cube_levels[b] };
+
+    int step = ((red + green + blue) / 3 - 3) / 10;
+    step = step < 0 ? 0 : step > 23 ? 23 : step;
+    const unsigned char gray[3] = { (unsigned char)(8 + 10 * step), (unsigned char)(8 + 10 * step), (unsigned char)(8 + 10 * step) };
+
+    if (rgb_distance(red, green, blue, gray) < rgb_distance(red, green, blue, cube))
+    {
+        return 232 + step;
+    }
+
+    return 16 + 36 * r + 6 * g + b;
+}
+
+// Tables mapping colors onto the nearest ConsoleColor, built on first use.
+struct QuantizeTables
+{
+    QuantizeTables();
+
+    // Nearest color for each RGB value cut to WINCC_QUANTIZE_BITS per channel. Red is the lowest
+    // part of the index and blue the highest, matching the byte order of a Color.
+    unsigned char rgb[1 << (3 * WINCC_QUANTIZE_BITS)];
+
+    // Nearest color for each entry of the 256-color palette.
+    unsigned char indexed[256];
+};
+
+QuantizeTables::QuantizeTables()
+{
+    const int levels = 1 << WINCC_QUANTIZE_BITS;
+    const int step = 256 / levels;
+
+    // Each cell of the table holds the color nearest to its center.
+    for (int blue = 0; blue < levels; ++blue)
+    {
+        for (int green = 0; green < levels; ++green)
+        {
+            for (int red = 0; red < levels; ++red)
+            {
+                rgb[(blue * levels + green) * levels + red] =
+                    nearest_console_color(red * step + step / 2, green * step + step / 2, blue * step + step / 2);
+            }
+        }
+    }
+
+    for (int index = 0; index < 16; ++index)
+    {
+        indexed[index] = (unsigned char)k_basic_index_colors[index];
+    }
+
+    for (int index = 16; index < 232; ++index)
+    {
+        int cube = index - 16;
+        indexed[index] = nearest_console_color(k_cube_levels[cube / 36], k_cube_levels[cube / 6 % 6], k_cube_levels[cube % 6]);
+    }
+
+    for (int index = 232; index < 256; ++index)
+    {
+        int level = 8 + 10 * (index - 232);
+        indexed[index] = nearest_console_color(level, level, level);
+    }
+}
+
+static const QuantizeTables &quantize_tables()
+{
+    static const QuantizeTables tables;
+    return tables;
+}
+
+// Nearest ConsoleColor to a color, as its enum value.
+static inline unsigned char quantize_color(wincc::Color color, const QuantizeTables &tables)
+{
+    const int shift = 8 - WINCC_QUANTIZE_BITS;
+
+    switch (color.kind)
+    {
+    case wincc::Color::Kind::Rgb:
+        return tables.rgb[(color.red >> shift) | ((color.green >> shift) << WINCC_QUANTIZE_BITS) |
+            ((color.blue >> shift) << (2 * WINCC_QUANTIZE_BITS))];
+    case wincc::Color::Kind::Indexed:
+        return tables.indexed[color.red];
+    default:
+        return color.red;
+    }
+}
+
+wincc::ConsoleColor wincc::Color::console_color() const
+{
+    return (ConsoleColor)quantize_color(*this, quantize_tables());
+}
+
+void wincc::quantize(const Color *colors, size_t count, ConsoleColor *dst)
+{
+    size_t i = 0;
+
+#ifdef WINCC_HAVE_SSE2
+    const QuantizeTables &tables = quantize_tables();
+    const int bits = WINCC_QUANTIZE_BITS;
+    const int shift = 8 - bits;
+    const __m128i channel = _mm_set1_epi32((1 << bits) - 1);
+    const __m128i kind_mask = _mm_set1_epi32((int)0xFF000000);
+    const __m128i rgb_kind = _mm_set1_epi32((int)((unsigned)Color::Kind::Rgb << 24));
+
+    // Each Color is one 32-bit lane: red in the low byte, then green, blue and the kind. The table
+    // index of four RGB colors is computed at once by shifting each channel's top bits into place.
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i lanes = _mm_loadu_si128((const __m128i *)(colors + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(lanes, kind_mask), rgb_kind)) != 0xFFFF)
+        {
+            detail::quantize_scalar(colors + i, 4, dst + i);
+            continue;
+        }
+
+        __m128i red = _mm_and_si128(_mm_srli_epi32(lanes, shift), channel);
+        __m128i green = _mm_and_si128(_mm_srli_epi32(lanes, 8 + shift - bits), _mm_slli_epi32(channel, bits));
+        __m128i blue = _mm_and_si128(_mm_srli_epi32(lanes, 16 + shift - 2 * bits), _mm_slli_epi32(channel, 2 * bits));
+
+        alignas(16) uint32_t indexes[4];
+        _mm_store_si128((__m128i *)indexes, _mm_or_si128(_mm_or_si128(red, green), blue));
+
+        dst[i] = (ConsoleColor)tables.rgb[indexes[0]];
+        dst[i + 1] = (ConsoleColor)tables.rgb[indexes[1]];
+        dst[i + 2] = (ConsoleColor)tables.rgb[indexes[2]];
+        dst[i + 3] = (ConsoleColor)tables.rgb[indexes[3]];
+    }
+#endif
+
+    detail::quantize_scalar(colors + i, count - i, dst + i);
+}
+
+void wincc::detail::quantize_scalar(const Color *colors, size_t count, ConsoleColor *dst)
+{
+    const QuantizeTables &tables = quantize_tables();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = (ConsoleColor)quantize_color(colors[i], tables);
+    }
+}
+
+// Append the SGR parameters selecting a color: base is 30 for the foreground or 40 for the
+// background. Colors the depth cannot show are brought down to the nearest palette entry.
+static char *append_color_parameters(char *out, wincc::Color color, int base, wincc::ColorDepth depth)
+{
+    if (color.kind == wincc::Color::Kind::Console)
+    {
+        return append_number(out, wincc::detail::k_sgr_color_codes[color.red] - 30 + base);
+    }
+
+    out = append_number(out, base + 8);
+
+    if (color.kind == wincc::Color::Kind::Indexed || depth == wincc::ColorDepth::Indexed)
+    {
+        out = append_sgr_parameter(out, ";5;");
+        return append_number(out, color.kind == wincc::Color::Kind::Indexed ? color.red : index_from_rgb(color.red, color.green, color.blue));
+    }
+
+    out = append_sgr_parameter(out, ";2;");
+    out = append_number(out, color.red);
+    *out++ = ';';
+    out = append_number(out, color.green);
+    *out++ = ';';
+    return append_number(out, color.blue);
+}
+
+// Add bytes to a gather list, extending the last slice when they follow on from it.
+static void append_slice(std::vector<wincc::IoSlice> &slices, const char *data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (!slices.empty() && slices.back().data + slices.back().size == data)
+    {
+        slices.back().size += size;
+        return;
+    }
+
+    slices.push_back(wincc::IoSlice{ data, size });
+}
+
+// Guess the colors a terminal can show from the environment, the same way most terminal programs do.
+static wincc::ColorDepth detect_color_depth()
+{
+    const char *colorterm = getenv("COLORTERM");
+    if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0))
+    {
+        return wincc::ColorDepth::TrueColor;
+    }
+
+    const char *term = getenv("TERM");
+    if (term && strstr(term, "256color"))
+    {
+        return wincc::ColorDepth::Indexed;
+    }
+
+    return wincc::ColorDepth::Basic;
+}
+
+void wincc::MarkupTemplate::parse(std::string_view markup)
+{
+    m_text.clear();
+    m_spans.clear();
+    m_ansi.clear();
+    m_ansi_lead_size = 0;
+
+    ConsoleColor foreground = ConsoleColor::Default;
+    ConsoleColor background = ConsoleColor::Default;
 
-#include "win_color_console.hh"
+    const char *pos = markup.data();
+    const char *end = pos + markup.size();
 
-// Mask for the foreground color part CONSOLE_SCREEN_BUFFER_INFO wAttributes.
-#define WINCC_FOREGROUND_MASK 0x0F
+    while (pos != end)
+    {
+        const char *open = detail::find_byte(pos, end, '[');
+        _append(foreground, background, pos, (size_t)(open - pos));
 
-// Mask for the background color part from CONSOLE_SCREEN_BUFFER_INFO wAttributes.
-#define WINCC_BACKGROUND_MASK 0xF0
+        if (open == end)
+        {
+            break;
+        }
 
-// Number of bits to shift for background part of number for CONSOLE_SCREEN_BUFFER_INFO wAttributes.
-#define WINCC_BG_SHIFT 4
+        // [[ is a literal bracket.
+        if (open + 1 != end && open[1] == '[')
+        {
+            _append(foreground, background, open, 1);
+            pos = open + 2;
+            continue;
+        }
 
-wincc::Console::Console()
+        // Tags are short, so an unmatched bracket does not send the search through the rest of the text.
+        const char *tag_end = end - open > WINCC_MAX_TAG_LENGTH ? open + WINCC_MAX_TAG_LENGTH : end;
+        const char *close = detail::find_byte(open + 1, tag_end, ']');
+        ConsoleColor tag_foreground = foreground;
+        ConsoleColor tag_background = background;
+
+        if (close != tag_end && detail::parse_color_tag(std::string_view(open + 1, (size_t)(close - open - 1)), tag_foreground, tag_background))
+        {
+            foreground = tag_foreground;
+            background = tag_background;
+            pos = close + 1;
+        }
+        else
+        {
+            // Not a color tag, so the bracket is part of the text.
+            _append(foreground, background, open, 1);
+            pos = open + 1;
+        }
+    }
+}
+
+wincc::StyledText wincc::MarkupTemplate::styled() const
 {
-    BOOL winapi_result;
+    StyledText result = { m_text.data(), m_spans.data(), m_spans.size(), m_ansi.data(), m_ansi.size(), m_ansi_lead_size };
+    return result;
+}
+
+void wincc::MarkupTemplate::_append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    StyledSpan *previous = m_spans.empty() ? nullptr : &m_spans.back();
+
+    if (!previous || previous->foreground != foreground || previous->background != background)
+    {
+        // The first span sets both colors since the terminal could be in any state.
+        bool set_foreground = !previous || previous->foreground != foreground;
+        bool set_background = !previous || previous->background != background;
+        char code[4];
+
+        m_ansi += "\x1b[";
+
+        if (set_foreground)
+        {
+            m_ansi.append(code, std::to_chars(code, code + sizeof(code), detail::k_sgr_color_codes[(int)foreground]).ptr);
+        }
+
+        if (set_background)
+        {
+            if (set_foreground)
+            {
+                m_ansi += ';';
+            }
+
+            m_ansi.append(code, std::to_chars(code, code + sizeof(code), detail::k_sgr_color_codes[(int)background] + 10).ptr);
+        }
+
+        m_ansi += 'm';
+
+        if (!previous)
+        {
+            m_ansi_lead_size = m_ansi.size();
+        }
+
+        StyledSpan span = { foreground, background, m_text.size(), 0 };
+        m_spans.push_back(span);
+    }
+
+    m_text.append(text, size);
+    m_ansi.append(text, size);
+    m_spans.back().size += size;
+}
+
+void wincc::StreamSink::write(const char *data, size_t size)
+{
+    fwrite(data, 1, size, m_stream);
+}
+
+void wincc::StreamSink::writev(const IoSlice *slices, size_t count)
+{
+#ifdef _WIN32
+    _lock_file(m_stream);
+#else
+    flockfile(m_stream);
+#endif
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        fwrite(slices[i].data, 1, slices[i].size, m_stream);
+    }
+
+#ifdef _WIN32
+    _unlock_file(m_stream);
+#else
+    funlockfile(m_stream);
+#endif
+}
+
+void wincc::StreamSink::flush()
+{
+    fflush(m_stream);
+}
+
+bool wincc::StreamSink::is_terminal() const
+{
+#ifdef _WIN32
+    return _isatty(_fileno(m_stream)) != 0;
+#else
+    return isatty(fileno(m_stream)) != 0;
+#endif
+}
+
+wincc::FdSink::FdSink(int fd, size_t threshold) : m_fd(fd), m_owns_fd(false), m_threshold(threshold)
+{
+    m_buffer.reserve(threshold);
+}
+
+wincc::FdSink::FdSink(const char *path, size_t threshold) : m_owns_fd(true), m_threshold(threshold)
+{
+#ifdef _WIN32
+    m_fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+    m_buffer.reserve(threshold);
+}
+
+wincc::FdSink::~FdSink()
+{
+    flush();
+
+    if (m_owns_fd && m_fd >= 0)
+    {
+#ifdef _WIN32
+        _close(m_fd);
+#else
+        close(m_fd);
+#endif
+    }
+}
+
+void wincc::FdSink::write(const char *data, size_t size)
+{
+    if (m_buffer.size() + size < m_threshold)
+    {
+        m_buffer.append(data, size);
+        return;
+    }
+
+    // Large writes skip the copy into the buffer.
+    flush();
+
+    if (size >= m_threshold)
+    {
+        _write_all(data, size);
+    }
+    else
+    {
+        m_buffer.append(data, size);
+    }
+}
+
+void wincc::FdSink::writev(const IoSlice *slices, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size += slices[i].size;
+    }
+
+    if (m_buffer.size() + size < m_threshold)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_buffer.append(slices[i].data, slices[i].size);
+        }
+
+        return;
+    }
+
+    // Anything buffered goes first, in the same system call.
+    if (!m_buffer.empty())
+    {
+        m_gather.assign(1, IoSlice{ m_buffer.data(), m_buffer.size() });
+        m_gather.insert(m_gather.end(), slices, slices + count);
+        _writev_all(m_gather.data(), m_gather.size());
+        m_buffer.clear();
+    }
+    else
+    {
+        _writev_all(slices, count);
+    }
+}
+
+void wincc::FdSink::flush()
+{
+    if (!m_buffer.empty())
+    {
+        _write_all(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+    }
+}
+
+bool wincc::FdSink::is_terminal() const
+{
+#ifdef _WIN32
+    return m_fd >= 0 && _isatty(m_fd) != 0;
+#else
+    return m_fd >= 0 && isatty(m_fd) != 0;
+#endif
+}
+
+void wincc::FdSink::_write_all(const char *data, size_t size)
+{
+    while (size > 0 && m_fd >= 0)
+    {
+#ifdef _WIN32
+        int written = _write(m_fd, data, size > 0x40000000 ? 0x40000000u : (unsigned int)size);
+#else
+        ssize_t written = ::write(m_fd, data, size);
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        data += written;
+        size -= (size_t)written;
+    }
+}
+
+void wincc::FdSink::_writev_all(const IoSlice *slices, size_t count)
+{
+#ifdef _WIN32
+    for (size_t i = 0; i < count; ++i)
+    {
+        _write_all(slices[i].data, slices[i].size);
+    }
+#else
+    static_assert(sizeof(IoSlice) == sizeof(struct iovec) && offsetof(IoSlice, data) == offsetof(struct iovec, iov_base) &&
+        offsetof(IoSlice, size) == offsetof(struct iovec, iov_len), "IoSlice must match struct iovec");
+
+    // Bytes of the first slice already written after a partial write.
+    size_t done = 0;
+
+    while (count > 0 && m_fd >= 0)
+    {
+        // A slice cut short by a partial write is finished on its own, then the list carries on.
+        if (done > 0)
+        {
+            _write_all(slices->data + done, slices->size - done);
+            ++slices;
+            --count;
+            done = 0;
+            continue;
+        }
+
+        int batch = count < (size_t)IOV_MAX ? (int)count : IOV_MAX;
+        ssize_t written = ::writev(m_fd, reinterpret_cast<const struct iovec *>(slices), batch);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        size_t left = (size_t)written;
+        while (count > 0 && left >= slices->size)
+        {
+            left -= slices->size;
+            ++slices;
+            --count;
+        }
+
+        done = left;
+    }
+#endif
+}
+
+void wincc::MemorySink::write(const char *data, size_t size)
+{
+    m_buffer.append(data, size);
+}
+
+void wincc::Frame::append(const char *text)
+{
+    _append(k_current_color, k_current_color, text, strlen(text));
+}
+
+void wincc::Frame::append(const char *text, size_t size)
+{
+    _append(k_current_color, k_current_color, text, size);
+}
+
+void wincc::Frame::append(ConsoleColor foreground, const char *text)
+{
+    _append((unsigned char)foreground, k_current_color, text, strlen(text));
+}
+
+void wincc::Frame::append(ConsoleColor foreground, const char *text, size_t size)
+{
+    _append((unsigned char)foreground, k_current_color, text, size);
+}
+
+void wincc::Frame::append(ConsoleColor foreground, ConsoleColor background, const char *text)
+{
+    _append((unsigned char)foreground, (unsigned char)background, text, strlen(text));
+}
+
+void wincc::Frame::append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size)
+{
+    _append((unsigned char)foreground, (unsigned char)background, text, size);
+}
+
+void wincc::Frame::append(unsigned char foreground, unsigned char background, const char *text, size_t size)
+{
+    _append(foreground, background, text, size);
+}
+
+void wincc::Frame::move_cursor(int row, int column)
+{
+    Segment segment = { k_cursor_move, 0, (size_t)row, (size_t)column };
+    m_segments.push_back(segment);
+}
+
+void wincc::Frame::clear()
+{
+    m_text.clear();
+    m_segments.clear();
+}
+
+void wincc::Frame::_append(unsigned char foreground, unsigned char background, const char *text, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (!m_segments.empty() && m_segments.back().foreground == foreground && m_segments.back().background == background)
+    {
+        m_segments.back().size += size;
+    }
+    else
+    {
+        Segment segment = { foreground, background, m_text.size(), size };
+        m_segments.push_back(segment);
+    }
+
+    m_text.append(text, size);
+}
+
+#ifdef WINCC_ENABLE_STATS
+// Add to a counter only the console's writing thread changes. Readers on other threads see a
+// whole value, so no locked add is needed.
+static void stat_add(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
 
+// Counter value since the baseline taken by the last reset.
+static uint64_t stat_since(const std::atomic<uint64_t> &total, const std::atomic<uint64_t> &baseline)
+{
+    uint64_t start = baseline.load(std::memory_order_relaxed);
+    uint64_t now = total.load(std::memory_order_relaxed);
+    return now > start ? now - start : 0;
+}
+#endif
+
+uint64_t wincc::ConsoleStats::latency_percentile(double fraction) const
+{
+    uint64_t total = 0;
+    for (uint64_t count : latency)
+    {
+        total += count;
+    }
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    // The number of calls that must fall at or below the answer, at least one.
+    uint64_t wanted = (uint64_t)(fraction * (double)total);
+    wanted = wanted < 1 ? 1 : wanted > total ? total : wanted;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_latency_buckets; ++i)
+    {
+        seen += latency[i];
+        if (seen >= wanted)
+        {
+            return (uint64_t)1 << (i + 1);
+        }
+    }
+
+    return (uint64_t)1 << k_latency_buckets;
+}
+
+wincc::Console::Console() : Console(ConsoleBackend::Auto)
+{
+}
+
+wincc::Console::Console(ConsoleBackend backend, OutputSink *sink)
+    : m_backend(backend), m_color_depth(ColorDepth::Basic), m_stdout_sink(stdout), m_sink(sink ? sink : &m_stdout_sink), m_scrollback(nullptr),
+      m_console_handle(nullptr),
+      m_saved_code_page(0), m_style_depth(0), m_switch_count(0), m_requested_switches(0)
+{
+#ifdef _WIN32
     m_console_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+#endif
+
+    if (m_backend == ConsoleBackend::Auto)
+    {
+#ifdef _WIN32
+        DWORD console_mode;
+        if (m_sink == &m_stdout_sink)
+        {
+            m_backend = GetConsoleMode(m_console_handle, &console_mode) ? ConsoleBackend::Win32 : ConsoleBackend::Plain;
+        }
+        else
+#endif
+        {
+            m_backend = m_sink->is_terminal() ? ConsoleBackend::Ansi : ConsoleBackend::Plain;
+        }
+    }
+
+#ifdef _WIN32
+    // Text, wide text included, reaches the console as UTF-8.
+    if (m_backend == ConsoleBackend::Win32 || (m_backend == ConsoleBackend::Ansi && m_sink == &m_stdout_sink))
+    {
+        m_saved_code_page = GetConsoleOutputCP();
+        SetConsoleOutputCP(CP_UTF8);
+    }
+#else
+    assert(m_backend != ConsoleBackend::Win32 && "The Win32 backend is only available on Windows");
+#endif
+
+    if (m_backend != ConsoleBackend::Win32)
+    {
+        if (m_backend == ConsoleBackend::Ansi)
+        {
+            m_color_depth = detect_color_depth();
+        }
+
+#ifdef _WIN32
+        // Windows 10 consoles understand escape sequences, 24-bit colors included, once virtual
+        // terminal processing is on.
+        DWORD mode;
+        if (m_backend == ConsoleBackend::Ansi && m_sink == &m_stdout_sink && GetConsoleMode(m_console_handle, &mode))
+        {
+            SetConsoleMode(m_console_handle, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+            m_color_depth = ColorDepth::TrueColor;
+        }
+#endif
+
+        // Terminals cannot be asked for their colors, so "ConsoleColor::Default" maps to the
+        // terminal's own default, which is also assumed to be in effect right now.
+        m_default_foreground = WINCC_DEFAULT_FOREGROUND;
+        m_default_background = WINCC_DEFAULT_BACKGROUND;
+        m_current_text_attribute = m_default_foreground | m_default_background;
+        m_applied_attribute = m_current_text_attribute;
+
+        m_foreground_color = ConsoleColor::Default;
+        m_background_color = ConsoleColor::Default;
+        return;
+    }
+
+#ifdef _WIN32
+    BOOL winapi_result;
 
     // Get colors the console is using at the time of initialization. This may be different
     // depending on cmd.exe and powershell.exe or if the user configured different colors. The 
@@ -56,6 +1513,7 @@ wincc::Console::Console()
         m_default_background = console_info.wAttributes & WINCC_BACKGROUND_MASK;
     }
     else
+#endif
     {
         // Fall back to default gray on black.
         m_default_foreground = _convert_attributes(ConsoleColor::Gray);
@@ -63,43 +1521,188 @@ wincc::Console::Console()
         m_current_text_attribute = m_default_foreground | m_default_background;
     }
 
-    // Set enum values. Background needs shifted right for conversion.
-    m_foreground_color = _color_from_attribute(m_default_foreground);
-    m_background_color = _color_from_attribute(m_default_background >> WINCC_BG_SHIFT);
+    m_applied_attribute = m_current_text_attribute;
+
+    // Set enum values. Background needs shifted right for conversion.
+    m_foreground_color = _color_from_attribute(m_default_foreground);
+    m_background_color = _color_from_attribute(m_default_background >> WINCC_BG_SHIFT);
+}
+
+wincc::Console::~Console()
+{
+    if (m_backend != ConsoleBackend::Win32)
+    {
+        // Leave the terminal in its default colors.
+        _apply_attribute(m_default_foreground | m_default_background);
+        _device_flush();
+    }
+    else
+    {
+        // Colors set on a Windows console outlive the process, so apply what was last asked for.
+        _apply_attribute(m_current_text_attribute);
+    }
+
+#ifdef _WIN32
+    if (m_saved_code_page)
+    {
+        fflush(stdout);
+        SetConsoleOutputCP(m_saved_code_page);
+    }
+
+    CloseHandle(m_console_handle);
+#endif
+}
+
+void wincc::Console::background_color(ConsoleColor value)
+{
+    m_background_color = value;
+    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
+
+    // Applied right before the next write.
+    _count_requests(1);
+}
+
+void wincc::Console::foreground_color(ConsoleColor value)
+{
+    m_foreground_color = value;
+    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
+
+    // Applied right before the next write.
+    _count_requests(1);
+}
+
+void wincc::Console::reset_colors()
+{
+    // Set enum values. Background needs shifted right for conversion.
+    m_foreground_color = _color_from_attribute(m_default_foreground);
+    m_background_color = _color_from_attribute(m_default_background >> WINCC_BG_SHIFT);
+
+    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
+
+    // Applied right before the next write.
+    _count_requests(1);
+}
+
+void wincc::Console::push_style(ConsoleColor foreground)
+{
+    push_style(Style{ foreground, m_background_color });
+}
+
+void wincc::Console::push_style(ConsoleColor foreground, ConsoleColor background)
+{
+    push_style(Style{ foreground, background });
+}
+
+void wincc::Console::push_style(const Style &style)
+{
+    if (m_style_depth < k_style_stack_capacity)
+    {
+        m_style_stack[m_style_depth] = this->style();
+    }
+
+    ++m_style_depth;
+    _set_style(style);
+}
+
+void wincc::Console::pop_style()
+{
+    if (m_style_depth == 0)
+    {
+        return;
+    }
+
+    --m_style_depth;
+    if (m_style_depth < k_style_stack_capacity)
+    {
+        _set_style(m_style_stack[m_style_depth]);
+    }
+}
+
+void wincc::Console::flush()
+{
+    _apply_attribute(m_current_text_attribute);
+
+    _device_flush();
 }
 
-wincc::Console::~Console()
+size_t wincc::Console::avoided_switch_count() const
 {
-    CloseHandle(m_console_handle);
+    return m_requested_switches > m_switch_count ? m_requested_switches - m_switch_count : 0;
 }
 
-void wincc::Console::background_color(ConsoleColor value)
+wincc::ConsoleStats wincc::Console::stats() const
 {
-    m_background_color = value;
-    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
-    SetConsoleTextAttribute(m_console_handle, (WORD)m_current_text_attribute);
+    ConsoleStats stats;
+
+#ifdef WINCC_ENABLE_STATS
+    stats.writes = stat_since(m_stats.writes, m_stats_baseline.writes);
+    stats.bytes = stat_since(m_stats.bytes, m_stats_baseline.bytes);
+    stats.switches = stat_since(m_stats.switches, m_stats_baseline.switches);
+    stats.flushes = stat_since(m_stats.flushes, m_stats_baseline.flushes);
+    stats.blocked_ns = stat_since(m_stats.blocked_ns, m_stats_baseline.blocked_ns);
+
+    uint64_t requested = stat_since(m_stats.requested_switches, m_stats_baseline.requested_switches);
+    stats.avoided_switches = requested > stats.switches ? requested - stats.switches : 0;
+
+    for (size_t i = 0; i < ConsoleStats::k_latency_buckets; ++i)
+    {
+        stats.latency[i] = stat_since(m_stats.latency[i], m_stats_baseline.latency[i]);
+    }
+#endif
+
+    return stats;
 }
 
-void wincc::Console::foreground_color(ConsoleColor value)
+void wincc::Console::reset_stats()
 {
-    m_foreground_color = value;
-    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
-    SetConsoleTextAttribute(m_console_handle, (WORD)m_current_text_attribute);
+#ifdef WINCC_ENABLE_STATS
+    // The writing thread keeps adding to the totals, so a reset moves the baseline instead.
+    auto mark = [](const std::atomic<uint64_t> &total, std::atomic<uint64_t> &baseline)
+    {
+        baseline.store(total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    };
+
+    mark(m_stats.writes, m_stats_baseline.writes);
+    mark(m_stats.bytes, m_stats_baseline.bytes);
+    mark(m_stats.switches, m_stats_baseline.switches);
+    mark(m_stats.requested_switches, m_stats_baseline.requested_switches);
+    mark(m_stats.flushes, m_stats_baseline.flushes);
+    mark(m_stats.blocked_ns, m_stats_baseline.blocked_ns);
+
+    for (size_t i = 0; i < ConsoleStats::k_latency_buckets; ++i)
+    {
+        mark(m_stats.latency[i], m_stats_baseline.latency[i]);
+    }
+#endif
 }
 
-void wincc::Console::reset_colors()
+void wincc::Console::move_cursor(int row, int column)
 {
-    // Set enum values. Background needs shifted right for conversion.
-    m_foreground_color = _color_from_attribute(m_default_foreground);
-    m_background_color = _color_from_attribute(m_default_background >> WINCC_BG_SHIFT);
+    if (m_backend == ConsoleBackend::Plain)
+    {
+        return;
+    }
 
-    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
-    SetConsoleTextAttribute(m_console_handle, (WORD)m_current_text_attribute);
+    if (m_backend == ConsoleBackend::Ansi)
+    {
+        char sequence[WINCC_MAX_CURSOR_MOVE_LENGTH];
+        size_t length = format_cursor_move(row, column, sequence);
+        _device_write(sequence, length);
+        return;
+    }
+
+#ifdef _WIN32
+    // Text already printed must land before the cursor moves.
+    fflush(stdout);
+
+    COORD position = { (SHORT)column, (SHORT)row };
+    SetConsoleCursorPosition(m_console_handle, position);
+#endif
 }
 
 void wincc::Console::write(const char *msg)
 {
-    printf(msg);
+    _write_text(m_current_text_attribute, msg, false);
 }
 
 void wincc::Console::write(ConsoleColor foreground, const char *msg)
@@ -112,9 +1715,56 @@ void wincc::Console::write(ConsoleColor foreground, ConsoleColor background, con
     _single_set_write(foreground, background, msg, false);
 }
 
+void wincc::Console::write(Color foreground, const char *msg)
+{
+    write(foreground, Color(m_background_color), msg);
+}
+
+void wincc::Console::write(Color foreground, Color background, const char *msg)
+{
+    bool extended = foreground.kind != Color::Kind::Console || background.kind != Color::Kind::Console;
+
+    if (!extended || m_backend != ConsoleBackend::Ansi || m_color_depth == ColorDepth::Basic)
+    {
+        _single_set_write(foreground.console_color(), background.console_color(), msg, false);
+        return;
+    }
+
+    _count_requests(2);
+
+    size_t size = strlen(msg);
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (m_scrollback)
+    {
+        m_scrollback->append(foreground.console_color(), background.console_color(), msg, size);
+    }
+
+    // The attribute model cannot hold extended colors, so the terminal's attribute becomes unknown
+    // and the next switch sets both colors. Runs in the same extended colors still switch once.
+    if (m_applied_attribute == WINCC_UNKNOWN_ATTRIBUTE && m_extended_foreground == foreground &&
+        m_extended_background == background)
+    {
+        _device_write(msg, size);
+        return;
+    }
+
+    char sequence[WINCC_MAX_EXTENDED_SGR_LENGTH];
+    IoSlice slices[] = { { sequence, _format_extended_sgr(foreground, background, sequence) }, { msg, size } };
+    _device_writev(slices, 2);
+
+    m_applied_attribute = WINCC_UNKNOWN_ATTRIBUTE;
+    m_extended_foreground = foreground;
+    m_extended_background = background;
+    _count_switches(1);
+}
+
 void wincc::Console::writewc(const wchar_t *msg)
 {
-    wprintf(msg);
+    _write_text(m_current_text_attribute, msg, true);
 }
 
 void wincc::Console::writewc(ConsoleColor foreground, const wchar_t *msg)
@@ -127,93 +1777,156 @@ void wincc::Console::writewc(ConsoleColor foreground, ConsoleColor background, c
     _single_set_write(foreground, background, msg, true);
 }
 
-int wincc::Console::_convert_attributes(ConsoleColor color)
+void wincc::Console::write(const StyledText &styled)
 {
-    WORD result_attr;
+    if (styled.span_count == 0)
+    {
+        return;
+    }
+
+    // Every span stands in for a colored write.
+    _count_requests(2 * styled.span_count);
+
+    const StyledSpan &last = styled.spans[styled.span_count - 1];
 
-    switch (color)
+    // The Win32 backend records as it writes each span.
+    if (m_scrollback && m_backend != ConsoleBackend::Win32)
     {
-    case ConsoleColor::Blue:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_INTENSITY;
-        break;
-    case ConsoleColor::Green:
-        result_attr = FOREGROUND_GREEN | FOREGROUND_INTENSITY;
-        break;
-    case ConsoleColor::Red:
-        result_attr = FOREGROUND_RED | FOREGROUND_INTENSITY;
-        break;
+        for (size_t i = 0; i < styled.span_count; ++i)
+        {
+            const StyledSpan &span = styled.spans[i];
+            m_scrollback->append(span.foreground, span.background, styled.text + span.offset, span.size);
+        }
+    }
 
+    if (m_backend == ConsoleBackend::Plain)
+    {
+        // Spans are contiguous, so the text is one piece.
+        _device_write(styled.text, last.offset + last.size);
+        return;
+    }
 
-    case ConsoleColor::DarkBlue:
-        result_attr = FOREGROUND_BLUE;
-        break;
-    case ConsoleColor::DarkGreen:
-        result_attr = FOREGROUND_GREEN;
-        break;
-    case ConsoleColor::DarkRed:
-        result_attr = FOREGROUND_RED;
-        break;
+    if (m_backend == ConsoleBackend::Win32)
+    {
+        for (size_t i = 0; i < styled.span_count; ++i)
+        {
+            const StyledSpan &span = styled.spans[i];
+            _write_bytes(_compute_text_attribute(span.foreground, span.background), styled.text + span.offset, span.size);
+        }
 
+        return;
+    }
 
-    case ConsoleColor::Cyan:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY;
-        break;
-    case ConsoleColor::Violet:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_RED | FOREGROUND_INTENSITY;
-        break;
-    case ConsoleColor::Yellow:
-        result_attr = FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY;
-        break;
+    const StyledSpan &first = styled.spans[0];
+
+    size_t skip = 0;
+    size_t switches = styled.span_count;
+    if (_compute_text_attribute(first.foreground, first.background) == m_applied_attribute)
+    {
+        skip = styled.ansi_lead_size;
+        --switches;
+    }
 
+    _device_write(styled.ansi + skip, styled.ansi_size - skip);
 
-    case ConsoleColor::DarkCyan:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_GREEN;
-        break;
-    case ConsoleColor::DarkViolet:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_RED;
-        break;
-    case ConsoleColor::DarkYellow:
-        result_attr = FOREGROUND_GREEN | FOREGROUND_RED;
-        break;
+    m_applied_attribute = _compute_text_attribute(last.foreground, last.background);
+    _count_switches(switches);
+}
 
+void wincc::Console::commit(const Frame &frame)
+{
+    if (m_backend == ConsoleBackend::Win32)
+    {
+        // Console attributes apply at the moment text is written, so each segment is its own write.
+        for (const Frame::Segment &segment : frame.m_segments)
+        {
+            if (segment.foreground == Frame::k_cursor_move)
+            {
+                move_cursor((int)segment.offset, (int)segment.size);
+                continue;
+            }
 
-    case ConsoleColor::White:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY;
-        break;
+            int attribute = _segment_attribute(segment.foreground, segment.background);
+            _write_bytes(attribute, frame.m_text.data() + segment.offset, segment.size);
+        }
 
-    case ConsoleColor::Gray:
-        result_attr = FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED;
-        break;
+        return;
+    }
+
+    // Cursor moves are the only sequences formatted here. Room for all of them is reserved up
+    // front so the slices pointing into the scratch buffer stay valid.
+    size_t cursor_moves = 0;
+    for (const Frame::Segment &segment : frame.m_segments)
+    {
+        cursor_moves += segment.foreground == Frame::k_cursor_move;
+    }
 
+    m_scratch.clear();
+    m_scratch.reserve(m_backend == ConsoleBackend::Ansi ? cursor_moves * WINCC_MAX_CURSOR_MOVE_LENGTH : 0);
+    m_slices.clear();
 
-    // Black for fall through color.
-    case ConsoleColor::Black:
-    default:
-        result_attr = 0;
-        break;
+    for (const Frame::Segment &segment : frame.m_segments)
+    {
+        if (segment.foreground == Frame::k_cursor_move)
+        {
+            if (m_backend == ConsoleBackend::Ansi)
+            {
+                size_t start = m_scratch.size();
+                char sequence[WINCC_MAX_CURSOR_MOVE_LENGTH];
+                m_scratch.append(sequence, format_cursor_move((int)segment.offset, (int)segment.size, sequence));
+                append_slice(m_slices, m_scratch.data() + start, m_scratch.size() - start);
+            }
+
+            continue;
+        }
+
+        int attribute = _segment_attribute(segment.foreground, segment.background);
+        _record(attribute, frame.m_text.data() + segment.offset, segment.size);
+
+        std::string_view sequence = _take_switch(attribute);
+        append_slice(m_slices, sequence.data(), sequence.size());
+        append_slice(m_slices, frame.m_text.data() + segment.offset, segment.size);
+    }
+
+    if (!m_slices.empty())
+    {
+        _device_writev(m_slices.data(), m_slices.size());
     }
+}
 
-    return result_attr;
+int wincc::Console::_convert_attributes(ConsoleColor color)
+{
+    return color_attribute(color);
 }
 
 void wincc::Console::_single_set_write(ConsoleColor foreground, ConsoleColor background, const void* msg, bool is_wide)
 {
-    // Change foreground and background color.
-    int temp_attribute = _compute_text_attribute(foreground, background);
-    SetConsoleTextAttribute(m_console_handle, (WORD)temp_attribute);
+    _write_text(_single_set_attribute(foreground, background), msg, is_wide);
+}
 
-    // Use implementation function to write.
-    if (is_wide)
-    {
-        wprintf((const wchar_t *)msg);
-    }
-    else
+int wincc::Console::_single_set_attribute(ConsoleColor foreground, ConsoleColor background)
+{
+    // Setting the colors and reverting them afterwards are both deferred until text needs them, so
+    // a run of writes in the same colors switches at most once.
+    _count_requests(2);
+
+    return _compute_text_attribute(foreground, background);
+}
+
+void wincc::Console::_set_style(const Style &style)
+{
+    // Nested styles often restore the colors already in effect, which needs no work at all.
+    if (style == this->style())
     {
-        printf((const char *)msg);
+        return;
     }
 
-    // Revert color.
-    SetConsoleTextAttribute(m_console_handle, (WORD)m_current_text_attribute);
+    m_foreground_color = style.foreground;
+    m_background_color = style.background;
+    m_current_text_attribute = _compute_text_attribute(m_foreground_color, m_background_color);
+
+    // Applied right before the next write.
+    _count_requests(1);
 }
 
 int wincc::Console::_compute_text_attribute(ConsoleColor foreground, ConsoleColor background)
@@ -248,66 +1961,311 @@ int wincc::Console::_compute_text_attribute(ConsoleColor foreground, ConsoleColo
 
 wincc::ConsoleColor wincc::Console::_color_from_attribute(int attribute)
 {
-    ConsoleColor result_color;
+    // Only the ANSI backend uses the default flag, for colors it cannot look up.
+    if (attribute & WINCC_DEFAULT_FOREGROUND)
+    {
+        return ConsoleColor::Default;
+    }
+
+    return k_attribute_colors[attribute & WINCC_FOREGROUND_MASK];
+}
+
+size_t wincc::Console::_format_extended_sgr(Color foreground, Color background, char *dst) const
+{
+    char *out = dst;
+    *out++ = '\x1b';
+    *out++ = '[';
+    out = append_color_parameters(out, foreground, 30, m_color_depth);
+    *out++ = ';';
+    out = append_color_parameters(out, background, 40, m_color_depth);
+    *out++ = 'm';
+    return (size_t)(out - dst);
+}
 
-    switch (attribute)
+void wincc::Console::_apply_attribute(int attribute)
+{
+    if (m_backend != ConsoleBackend::Win32)
     {
-    case FOREGROUND_BLUE | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::Blue;
-        break;
-    case FOREGROUND_GREEN | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::Green;
-        break;
-    case FOREGROUND_RED | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::Red;
-        break;
+        std::string_view sequence = _take_switch(attribute);
+        if (!sequence.empty())
+        {
+            _device_write(sequence.data(), sequence.size());
+        }
 
-    case FOREGROUND_BLUE:
-        result_color = ConsoleColor::DarkBlue;
-        break;
-    case FOREGROUND_GREEN:
-        result_color = ConsoleColor::DarkGreen;
-        break;
-    case FOREGROUND_RED:
-        result_color = ConsoleColor::DarkRed;
-        break;
+        return;
+    }
 
-    case FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::Cyan;
-        break;
-    case FOREGROUND_BLUE | FOREGROUND_RED | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::Violet;
-        break;
-    case FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::Yellow;
-        break;
+#ifdef _WIN32
+    if (attribute != m_applied_attribute)
+    {
+        SetConsoleTextAttribute(m_console_handle, (WORD)attribute);
+        m_applied_attribute = attribute;
+        _count_switches(1);
+    }
+#endif
+}
 
+void wincc::Console::_write_text(int attribute, const void *msg, bool is_wide)
+{
+    // Nothing is printed, so the colors do not need to change.
+    if (is_wide ? *(const wchar_t *)msg == 0 : *(const char *)msg == 0)
+    {
+        return;
+    }
 
-    case FOREGROUND_BLUE | FOREGROUND_GREEN:
-        result_color = ConsoleColor::DarkCyan;
-        break;
-    case FOREGROUND_BLUE | FOREGROUND_RED:
-        result_color = ConsoleColor::DarkViolet;
-        break;
-    case FOREGROUND_GREEN | FOREGROUND_RED:
-        result_color = ConsoleColor::DarkYellow;
-        break;
+    if (is_wide)
+    {
+        const wchar_t *text = (const wchar_t *)msg;
+        _write_wide(attribute, text, wcslen(text));
+    }
+    else
+    {
+        const char *text = (const char *)msg;
+        _write_bytes(attribute, text, strlen(text));
+    }
+}
 
+void wincc::Console::_write_wide(int attribute, const wchar_t *text, size_t size)
+{
+    // Wide text goes out as UTF-8 through the same path as narrow text, so the two mix freely.
+    m_scratch.resize(size * detail::k_max_utf8_per_wchar);
+    size_t length = detail::utf8_from_wide(text, size, &m_scratch[0]);
+    _write_bytes(attribute, m_scratch.data(), length);
+}
 
-    case FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY:
-        result_color = ConsoleColor::White;
-        break;
+void wincc::Console::_record(int attribute, const char *data, size_t size)
+{
+    if (m_scrollback)
+    {
+        m_scrollback->append(_color_from_attribute(attribute), _color_from_attribute(attribute >> WINCC_BG_SHIFT), data,
+            size);
+    }
+}
 
-    case FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED:
-        result_color = ConsoleColor::Gray;
-        break;
+void wincc::Console::_write_bytes(int attribute, const char *data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
 
-    // Black for fall through color.
-    case 0:
-    default:
-        result_color = ConsoleColor::Black;
-        break;
+    _record(attribute, data, size);
+
+    if (m_backend == ConsoleBackend::Win32)
+    {
+        _apply_attribute(attribute);
+        _device_write(data, size);
+        return;
+    }
+
+    // The switch comes from a static table and the text is used where it lies, so both reach the
+    // sink in one gather write without being copied together.
+    std::string_view sequence = _take_switch(attribute);
+    if (sequence.empty())
+    {
+        _device_write(data, size);
+        return;
+    }
+
+    IoSlice slices[] = { { sequence.data(), sequence.size() }, { data, size } };
+    _device_writev(slices, 2);
+}
+
+std::string_view wincc::Console::_take_switch(int attribute)
+{
+    if (attribute == m_applied_attribute || m_backend == ConsoleBackend::Plain)
+    {
+        return std::string_view();
+    }
+
+    std::string_view sequence = sgr_switch(m_applied_attribute, attribute);
+    m_applied_attribute = attribute;
+    _count_switches(1);
+    return sequence;
+}
+
+int wincc::Console::_segment_attribute(unsigned char foreground, unsigned char background)
+{
+    // Segments in the current colors need no switch of their own.
+    if (foreground == Frame::k_current_color && background == Frame::k_current_color)
+    {
+        return m_current_text_attribute;
+    }
+
+    // A colored segment stands in for a colored write: set, then revert.
+    _count_requests(2);
+
+    ConsoleColor fg = foreground == Frame::k_current_color ? m_foreground_color : (ConsoleColor)foreground;
+    ConsoleColor bg = background == Frame::k_current_color ? m_background_color : (ConsoleColor)background;
+    return _compute_text_attribute(fg, bg);
+}
+
+void wincc::Console::_count_switches(size_t count)
+{
+    m_switch_count += count;
+
+#ifdef WINCC_ENABLE_STATS
+    stat_add(m_stats.switches, count);
+#endif
+}
+
+void wincc::Console::_count_requests(size_t count)
+{
+    m_requested_switches += count;
+
+#ifdef WINCC_ENABLE_STATS
+    stat_add(m_stats.requested_switches, count);
+#endif
+}
+
+void wincc::Console::_device_write(const char *data, size_t size)
+{
+#ifdef WINCC_ENABLE_STATS
+    uint64_t start = (uint64_t)detail::steady_ns();
+#endif
+
+    if (m_backend == ConsoleBackend::Win32)
+    {
+        fwrite(data, 1, size, stdout);
+    }
+    else
+    {
+        m_sink->write(data, size);
+    }
+
+#ifdef WINCC_ENABLE_STATS
+    _record_blocking(start, size, false);
+#endif
+}
+
+void wincc::Console::_device_writev(const IoSlice *slices, size_t count)
+{
+#ifdef WINCC_ENABLE_STATS
+    uint64_t start = (uint64_t)detail::steady_ns();
+#endif
+
+    m_sink->writev(slices, count);
+
+#ifdef WINCC_ENABLE_STATS
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size += slices[i].size;
+    }
+
+    _record_blocking(start, size, false);
+#endif
+}
+
+void wincc::Console::_device_flush()
+{
+#ifdef WINCC_ENABLE_STATS
+    uint64_t start = (uint64_t)detail::steady_ns();
+#endif
+
+    if (m_backend == ConsoleBackend::Win32)
+    {
+        fflush(stdout);
+    }
+    else
+    {
+        m_sink->flush();
+    }
+
+#ifdef WINCC_ENABLE_STATS
+    _record_blocking(start, 0, true);
+#endif
+}
+
+#ifdef WINCC_ENABLE_STATS
+void wincc::Console::_record_blocking(uint64_t start_ns, size_t bytes, bool is_flush)
+{
+    uint64_t elapsed = (uint64_t)detail::steady_ns() - start_ns;
+    size_t bucket = elapsed ? (size_t)std::bit_width(elapsed) - 1 : 0;
+
+    if (is_flush)
+    {
+        stat_add(m_stats.flushes, 1);
+    }
+    else
+    {
+        stat_add(m_stats.writes, 1);
+        stat_add(m_stats.bytes, bytes);
+    }
+
+    stat_add(m_stats.blocked_ns, elapsed);
+    stat_add(m_stats.latency[std::min(bucket, ConsoleStats::k_latency_buckets - 1)], 1);
+}
+#endif
+
+void wincc::backend::Ansi::_switch(ConsoleColor foreground, ConsoleColor background)
+{
+    // Switches that were never written collapse into one from the colors last written.
+    int from = m_pending.empty() ? ansi_attribute(m_foreground, m_background) : m_pending_from;
+    m_pending = sgr_switch(from, ansi_attribute(foreground, background));
+    m_pending_from = from;
+
+    m_foreground = foreground;
+    m_background = background;
+}
+
+void wincc::backend::Ansi::_write_switched(const char *data, size_t size)
+{
+    if (m_pending.empty())
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    _lock_file(m_stream);
+#else
+    flockfile(m_stream);
+#endif
+
+    fwrite(m_pending.data(), 1, m_pending.size(), m_stream);
+    if (size > 0)
+    {
+        fwrite(data, 1, size, m_stream);
     }
 
-    return result_color;
+#ifdef _WIN32
+    _unlock_file(m_stream);
+#else
+    funlockfile(m_stream);
+#endif
+
+    m_pending = std::string_view();
+}
+
+#ifdef _WIN32
+wincc::backend::Win32::Win32() : m_console_handle(GetStdHandle(STD_OUTPUT_HANDLE))
+{
+    CONSOLE_SCREEN_BUFFER_INFO console_info;
+    m_default_attribute = GetConsoleScreenBufferInfo(m_console_handle, &console_info)
+        ? console_info.wAttributes : color_attribute(ConsoleColor::Gray);
+
+    // Text, wide text included, reaches the console as UTF-8.
+    m_saved_code_page = GetConsoleOutputCP();
+    SetConsoleOutputCP(CP_UTF8);
+}
+
+wincc::backend::Win32::~Win32()
+{
+    fflush(stdout);
+    SetConsoleOutputCP(m_saved_code_page);
+}
+
+void wincc::backend::Win32::_switch(ConsoleColor foreground, ConsoleColor background)
+{
+    int attribute = foreground == ConsoleColor::Default ? m_default_attribute & WINCC_FOREGROUND_MASK : color_attribute(foreground);
+    attribute |= background == ConsoleColor::Default ? m_default_attribute & WINCC_BACKGROUND_MASK
+        : color_attribute(background) << WINCC_BG_SHIFT;
+
+    // Text already printed must land in the old colors.
+    fflush(stdout);
+    SetConsoleTextAttribute(m_console_handle, (WORD)attribute);
+
+    m_foreground = foreground;
+    m_background = background;
 }
+#endif
@@ -24,6 +24,18 @@ SOFTWARE.
 #ifndef _WIN_COLOR_CONSOLE_HH
 #define _WIN_COLOR_CONSOLE_HH
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifdef WINCC_ENABLE_STATS
+#include <atomic>
+#endif
+
+#include "win_color_format.hh"
+
 namespace wincc
 {
     // Colors available for windows consoles. These match what the results are from macros defined
@@ -45,21 +57,551 @@ namespace wincc
         DarkYellow,
         White,
         Gray,
+        DarkGray,
 
         Default
     };
 
+    namespace detail
+    {
+        // Lower case names of the colors, in enum order.
+        inline constexpr std::string_view k_color_names[] =
+        {
+            "black", "blue", "green", "red", "darkblue", "darkgreen", "darkred", "cyan", "violet", "yellow",
+            "darkcyan", "darkviolet", "darkyellow", "white", "gray", "darkgray", "default"
+        };
+
+        // SGR foreground parameter for each color, in enum order. Backgrounds are ten higher.
+        inline constexpr int k_sgr_color_codes[] = { 30, 94, 92, 91, 34, 32, 31, 96, 95, 93, 36, 35, 33, 97, 37, 90, 39 };
+
+        // Typical terminal RGB values for each color, in enum order, used to find the nearest color
+        // to an RGB or 256-color value.
+        inline constexpr unsigned char k_color_rgb[][3] =
+        {
+            { 0, 0, 0 }, { 92, 92, 255 }, { 0, 255, 0 }, { 255, 0, 0 }, { 0, 0, 238 }, { 0, 205, 0 }, { 205, 0, 0 },
+            { 0, 255, 255 }, { 255, 0, 255 }, { 255, 255, 0 }, { 0, 205, 205 }, { 205, 0, 205 }, { 205, 205, 0 },
+            { 255, 255, 255 }, { 229, 229, 229 }, { 127, 127, 127 }
+        };
+
+        // Find the first c in [begin, end), or end if there is none. Uses SSE2 on x86-64 so text
+        // without c streams through at memory speed.
+        const char *find_byte(const char *begin, const char *end, char c);
+
+        // Plain loop version of find_byte, used where SSE2 is not available.
+        const char *find_byte_scalar(const char *begin, const char *end, char c);
+
+        // Most UTF-8 bytes a single wchar_t turns into. A UTF-16 unit gives at most three, as a
+        // surrogate pair gives four from two units, and a UTF-32 unit at most four.
+        inline constexpr size_t k_max_utf8_per_wchar = sizeof(wchar_t) == 2 ? 3 : 4;
+
+        // Convert size wide characters, UTF-16 or UTF-32 depending on the size of wchar_t, to UTF-8
+        // in dst, which needs room for k_max_utf8_per_wchar bytes per character. Invalid code
+        // units become U+FFFD. Returns the number of bytes written. Blocks that are all ASCII or
+        // all two-byte characters are converted with SSE2, or AVX2 when compiled for it.
+        size_t utf8_from_wide(const wchar_t *text, size_t size, char *dst);
+
+        // Plain loop version of utf8_from_wide.
+        size_t utf8_from_wide_scalar(const wchar_t *text, size_t size, char *dst);
+
+        // Decode the UTF-8 sequence at text[pos] and advance pos past it. Malformed input decodes
+        // to U+FFFD one byte at a time.
+        char32_t decode_utf8(std::string_view text, size_t &pos);
+
+        // Steady clock time in nanoseconds, for timeouts, intervals and timing writes.
+        int64_t steady_ns();
+    }
+
+    // Look up a color by its enum name, ignoring case, such as "DarkRed" or "darkred". Returns false
+    // if there is no color with that name.
+    constexpr bool color_from_name(std::string_view name, ConsoleColor &color)
+    {
+        for (size_t i = 0; i < sizeof(detail::k_color_names) / sizeof(detail::k_color_names[0]); ++i)
+        {
+            std::string_view candidate = detail::k_color_names[i];
+            bool match = candidate.size() == name.size();
+
+            for (size_t c = 0; match && c < name.size(); ++c)
+            {
+                char lower = (name[c] >= 'A' && name[c] <= 'Z') ? (char)(name[c] - 'A' + 'a') : name[c];
+                match = lower == candidate[c];
+            }
+
+            if (match)
+            {
+                color = (ConsoleColor)i;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    namespace detail
+    {
+        // Parse the body of a color tag: a color name such as "red" sets the foreground, "white on
+        // blue" sets both colors, and "/" goes back to the defaults. Used by wincc::styled and
+        // MarkupTemplate.
+        constexpr bool parse_color_tag(std::string_view tag, ConsoleColor &foreground, ConsoleColor &background)
+        {
+            if (tag == "/")
+            {
+                foreground = ConsoleColor::Default;
+                background = ConsoleColor::Default;
+                return true;
+            }
+
+            size_t on = tag.find(" on ");
+            if (on == std::string_view::npos)
+            {
+                return color_from_name(tag, foreground);
+            }
+
+            return color_from_name(tag.substr(0, on), foreground) && color_from_name(tag.substr(on + 4), background);
+        }
+    }
+
+    // How many colors a terminal can show.
+    enum class ColorDepth
+    {
+        // The ConsoleColor palette only. Windows consoles driven through the Win32 API.
+        Basic,
+
+        // The xterm 256-color palette.
+        Indexed,
+
+        // Any 24-bit RGB value.
+        TrueColor
+    };
+
+    // Color beyond the ConsoleColor palette, packed into four bytes: a ConsoleColor, an entry of
+    // the xterm 256-color palette or an RGB value. Consoles that can show it get it exactly; the
+    // others get the nearest ConsoleColor, found in a precomputed table.
+    struct Color
+    {
+        // What the color bytes hold.
+        enum class Kind : unsigned char
+        {
+            // A ConsoleColor in red.
+            Console,
+
+            // A 256-color palette index in red.
+            Indexed,
+
+            // Red, green and blue.
+            Rgb
+        };
+
+        constexpr Color() : Color(ConsoleColor::Default) {}
+
+        constexpr Color(ConsoleColor color) : red((unsigned char)color), green(0), blue(0), kind(Kind::Console) {}
+
+        // A 24-bit color.
+        static constexpr Color rgb(unsigned char red, unsigned char green, unsigned char blue)
+        {
+            Color color;
+            color.red = red;
+            color.green = green;
+            color.blue = blue;
+            color.kind = Kind::Rgb;
+            return color;
+        }
+
+        // An entry of the xterm 256-color palette.
+        static constexpr Color indexed(unsigned char index)
+        {
+            Color color;
+            color.red = index;
+            color.kind = Kind::Indexed;
+            return color;
+        }
+
+        // Nearest ConsoleColor.
+        ConsoleColor console_color() const;
+
+        constexpr bool operator==(const Color &other) const = default;
+
+        unsigned char red;
+        unsigned char green;
+        unsigned char blue;
+        Kind kind;
+    };
+
+    static_assert(sizeof(Color) == 4, "Color is packed into four bytes");
+
+    // Find the nearest ConsoleColor for each of count colors and store them in dst. Runs of RGB
+    // colors are looked up four at a time with SSE2, fast enough to quantize a full-screen heatmap
+    // every frame.
+    void quantize(const Color *colors, size_t count, ConsoleColor *dst);
+
+    namespace detail
+    {
+        // Plain loop version of quantize.
+        void quantize_scalar(const Color *colors, size_t count, ConsoleColor *dst);
+    }
+
+    // Run of text in one pair of colors within a StyledText.
+    struct StyledSpan
+    {
+        ConsoleColor foreground;
+        ConsoleColor background;
+        size_t offset;
+        size_t size;
+    };
+
+    // Colored text resolved ahead of time, usually at compile time by wincc::styled. The ANSI form
+    // begins by setting both colors and carries every later switch inline, so the ANSI backend
+    // writes it with a single copy.
+    struct StyledText
+    {
+        // Text without any escape sequences. Spans index into it.
+        const char *text;
+        const StyledSpan *spans;
+        size_t span_count;
+
+        // Text with escape sequences.
+        const char *ansi;
+        size_t ansi_size;
+
+        // Length of the escape sequence at the start of the ANSI form, skipped when the terminal
+        // is already in the first span's colors.
+        size_t ansi_lead_size;
+    };
+
+    // Color markup parsed at runtime, for templates that come from configuration rather than code.
+    // Tags use the same names as wincc::styled but in square brackets: [red] sets the foreground,
+    // [white on blue] sets both colors, and [/] goes back to the defaults, which is also where the
+    // text starts. [[ is a literal bracket, and anything in brackets that is not a color tag is
+    // kept as text. Parse a template once and write it as often as needed.
+    class MarkupTemplate
+    {
+    public:
+        MarkupTemplate() {}
+
+        // Parse markup.
+        explicit MarkupTemplate(std::string_view markup) { parse(markup); }
+
+        // Replace the template with newly parsed markup, reusing the memory already allocated.
+        void parse(std::string_view markup);
+
+        // Get the parsed template. Valid until the next parse.
+        StyledText styled() const;
+
+        // Number of spans after merging neighbors in the same colors.
+        size_t span_count() const { return m_spans.size(); }
+
+    private:
+        // Append text in the given colors, merging with the previous span when they match.
+        void _append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size);
+
+        std::string m_text;
+        std::vector<StyledSpan> m_spans;
+        std::string m_ansi;
+        size_t m_ansi_lead_size = 0;
+    };
+
+    // How colors are applied to the console.
+    enum class ConsoleBackend
+    {
+        // Win32 console API when stdout is a Windows console, ANSI escape sequences when the sink
+        // is a terminal, and Plain for anything else, such as files and pipes.
+        Auto,
+
+        // SetConsoleTextAttribute on the process console. Only available on Windows.
+        Win32,
+
+        // ANSI/VT SGR escape sequences written inline with the text.
+        Ansi,
+
+        // Text only. Colors and cursor moves are dropped, so logs and pipes get clean text.
+        Plain
+    };
+
+    // Bytes referenced by a gather write. Laid out like POSIX struct iovec so a list of slices can
+    // be handed to writev as it is.
+    struct IoSlice
+    {
+        const char *data;
+        size_t size;
+    };
+
+    // Destination for the bytes written by an ANSI or Plain console. Sinks may buffer; the
+    // console only asks for a flush when flushed itself or destroyed.
+    class OutputSink
+    {
+    public:
+        virtual ~OutputSink() {}
+
+        // Write size bytes from data.
+        virtual void write(const char *data, size_t size) = 0;
+
+        // Write count slices in order, as one write of all of them. The console sends escape
+        // sequences and text this way so the text is never copied to put them together. Sinks
+        // that can pass the list to the system override this; by default each slice is written
+        // in turn.
+        virtual void writev(const IoSlice *slices, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                write(slices[i].data, slices[i].size);
+            }
+        }
+
+        // Push anything buffered to the underlying device.
+        virtual void flush() {}
+
+        // True if the sink is an interactive terminal. ConsoleBackend::Auto uses Plain otherwise.
+        virtual bool is_terminal() const { return false; }
+    };
+
+    // Sink writing to a C stream, such as stdout or the slave side of a pty. Buffering is left to
+    // the stream.
+    class StreamSink : public OutputSink
+    {
+    public:
+        explicit StreamSink(FILE *stream) : m_stream(stream) {}
+
+        void write(const char *data, size_t size) override;
+
+        // Write every slice under one lock of the stream, so output from other threads cannot
+        // land between them.
+        void writev(const IoSlice *slices, size_t count) override;
+
+        void flush() override;
+
+        bool is_terminal() const override;
+
+    private:
+        FILE *m_stream;
+    };
+
+    // Sink writing to a file descriptor through its own buffer, without stdio locking. Bytes are
+    // sent once the buffer reaches the threshold, on flush, and when the sink is destroyed.
+    class FdSink : public OutputSink
+    {
+    public:
+        // Write to an open descriptor, which stays open when the sink is destroyed.
+        explicit FdSink(int fd, size_t threshold = k_default_threshold);
+
+        // Create or truncate the file at path and write to it. The file is closed with the sink.
+        explicit FdSink(const char *path, size_t threshold = k_default_threshold);
+
+        FdSink(const FdSink &) = delete;
+
+        FdSink &operator=(const FdSink &) = delete;
+
+        ~FdSink();
+
+        void write(const char *data, size_t size) override;
+
+        // Small lists are buffered like small writes. Larger ones go out with the buffered bytes in
+        // front of them as a single writev, straight from the caller's memory. Windows has no
+        // gather write for descriptors, so there each slice is written in turn.
+        void writev(const IoSlice *slices, size_t count) override;
+
+        void flush() override;
+
+        bool is_terminal() const override;
+
+        // False if the file could not be opened.
+        bool is_open() const { return m_fd >= 0; }
+
+        // Buffered bytes not yet sent to the descriptor.
+        size_t pending() const { return m_buffer.size(); }
+
+        static const size_t k_default_threshold = 64 * 1024;
+
+    private:
+        // Write everything to the descriptor, retrying after partial writes and interruptions.
+        // Bytes are dropped if the descriptor fails.
+        void _write_all(const char *data, size_t size);
+
+        // Gather write every slice to the descriptor, retrying the same way as _write_all.
+        void _writev_all(const IoSlice *slices, size_t count);
+
+        int m_fd;
+        bool m_owns_fd;
+        size_t m_threshold;
+        std::string m_buffer;
+
+        // Buffered bytes followed by the caller's slices, for a gather write.
+        std::vector<IoSlice> m_gather;
+    };
+
+    // Sink collecting everything written into memory. Useful for tests and capturing output.
+    class MemorySink : public OutputSink
+    {
+    public:
+        void write(const char *data, size_t size) override;
+
+        // Get everything written so far.
+        const std::string &str() const { return m_buffer; }
+
+        // Discard everything written so far.
+        void clear() { m_buffer.clear(); }
+
+    private:
+        std::string m_buffer;
+    };
+
+    // Snapshot of a Console's instrumentation counters. Counting is compiled in only when the
+    // library is built with WINCC_ENABLE_STATS; otherwise every field stays zero.
+    struct ConsoleStats
+    {
+        // Buckets in the latency histogram. Bucket i counts calls that took from 2^i up to
+        // 2^(i+1) nanoseconds; the last also counts anything slower.
+        static const size_t k_latency_buckets = 32;
+
+        // Writes handed to the sink, or to stdout by the Win32 backend, and the bytes in them.
+        uint64_t writes = 0;
+        uint64_t bytes = 0;
+
+        // Color switches sent, and switches asked for but skipped.
+        uint64_t switches = 0;
+        uint64_t avoided_switches = 0;
+
+        // Flushes of the sink or stdout.
+        uint64_t flushes = 0;
+
+        // Time spent blocked in writes and flushes, in total and as a histogram.
+        uint64_t blocked_ns = 0;
+        uint64_t latency[k_latency_buckets] = {};
+
+        // Upper bound in nanoseconds of the bucket holding the given fraction of writes and
+        // flushes, such as 0.99 for the 99th percentile. 0 if nothing was timed.
+        uint64_t latency_percentile(double fraction) const;
+    };
+
+#ifdef WINCC_ENABLE_STATS
+    namespace detail
+    {
+        // Running totals behind ConsoleStats. Only the thread writing to the console adds to them,
+        // with a relaxed load and store rather than a locked add, and they never go down, so any
+        // thread may read them.
+        struct ConsoleCounters
+        {
+            std::atomic<uint64_t> writes{ 0 };
+            std::atomic<uint64_t> bytes{ 0 };
+            std::atomic<uint64_t> switches{ 0 };
+            std::atomic<uint64_t> requested_switches{ 0 };
+            std::atomic<uint64_t> flushes{ 0 };
+            std::atomic<uint64_t> blocked_ns{ 0 };
+            std::atomic<uint64_t> latency[ConsoleStats::k_latency_buckets] = {};
+        };
+    }
+#endif
+
+    // A line or screen of colored text built up front and sent to a Console in one write. Text is
+    // copied into a single buffer that keeps its capacity across clear(), so a frame reused for
+    // every line stops allocating once it has grown. Neighboring segments in the same colors are
+    // merged as they are appended.
+    class Frame
+    {
+    public:
+        // Append text in the console's current colors.
+        void append(const char *text);
+
+        // Append size bytes of text in the console's current colors.
+        void append(const char *text, size_t size);
+
+        // Append text with the given foreground color.
+        void append(ConsoleColor foreground, const char *text);
+
+        // Append size bytes of text with the given foreground color.
+        void append(ConsoleColor foreground, const char *text, size_t size);
+
+        // Append text with the given foreground and background color.
+        void append(ConsoleColor foreground, ConsoleColor background, const char *text);
+
+        // Append size bytes of text with the given foreground and background color.
+        void append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size);
+
+        // Append size bytes of text with colors stored as bytes, each a ConsoleColor or
+        // k_current_color, as kept by classes that queue or buffer colored text.
+        void append(unsigned char foreground, unsigned char background, const char *text, size_t size);
+
+        // Move the cursor to a zero-based row and column before the text that follows.
+        void move_cursor(int row, int column);
+
+        // Remove all segments, keeping the allocated memory for reuse.
+        void clear();
+
+        // True if nothing has been appended since the last clear.
+        bool empty() const { return m_segments.empty(); }
+
+        // Number of segments after merging.
+        size_t segment_count() const { return m_segments.size(); }
+
+        // Number of text bytes appended.
+        size_t size() const { return m_text.size(); }
+
+        // Color code meaning whatever color the console is using when the frame is committed.
+        static const unsigned char k_current_color = 0xFF;
+
+    private:
+        friend class Console;
+
+        // Foreground code marking a cursor move. The row is kept in offset and the column in size.
+        static const unsigned char k_cursor_move = 0xFE;
+
+        // Run of text in one pair of colors, or a cursor move.
+        struct Segment
+        {
+            unsigned char foreground;
+            unsigned char background;
+            size_t offset;
+            size_t size;
+        };
+
+        // Append text, extending the last segment if the colors match.
+        void _append(unsigned char foreground, unsigned char background, const char *text, size_t size);
+
+        std::string m_text;
+        std::vector<Segment> m_segments;
+    };
+
+    class Scrollback;
+
+    // Colors saved and restored by the style stack of a Console.
+    struct Style
+    {
+        ConsoleColor foreground = ConsoleColor::Default;
+        ConsoleColor background = ConsoleColor::Default;
+
+        constexpr bool operator==(const Style &other) const = default;
+    };
+
     // Allows writing to the console with various foreground and background colors. Supports 
-    // narrow and wide character arrays. PowerShell consoles may display different results
-    // than the default gray-on-black command line.
+    // narrow and wide character arrays; wide text is written as UTF-8, so the two can be mixed.
+    // PowerShell consoles may display different results than the default gray-on-black command
+    // line. The backend is picked at runtime; BasicConsole in win_color_basic.hh fixes it at
+    // compile time instead.
     class Console
     {
     public:
 
         Console();
-        
+
+        // Create a console with the given backend. The ANSI backend writes to sink, or stdout when
+        // sink is null. The sink is not owned and must outlive the console. The Win32 backend always
+        // writes to the process console.
+        explicit Console(ConsoleBackend backend, OutputSink *sink = nullptr);
+
+        Console(const Console &) = delete;
+
+        Console &operator=(const Console &) = delete;
+
         ~Console();
 
+        // Get the backend used to apply colors. Never ConsoleBackend::Auto.
+        ConsoleBackend backend() const { return m_backend; }
+
+        // Get the colors the terminal can show. The ANSI backend guesses from the COLORTERM and
+        // TERM environment variables; the other backends only use the ConsoleColor palette.
+        ColorDepth color_depth() const { return m_color_depth; }
+
+        // Override the colors the terminal can show. Only the ANSI backend goes beyond Basic.
+        void color_depth(ColorDepth value) { m_color_depth = value; }
+
         // Get the current background color.
         ConsoleColor background_color() const { return m_background_color; }
 
@@ -75,6 +617,59 @@ namespace wincc
         // Reset colors back to default.
         void reset_colors();
 
+        // Get the current colors.
+        Style style() const { return Style{ m_foreground_color, m_background_color }; }
+
+        // Save the current colors on the style stack and switch to the given foreground color.
+        void push_style(ConsoleColor foreground);
+
+        // Save the current colors on the style stack and switch to the given colors.
+        void push_style(ConsoleColor foreground, ConsoleColor background);
+
+        // Save the current colors on the style stack and switch to the given style.
+        void push_style(const Style &style);
+
+        // Go back to the colors saved by the matching push_style. Like the setters this only
+        // takes effect at the next write, and restoring the colors already in effect costs
+        // nothing. Popping an empty stack does nothing.
+        void pop_style();
+
+        // Number of styles pushed and not yet popped.
+        size_t style_depth() const { return m_style_depth; }
+
+        // Styles the stack holds. It is part of the console, so pushing never allocates. Pushes
+        // beyond it still switch colors, but their pops leave the colors as they are.
+        static const size_t k_style_stack_capacity = 32;
+
+        // Get the scrollback recording what this console writes, or null.
+        Scrollback *scrollback() const { return m_scrollback; }
+
+        // Record everything written from now on into a scrollback, or stop with null. The
+        // scrollback is not owned and must outlive the console or be detached first.
+        void scrollback(Scrollback *value) { m_scrollback = value; }
+
+        // Move the cursor to a zero-based row and column.
+        void move_cursor(int row, int column);
+
+        // Apply any pending color change and push buffered output to the console. Colors are only
+        // switched right before text that needs them is written, so call this before writing to
+        // the console by other means.
+        void flush();
+
+        // Number of times the console colors were actually switched.
+        size_t switch_count() const { return m_switch_count; }
+
+        // Number of color switches skipped, either because nothing was written before the colors
+        // changed again or because the colors were already in effect.
+        size_t avoided_switch_count() const;
+
+        // Get the instrumentation counters. Safe to call from any thread while the console is
+        // writing. All zero unless built with WINCC_ENABLE_STATS.
+        ConsoleStats stats() const;
+
+        // Set the instrumentation counters back to zero. Does not affect switch_count().
+        void reset_stats();
+
         // Write to the console without setting new colors.
         void write(const char *msg);
 
@@ -84,6 +679,14 @@ namespace wincc
         // Write to the console with the given foreground and background color.
         void write(ConsoleColor foreground, ConsoleColor background, const char *msg);
 
+        // Write to the console with the given foreground color, which may be outside the
+        // ConsoleColor palette.
+        void write(Color foreground, const char *msg);
+
+        // Write to the console with the given foreground and background color. Colors the
+        // terminal cannot show are replaced by the nearest ones it can.
+        void write(Color foreground, Color background, const char *msg);
+
         // Write wide characters to the console without setting new colors.
         void writewc(const wchar_t *msg);
 
@@ -93,29 +696,296 @@ namespace wincc
         // Write wide characters to the console with the given foreground and background color.
         void writewc(ConsoleColor foreground, ConsoleColor background, const wchar_t *msg);
 
+        // Write formatted text to the console without setting new colors. Each {} in format is
+        // replaced by the next argument, and the two are checked against each other at compile time.
+        // Text is formatted into a per-thread buffer and written in one call.
+        template <class... Args>
+        void write(FormatString<Args...> format, const Args &... args);
+
+        // Write formatted text to the console with the given foreground color.
+        template <class... Args>
+        void write(ConsoleColor foreground, FormatString<Args...> format, const Args &... args);
+
+        // Write formatted text to the console with the given foreground and background color.
+        template <class... Args>
+        void write(ConsoleColor foreground, ConsoleColor background, FormatString<Args...> format, const Args &... args);
+
+        // Write formatted wide characters to the console without setting new colors.
+        template <class... Args>
+        void writewc(WideFormatString<Args...> format, const Args &... args);
+
+        // Write formatted wide characters to the console with the given foreground color.
+        template <class... Args>
+        void writewc(ConsoleColor foreground, WideFormatString<Args...> format, const Args &... args);
+
+        // Write formatted wide characters to the console with the given foreground and background color.
+        template <class... Args>
+        void writewc(ConsoleColor foreground, ConsoleColor background, WideFormatString<Args...> format, const Args &... args);
+
+        // Write text with colors resolved ahead of time, such as the result of wincc::styled. The ANSI
+        // backend copies the prepared bytes, escape sequences included, in one write.
+        void write(const StyledText &styled);
+
+        // Parse color markup and write it. See MarkupTemplate for the syntax. Each {} in the text
+        // is replaced by the next argument, and {{ and }} stand for literal braces, with or without
+        // arguments. Since markup is only known at runtime, extra arguments are ignored and
+        // placeholders without an argument are written as they are.
+        template <class... Args>
+        void write_markup(std::string_view markup, const Args &... args);
+
+        // Write a parsed markup template, replacing each {} in its text with the next argument.
+        template <class... Args>
+        void write_markup(const MarkupTemplate &markup, const Args &... args);
+
+        // Write every segment of a frame. The ANSI backend sends the text and all the escape
+        // sequences it needs in a single write to the sink.
+        void commit(const Frame &frame);
+
     private:
         // Convert a color into a number used with SetConsoleTextAttribute.
-        int _convert_attributes(ConsoleColor color);
+        static int _convert_attributes(ConsoleColor color);
 
         // Write with colors given once. This is an implementation for wide and narrow text.
         void _single_set_write(ConsoleColor foreground, ConsoleColor background, const void* msg, bool is_wide);
 
+        // Attribute for a colored write, counting the set and revert it stands for.
+        int _single_set_attribute(ConsoleColor foreground, ConsoleColor background);
+
+        // Format into the per-thread buffer and write the result using the given attribute.
+        template <class Char, class... Args>
+        void _write_formatted(int attribute, std::basic_string_view<Char> format, const Args &... args);
+
+        // Make the given colors current, unless they already are.
+        void _set_style(const Style &style);
+
         // Compute a number for SetConsoleTextAttribute from a foreground and background color.
         int _compute_text_attribute(ConsoleColor foreground, ConsoleColor background);
 
         // Get color enum from integer.
-        ConsoleColor _color_from_attribute(int attribute);
+        static ConsoleColor _color_from_attribute(int attribute);
+
+        // Build the escape sequence switching to two colors outside the ConsoleColor palette, as
+        // far as the color depth allows. Returns the number of bytes written to dst.
+        size_t _format_extended_sgr(Color foreground, Color background, char *dst) const;
+
+        // Switch the console to the given attribute. Does nothing if it is already applied.
+        void _apply_attribute(int attribute);
+
+        // Write text using the given attribute. Colors are switched only if there is text to write.
+        void _write_text(int attribute, const void *msg, bool is_wide);
+
+        // Add text written using the given attribute to the scrollback, if there is one.
+        void _record(int attribute, const char *data, size_t size);
+
+        // Write size bytes of text using the given attribute.
+        void _write_bytes(int attribute, const char *data, size_t size);
+
+        // Convert size wide characters to UTF-8 and write them using the given attribute.
+        void _write_wide(int attribute, const wchar_t *text, size_t size);
+
+        // Escape sequence switching the terminal to the given attribute, which is taken as applied
+        // from then on. Points into a static table. Empty if the attribute is already applied or
+        // the backend is Plain. ANSI and Plain backends only.
+        std::string_view _take_switch(int attribute);
+
+        // Attribute for a frame segment's colors.
+        int _segment_attribute(unsigned char foreground, unsigned char background);
+
+        // Count color switches sent to the console.
+        void _count_switches(size_t count);
+
+        // Count color switches asked for through the API.
+        void _count_requests(size_t count);
+
+        // Write to the sink, or stdout for the Win32 backend, timing the call when stats are on.
+        void _device_write(const char *data, size_t size);
+
+        // Gather write to the sink, timing the call when stats are on.
+        void _device_writev(const IoSlice *slices, size_t count);
+
+        // Flush the sink, or stdout for the Win32 backend, timing the call when stats are on.
+        void _device_flush();
+
+#ifdef WINCC_ENABLE_STATS
+        // Record a write or flush that started at the given steady clock time, in nanoseconds.
+        void _record_blocking(uint64_t start_ns, size_t bytes, bool is_flush);
+#endif
+
+        ConsoleBackend m_backend;
+        ColorDepth m_color_depth;
+
+        StreamSink m_stdout_sink;
+        OutputSink *m_sink;
+        Scrollback *m_scrollback;
+
+        // Scratch space for converting wide text and formatting the cursor moves of frames.
+        std::string m_scratch;
+
+        // Gather list a frame is committed with: escape sequences and the frame's own text.
+        std::vector<IoSlice> m_slices;
+
+        // Markup parsed by write_markup, and the frame its formatted spans are assembled in.
+        MarkupTemplate m_markup;
+        Frame m_markup_frame;
 
         void* m_console_handle;
 
+        // Console output code page to restore when destroyed, or 0 if it was left alone. Windows only.
+        unsigned int m_saved_code_page;
+
         ConsoleColor m_background_color;
         ConsoleColor m_foreground_color;
 
         int m_current_text_attribute;
 
+        // Colors saved by push_style. Levels past the capacity are counted but not saved.
+        Style m_style_stack[k_style_stack_capacity];
+        size_t m_style_depth;
+
+        // Attribute the console is known to be using right now. m_current_text_attribute is the
+        // pending attribute, applied lazily before the next uncolored write.
+        int m_applied_attribute;
+
+        // Extended colors last written, still in effect while m_applied_attribute is unknown.
+        Color m_extended_foreground;
+        Color m_extended_background;
+
+        // Color switches actually sent to the console.
+        size_t m_switch_count;
+
+        // Color switches the API asked for: one per setter call and two, set and revert, per
+        // colored write.
+        size_t m_requested_switches;
+
         int m_default_foreground;
         int m_default_background;
+
+#ifdef WINCC_ENABLE_STATS
+        detail::ConsoleCounters m_stats;
+
+        // Totals at the last reset_stats, subtracted from the running totals in snapshots.
+        detail::ConsoleCounters m_stats_baseline;
+#endif
     };
+
+    // Pushes a style when created and pops it when destroyed, so nested blocks of output can
+    // change colors without saving and restoring them by hand.
+    class StyleScope
+    {
+    public:
+        StyleScope(Console &console, ConsoleColor foreground) : m_console(console) { console.push_style(foreground); }
+
+        StyleScope(Console &console, ConsoleColor foreground, ConsoleColor background) : m_console(console)
+        {
+            console.push_style(foreground, background);
+        }
+
+        StyleScope(Console &console, const Style &style) : m_console(console) { console.push_style(style); }
+
+        StyleScope(const StyleScope &) = delete;
+
+        StyleScope &operator=(const StyleScope &) = delete;
+
+        ~StyleScope() { m_console.pop_style(); }
+
+    private:
+        Console &m_console;
+    };
+
+    template <class... Args>
+    void Console::write(FormatString<Args...> format, const Args &... args)
+    {
+        _write_formatted(m_current_text_attribute, format.get(), args...);
+    }
+
+    template <class... Args>
+    void Console::write(ConsoleColor foreground, FormatString<Args...> format, const Args &... args)
+    {
+        _write_formatted(_single_set_attribute(foreground, m_background_color), format.get(), args...);
+    }
+
+    template <class... Args>
+    void Console::write(ConsoleColor foreground, ConsoleColor background, FormatString<Args...> format, const Args &... args)
+    {
+        _write_formatted(_single_set_attribute(foreground, background), format.get(), args...);
+    }
+
+    template <class... Args>
+    void Console::writewc(WideFormatString<Args...> format, const Args &... args)
+    {
+        _write_formatted(m_current_text_attribute, format.get(), args...);
+    }
+
+    template <class... Args>
+    void Console::writewc(ConsoleColor foreground, WideFormatString<Args...> format, const Args &... args)
+    {
+        _write_formatted(_single_set_attribute(foreground, m_background_color), format.get(), args...);
+    }
+
+    template <class... Args>
+    void Console::writewc(ConsoleColor foreground, ConsoleColor background, WideFormatString<Args...> format,
+        const Args &... args)
+    {
+        _write_formatted(_single_set_attribute(foreground, background), format.get(), args...);
+    }
+
+    template <class... Args>
+    void Console::write_markup(std::string_view markup, const Args &... args)
+    {
+        m_markup.parse(markup);
+        write_markup(m_markup, args...);
+    }
+
+    template <class... Args>
+    void Console::write_markup(const MarkupTemplate &markup, const Args &... args)
+    {
+        StyledText styled = markup.styled();
+        const StyledSpan *last = styled.span_count > 0 ? styled.spans + styled.span_count - 1 : nullptr;
+        const char *text_end = last ? styled.text + last->offset + last->size : styled.text;
+
+        // Text without braces formats to itself, so the prepared form can be written as it is.
+        if (detail::find_byte(styled.text, text_end, '{') == text_end &&
+            detail::find_byte(styled.text, text_end, '}') == text_end)
+        {
+            write(styled);
+            return;
+        }
+
+        // One extra element so the array is never empty.
+        const detail::FormatValue<char> values[sizeof...(Args) + 1] = { detail::make_format_value<char>(args)... };
+        size_t used = 0;
+
+        m_markup_frame.clear();
+        for (size_t i = 0; i < styled.span_count; ++i)
+        {
+            const StyledSpan &span = styled.spans[i];
+            std::string &buffer = detail::format_buffer<char>();
+            used += detail::format_to(buffer, std::string_view(styled.text + span.offset, span.size), values + used,
+                sizeof...(Args) - used);
+            m_markup_frame.append(span.foreground, span.background, buffer.data(), buffer.size());
+        }
+
+        commit(m_markup_frame);
+    }
+
+    template <class Char, class... Args>
+    void Console::_write_formatted(int attribute, std::basic_string_view<Char> format, const Args &... args)
+    {
+        // One extra element so the array is never empty.
+        const detail::FormatValue<Char> values[sizeof...(Args) + 1] = { detail::make_format_value<Char>(args)... };
+
+        std::basic_string<Char> &buffer = detail::format_buffer<Char>();
+        detail::format_to(buffer, format, values, sizeof...(Args));
+
+        if constexpr (std::is_same_v<Char, char>)
+        {
+            _write_bytes(attribute, buffer.data(), buffer.size());
+        }
+        else
+        {
+            _write_wide(attribute, buffer.data(), buffer.size());
+        }
+    }
 }
 
 
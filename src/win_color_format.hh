@@ -0,0 +1,234 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+
+Formatting used by the Console write templates. Included by win_color_console.hh.
+*******************************************************************************/
+#ifndef _WIN_COLOR_FORMAT_HH
+#define _WIN_COLOR_FORMAT_HH
+
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace wincc
+{
+    namespace detail
+    {
+        // Reached during constant evaluation when a format string is malformed or does not match
+        // its arguments, turning the mistake into a compile error that names the reason.
+        inline void format_string_error(const char *reason) { (void)reason; }
+
+        // Count the {} placeholders in a format string, reporting anything malformed. {{ and }}
+        // stand for literal braces.
+        template <class Char>
+        constexpr size_t count_placeholders(std::basic_string_view<Char> format)
+        {
+            size_t count = 0;
+
+            for (size_t i = 0; i < format.size(); ++i)
+            {
+                if (format[i] == Char('{'))
+                {
+                    if (i + 1 < format.size() && format[i + 1] == Char('{'))
+                    {
+                        ++i;
+                    }
+                    else if (i + 1 < format.size() && format[i + 1] == Char('}'))
+                    {
+                        ++i;
+                        ++count;
+                    }
+                    else
+                    {
+                        format_string_error("only {} placeholders are supported; use {{ for a literal brace");
+                    }
+                }
+                else if (format[i] == Char('}'))
+                {
+                    if (i + 1 < format.size() && format[i + 1] == Char('}'))
+                    {
+                        ++i;
+                    }
+                    else
+                    {
+                        format_string_error("unmatched }; use }} for a literal brace");
+                    }
+                }
+            }
+
+            return count;
+        }
+
+        // True for the character types, which format as characters only in strings of their own type.
+        template <class T>
+        inline constexpr bool is_character_v = std::is_same_v<T, char> || std::is_same_v<T, wchar_t> ||
+            std::is_same_v<T, char8_t> || std::is_same_v<T, char16_t> || std::is_same_v<T, char32_t>;
+
+        // True if T is text of the character type Other, which is not the format's own type.
+        template <class Char, class Other, class T>
+        inline constexpr bool is_text_of_v = !std::is_same_v<Char, Other> &&
+            (std::is_convertible_v<const T &, const Other *> || std::is_convertible_v<const T &, std::basic_string_view<Other>>);
+
+        // True if T is text of any character type other than Char.
+        template <class Char, class T>
+        inline constexpr bool is_foreign_text_v = is_text_of_v<Char, char, T> || is_text_of_v<Char, wchar_t, T> ||
+            is_text_of_v<Char, char8_t, T> || is_text_of_v<Char, char16_t, T> || is_text_of_v<Char, char32_t, T>;
+
+        // One formatting argument with its type erased, so the formatting loop is compiled once
+        // per character type rather than once per combination of argument types.
+        template <class Char>
+        struct FormatValue
+        {
+            enum class Kind
+            {
+                Bool,
+                Character,
+                Signed,
+                Unsigned,
+                Floating,
+                String,
+                Pointer
+            };
+
+            struct StringValue
+            {
+                const Char *data;
+                size_t size;
+            };
+
+            Kind kind;
+
+            union
+            {
+                bool boolean;
+                Char character;
+                long long signed_value;
+                unsigned long long unsigned_value;
+                double floating;
+                const void *pointer;
+                StringValue string;
+            };
+        };
+
+        // Wrap one argument for formatting.
+        template <class Char, class T>
+        FormatValue<Char> make_format_value(const T &value)
+        {
+            using Value = FormatValue<Char>;
+            using Kind = typename Value::Kind;
+            Value result;
+
+            if constexpr (std::is_same_v<T, bool>)
+            {
+                result.kind = Kind::Bool;
+                result.boolean = value;
+            }
+            else if constexpr (std::is_same_v<T, Char>)
+            {
+                result.kind = Kind::Character;
+                result.character = value;
+            }
+            else if constexpr (is_character_v<T>)
+            {
+                static_assert(std::is_same_v<T, Char>, "wincc formats characters only in strings of the same character type");
+            }
+            else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+            {
+                result.kind = Kind::Signed;
+                result.signed_value = value;
+            }
+            else if constexpr (std::is_integral_v<T> && std::is_unsigned_v<T>)
+            {
+                result.kind = Kind::Unsigned;
+                result.unsigned_value = value;
+            }
+            else if constexpr (std::is_enum_v<T>)
+            {
+                result.kind = Kind::Signed;
+                result.signed_value = (long long)value;
+            }
+            else if constexpr (std::is_floating_point_v<T>)
+            {
+                result.kind = Kind::Floating;
+                result.floating = (double)value;
+            }
+            else if constexpr (std::is_convertible_v<const T &, const Char *>)
+            {
+                const Char *text = value;
+                result.kind = Kind::String;
+                result.string.data = text;
+                result.string.size = text ? std::char_traits<Char>::length(text) : 0;
+            }
+            else if constexpr (std::is_convertible_v<const T &, std::basic_string_view<Char>>)
+            {
+                std::basic_string_view<Char> text = value;
+                result.kind = Kind::String;
+                result.string.data = text.data();
+                result.string.size = text.size();
+            }
+            else if constexpr (is_foreign_text_v<Char, T>)
+            {
+                static_assert(std::is_same_v<T, Char>, "wincc formats text only in strings of the same character type");
+            }
+            else if constexpr (std::is_pointer_v<T> && std::is_void_v<std::remove_pointer_t<T>>)
+            {
+                result.kind = Kind::Pointer;
+                result.pointer = (const void *)value;
+            }
+            else if constexpr (std::is_pointer_v<T>)
+            {
+                static_assert(std::is_void_v<T>, "wincc formats pointers only as void *; cast to print an address");
+            }
+            else
+            {
+                static_assert(std::is_same_v<T, bool>, "wincc cannot format this type");
+            }
+
+            return result;
+        }
+
+        // Append format to out, replacing each {} with the next value, and return how many values
+        // were used. Placeholders without a value are copied as they are, which only happens for
+        // format strings that are not checked at compile time.
+        template <class Char>
+        size_t format_to(std::basic_string<Char> &out, std::basic_string_view<Char> format, const FormatValue<Char> *values,
+            size_t count);
+
+        // Per-thread buffer the Console write templates format into. It keeps its capacity, so
+        // after the first few calls on a thread formatting no longer allocates.
+        template <class Char>
+        std::basic_string<Char> &format_buffer();
+    }
+
+    // Format string checked against its argument types at compile time. Text is copied as is,
+    // except that each {} is replaced by the next argument and {{ and }} stand for braces.
+    template <class Char, class... Args>
+    class BasicFormatString
+    {
+    public:
+        consteval BasicFormatString(const Char *text) : m_text(text)
+        {
+            if (detail::count_placeholders(m_text) != sizeof...(Args))
+            {
+                detail::format_string_error("the number of {} placeholders does not match the number of arguments");
+            }
+        }
+
+        // Get the format text.
+        std::basic_string_view<Char> get() const { return m_text; }
+
+    private:
+        std::basic_string_view<Char> m_text;
+    };
+
+    // Narrow format string. The argument types are not deduced from it.
+    template <class... Args>
+    using FormatString = BasicFormatString<char, std::type_identity_t<Args>...>;
+
+    // Wide format string. The argument types are not deduced from it.
+    template <class... Args>
+    using WideFormatString = BasicFormatString<wchar_t, std::type_identity_t<Args>...>;
+}
+
+#endif /* _WIN_COLOR_FORMAT_HH */
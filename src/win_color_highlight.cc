@@ -0,0 +1,327 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WINCC_HAVE_SSE2 1
+#endif
+
+#include "win_color_highlight.hh"
+
+// Marks a missing trie edge while the automaton is built.
+#define WINCC_NO_STATE 0xFFFFFFFFu
+
+void wincc::Highlighter::add(std::string_view keyword, ConsoleColor foreground)
+{
+    _add(keyword, (unsigned char)foreground, Frame::k_current_color);
+}
+
+void wincc::Highlighter::add(std::string_view keyword, ConsoleColor foreground, ConsoleColor background)
+{
+    _add(keyword, (unsigned char)foreground, (unsigned char)background);
+}
+
+void wincc::Highlighter::compile()
+{
+    // Bytes in no keyword share class 0; every other byte gets its own class.
+    uint32_t class_count = 1;
+    std::fill(m_classes, m_classes + 256, 0);
+
+    for (const Rule &rule : m_rules)
+    {
+        for (char c : rule.keyword)
+        {
+            uint16_t &byte_class = m_classes[(unsigned char)c];
+            if (byte_class == 0)
+            {
+                byte_class = (uint16_t)class_count++;
+            }
+        }
+    }
+
+    m_stride = class_count;
+
+    // Trie of the keywords, with state 0 as the root.
+    std::vector<uint32_t> next(class_count, WINCC_NO_STATE);
+    m_outputs.assign(1, Output{ 0, 0, 0 });
+
+    for (uint32_t r = 0; r < (uint32_t)m_rules.size(); ++r)
+    {
+        uint32_t state = 0;
+        for (char c : m_rules[r].keyword)
+        {
+            uint32_t &edge = next[state * class_count + m_classes[(unsigned char)c]];
+            if (edge == WINCC_NO_STATE)
+            {
+                edge = (uint32_t)m_outputs.size();
+                next.resize(next.size() + class_count, WINCC_NO_STATE);
+                m_outputs.push_back(Output{ 0, 0, 0 });
+            }
+
+            state = next[state * class_count + m_classes[(unsigned char)c]];
+        }
+
+        m_outputs[state].rule = r;
+        m_outputs[state].length = (uint32_t)m_rules[r].keyword.size();
+    }
+
+    // Breadth first, so each state's failure state is complete before its children need it. A
+    // missing edge becomes the failure state's edge, which makes the trie a complete automaton,
+    // and each state links to the longest keyword ending at its failure state. The root spells no
+    // keyword, so a link of 0 means there is none.
+    size_t state_count = m_outputs.size();
+    std::vector<uint32_t> failure(state_count, 0);
+    std::vector<uint32_t> queue;
+    queue.reserve(state_count);
+
+    for (uint32_t c = 0; c < class_count; ++c)
+    {
+        uint32_t &edge = next[c];
+        if (edge == WINCC_NO_STATE)
+        {
+            edge = 0;
+        }
+        else
+        {
+            queue.push_back(edge);
+        }
+    }
+
+    for (size_t head = 0; head < queue.size(); ++head)
+    {
+        uint32_t state = queue[head];
+
+        const Output &failure_output = m_outputs[failure[state]];
+        m_outputs[state].link = failure_output.length ? failure[state] : failure_output.link;
+
+        for (uint32_t c = 0; c < class_count; ++c)
+        {
+            uint32_t &edge = next[state * class_count + c];
+            uint32_t fallback = next[failure[state] * class_count + c];
+
+            if (edge == WINCC_NO_STATE)
+            {
+                edge = fallback;
+            }
+            else
+            {
+                failure[edge] = fallback;
+                queue.push_back(edge);
+            }
+        }
+    }
+
+    // Bytes leaving the root are where a keyword may start; everything else is skipped.
+    std::fill(m_starts, m_starts + 256, 0);
+    m_start_count = 0;
+
+    for (int byte = 0; byte < 256; ++byte)
+    {
+        if (m_classes[byte] && next[m_classes[byte]] != 0)
+        {
+            m_starts[byte] = 1;
+            if (m_start_count < sizeof(m_start_bytes))
+            {
+                m_start_bytes[m_start_count] = (unsigned char)byte;
+            }
+            ++m_start_count;
+        }
+    }
+
+    m_table.resize(next.size());
+    for (size_t i = 0; i < next.size(); ++i)
+    {
+        uint32_t target = next[i];
+        bool match = m_outputs[target].length || m_outputs[target].link;
+        m_table[i] = target * class_count | (match ? k_match_bit : 0);
+    }
+
+    m_compiled = true;
+}
+
+void wincc::Highlighter::clear()
+{
+    m_rules.clear();
+    m_table.clear();
+    m_outputs.clear();
+    m_stride = 0;
+    m_compiled = false;
+}
+
+void wincc::Highlighter::append(Frame &frame, std::string_view text)
+{
+    _scan(text);
+
+    size_t pos = 0;
+    for (const Match &match : m_matches)
+    {
+        const Rule &rule = m_rules[match.rule];
+        frame.append(text.data() + pos, match.start - pos);
+        frame.append(rule.foreground, rule.background, text.data() + match.start, match.end - match.start);
+        pos = match.end;
+    }
+
+    frame.append(text.data() + pos, text.size() - pos);
+}
+
+void wincc::Highlighter::write(Console &console, std::string_view text)
+{
+    m_frame.clear();
+    append(m_frame, text);
+    console.commit(m_frame);
+}
+
+void wincc::Highlighter::_add(std::string_view keyword, unsigned char foreground, unsigned char background)
+{
+    if (keyword.empty())
+    {
+        return;
+    }
+
+    m_compiled = false;
+
+    for (Rule &rule : m_rules)
+    {
+        if (rule.keyword == keyword)
+        {
+            rule.foreground = foreground;
+            rule.background = background;
+            return;
+        }
+    }
+
+    m_rules.push_back(Rule{ std::string(keyword), foreground, background });
+}
+
+void wincc::Highlighter::_scan(std::string_view text)
+{
+    if (!m_compiled)
+    {
+        compile();
+    }
+
+    m_matches.clear();
+
+    const unsigned char *data = (const unsigned char *)text.data();
+    const uint32_t *table = m_table.data();
+    uint32_t state = 0;
+    bool sorted = true;
+
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (state == 0)
+        {
+            i = _skip_to_start(data, i, text.size());
+            if (i == text.size())
+            {
+                break;
+            }
+        }
+
+        state = table[state + m_classes[data[i]]];
+
+        if (state & k_match_bit)
+        {
+            state &= ~k_match_bit;
+
+            // Every keyword ending here, longest and so first starting first. A shorter one can
+            // still be kept when the longer overlaps an earlier match.
+            uint32_t output_state = state / m_stride;
+            if (m_outputs[output_state].length == 0)
+            {
+                output_state = m_outputs[output_state].link;
+            }
+
+            while (output_state != 0)
+            {
+                const Output &output = m_outputs[output_state];
+                Match match = { i + 1 - output.length, i + 1, output.rule };
+
+                sorted = sorted && (m_matches.empty() || m_matches.back().start <= match.start);
+                m_matches.push_back(match);
+                output_state = output.link;
+            }
+        }
+    }
+
+    if (m_matches.empty())
+    {
+        return;
+    }
+
+    // Matches come out in order of their ends. A short keyword inside a longer one, like RR in
+    // ERROR, ends first but starts later, which is rare enough to sort for.
+    if (!sorted)
+    {
+        std::stable_sort(m_matches.begin(), m_matches.end(),
+            [](const Match &a, const Match &b) { return a.start < b.start || (a.start == b.start && a.end > b.end); });
+    }
+
+    // Keep the leftmost match, the longer of two starting at the same place, and nothing that
+    // overlaps a match kept before.
+    size_t kept = 0;
+    for (size_t i = 1; i < m_matches.size(); ++i)
+    {
+        Match &last = m_matches[kept];
+        const Match &match = m_matches[i];
+
+        if (match.start >= last.end)
+        {
+            m_matches[++kept] = match;
+        }
+        else if (match.start == last.start && match.end > last.end)
+        {
+            last = match;
+        }
+    }
+
+    m_matches.resize(kept + 1);
+}
+
+size_t wincc::Highlighter::_skip_to_start(const unsigned char *data, size_t pos, size_t size) const
+{
+#ifdef WINCC_HAVE_SSE2
+    if (m_start_count <= sizeof(m_start_bytes))
+    {
+        if (m_start_count == 0)
+        {
+            return size;
+        }
+
+        // Unused slots repeat the first start byte.
+        __m128i needles[4];
+        for (size_t n = 0; n < 4; ++n)
+        {
+            needles[n] = _mm_set1_epi8((char)m_start_bytes[n < m_start_count ? n : 0]);
+        }
+
+        for (; pos + 16 <= size; pos += 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)(data + pos));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, needles[0]), _mm_cmpeq_epi8(block, needles[1])),
+                _mm_or_si128(_mm_cmpeq_epi8(block, needles[2]), _mm_cmpeq_epi8(block, needles[3])));
+            unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+
+            if (mask != 0)
+            {
+#ifdef _MSC_VER
+                unsigned long first;
+                _BitScanForward(&first, mask);
+#else
+                unsigned first = (unsigned)__builtin_ctz(mask);
+#endif
+                return pos + first;
+            }
+        }
+    }
+#endif
+
+    while (pos < size && !m_starts[data[pos]])
+    {
+        ++pos;
+    }
+
+    return pos;
+}
@@ -0,0 +1,115 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_HIGHLIGHT_HH
+#define _WIN_COLOR_HIGHLIGHT_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // Colors keywords in streaming text, such as ERROR and WARN in a tailed log. Rules are
+    // compiled once into an Aho-Corasick automaton, stored as a single table of transitions on
+    // byte classes, where every byte that is in no keyword shares one class. Text is scanned in
+    // one pass with one table lookup per byte, however many rules there are, and stretches that
+    // cannot start a keyword are skipped sixteen bytes at a time with SSE2. Where matches
+    // overlap, the one starting first wins, and of those the longest. The text between matches is
+    // written in the console's current colors, and everything goes out as one frame.
+    class Highlighter
+    {
+    public:
+        // Color every occurrence of keyword in the given foreground color. Adding a keyword again
+        // replaces its colors. Empty keywords are ignored.
+        void add(std::string_view keyword, ConsoleColor foreground);
+
+        // Color every occurrence of keyword in the given foreground and background color.
+        void add(std::string_view keyword, ConsoleColor foreground, ConsoleColor background);
+
+        // Build the automaton. Done by the first highlight after rules change if not called.
+        void compile();
+
+        // Remove every rule.
+        void clear();
+
+        // Number of distinct keywords.
+        size_t rule_count() const { return m_rules.size(); }
+
+        // Number of automaton states, one per distinct keyword prefix. 0 before compile().
+        size_t state_count() const { return m_stride ? m_table.size() / m_stride : 0; }
+
+        // Append text to a frame with its keywords colored. Matches do not span calls, so feed
+        // whole lines.
+        void append(Frame &frame, std::string_view text);
+
+        // Write text to a console with its keywords colored, in a single commit.
+        void write(Console &console, std::string_view text);
+
+    private:
+        // Bit set on transitions into a state that ends a keyword.
+        static const uint32_t k_match_bit = 0x80000000u;
+
+        struct Rule
+        {
+            std::string keyword;
+            unsigned char foreground;
+            unsigned char background;
+        };
+
+        // Keyword a state spells out, if any, and the next shorter state on its failure chain that
+        // spells one, so every keyword ending at a position can be found.
+        struct Output
+        {
+            uint32_t rule;
+            uint32_t length;
+            uint32_t link;
+        };
+
+        struct Match
+        {
+            size_t start;
+            size_t end;
+            uint32_t rule;
+        };
+
+        // Add or replace a rule.
+        void _add(std::string_view keyword, unsigned char foreground, unsigned char background);
+
+        // Find every match in text and keep the leftmost longest ones that do not overlap.
+        void _scan(std::string_view text);
+
+        // Index of the first byte at or after pos that leaves the root state, or size.
+        size_t _skip_to_start(const unsigned char *data, size_t pos, size_t size) const;
+
+        std::vector<Rule> m_rules;
+        bool m_compiled = false;
+
+        // Class of each byte, and classes per state. There are 257 classes if every byte value is
+        // in some keyword.
+        uint16_t m_classes[256] = {};
+        uint32_t m_stride = 0;
+
+        // Bytes that leave the root state, as a lookup table and, when there are few enough for
+        // SSE2 to compare against all of them at once, as a list.
+        unsigned char m_starts[256] = {};
+        unsigned char m_start_bytes[4] = {};
+        size_t m_start_count = 0;
+
+        // Next state for each state and byte class, as the index of the state's first entry so
+        // no multiply is needed while scanning, with k_match_bit set if any keyword ends there.
+        std::vector<uint32_t> m_table;
+
+        // Keywords ending at each state, by state number.
+        std::vector<Output> m_outputs;
+
+        std::vector<Match> m_matches;
+        Frame m_frame;
+    };
+}
+
+#endif /* _WIN_COLOR_HIGHLIGHT_HH */
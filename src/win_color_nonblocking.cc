@@ -0,0 +1,547 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <algorithm>
+#include <charconv>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "win_color_nonblocking.hh"
+
+// Longest escape sequence setting both colors.
+#define WINCC_MAX_COLORS_LENGTH 16
+
+// Most slices sent in one direct gather write, after the one restoring colors.
+#define WINCC_NONBLOCKING_SLICES 16
+
+// Format the escape sequence setting both colors. Returns the number of bytes written to dst.
+static size_t format_colors(wincc::ConsoleColor foreground, wincc::ConsoleColor background, char *dst)
+{
+    char *end = dst + WINCC_MAX_COLORS_LENGTH;
+    char *out = dst;
+
+    *out++ = '\x1b';
+    *out++ = '[';
+    out = std::to_chars(out, end, wincc::detail::k_sgr_color_codes[(int)foreground]).ptr;
+    *out++ = ';';
+    out = std::to_chars(out, end, wincc::detail::k_sgr_color_codes[(int)background] + 10).ptr;
+    *out++ = 'm';
+
+    return (size_t)(out - dst);
+}
+
+wincc::NonBlockingSink::NonBlockingSink(int fd, BackpressurePolicy policy, size_t capacity)
+    : m_fd(fd), m_saved_flags(-1), m_policy(policy), m_capacity(capacity), m_deadline_ns(50000000),
+      m_severity(Severity::Info), m_sent(0), m_repeats(0), m_skip_line(false), m_line_start(true),
+      m_kept_foreground(ConsoleColor::Default),
+      m_kept_background(ConsoleColor::Default), m_dropped(0), m_dropped_bytes(0), m_coalesced(0)
+{
+#ifndef _WIN32
+    m_saved_flags = fcntl(m_fd, F_GETFL);
+    if (m_saved_flags >= 0 && !(m_saved_flags & O_NONBLOCK))
+    {
+        fcntl(m_fd, F_SETFL, m_saved_flags | O_NONBLOCK);
+    }
+#endif
+
+    m_pending.reserve(m_capacity);
+}
+
+wincc::NonBlockingSink::~NonBlockingSink()
+{
+    drain((double)m_deadline_ns / 1e9);
+
+    // Whatever the descriptor never took is lost.
+    size_t left = m_pending.size() - m_sent;
+    if (left > 0)
+    {
+        ++m_dropped;
+        m_dropped_bytes += left;
+    }
+
+#ifndef _WIN32
+    if (m_saved_flags >= 0 && !(m_saved_flags & O_NONBLOCK))
+    {
+        fcntl(m_fd, F_SETFL, m_saved_flags);
+    }
+#endif
+}
+
+void wincc::NonBlockingSink::write(const char *data, size_t size)
+{
+    IoSlice slice = { data, size };
+    writev(&slice, 1);
+}
+
+void wincc::NonBlockingSink::writev(const IoSlice *slices, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    // Once the descriptor catches up, the count of a repeating line goes out rather than waiting
+    // for a different line.
+    if (_send() && m_line.empty() && m_repeats > 0)
+    {
+        _end_repeats();
+        _send();
+    }
+
+    if (pending() > 0 || count > WINCC_NONBLOCKING_SLICES)
+    {
+        // The slices are one write, such as a color switch and its text, kept or dropped together.
+        const char *data = slices[0].data;
+        size_t size = slices[0].size;
+        if (count > 1)
+        {
+            m_scratch.clear();
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_scratch.append(slices[i].data, slices[i].size);
+            }
+
+            data = m_scratch.data();
+            size = m_scratch.size();
+        }
+
+        if (size > 0)
+        {
+            _write_pressured(data, size);
+        }
+
+        _send();
+        return;
+    }
+
+    // Nothing is pending, so the slices go straight to the descriptor, after the colors they
+    // expect if writes before them were dropped.
+    char colors[WINCC_MAX_COLORS_LENGTH];
+    IoSlice gather[WINCC_NONBLOCKING_SLICES + 1];
+    size_t gather_count = 0;
+
+    if (m_parser.foreground() != m_kept_foreground || m_parser.background() != m_kept_background)
+    {
+        gather[gather_count++] = IoSlice{ colors, format_colors(m_parser.foreground(), m_parser.background(), colors) };
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        gather[gather_count++] = slices[i];
+    }
+
+    m_last_line.clear();
+
+#ifdef _WIN32
+    for (size_t i = 0; i < count; ++i)
+    {
+        _track(slices[i].data, slices[i].size);
+    }
+
+    m_kept_foreground = m_parser.foreground();
+    m_kept_background = m_parser.background();
+
+    for (size_t i = 0; i < gather_count; ++i)
+    {
+        const char *data = gather[i].data;
+        size_t size = gather[i].size;
+        while (size > 0)
+        {
+            int result = _write(m_fd, data, size > 0x40000000 ? 0x40000000u : (unsigned int)size);
+            if (result < 0)
+            {
+                break;
+            }
+
+            data += result;
+            size -= (size_t)result;
+        }
+    }
+#else
+    static_assert(sizeof(IoSlice) == sizeof(struct iovec), "IoSlice must match struct iovec");
+
+    ssize_t result;
+    do
+    {
+        result = ::writev(m_fd, (const struct iovec *)gather, (int)gather_count);
+    } while (result < 0 && errno == EINTR);
+
+    // The colors the terminal ends up in are those after the bytes it took.
+    size_t written = result > 0 ? (size_t)result : 0;
+    size_t unsent = 0;
+    for (size_t i = 0; i < gather_count; ++i)
+    {
+        size_t skip = std::min(written, gather[i].size);
+        if (gather[i].data != colors)
+        {
+            _track(gather[i].data, skip);
+        }
+
+        gather[i].data += skip;
+        gather[i].size -= skip;
+        unsent += gather[i].size;
+        written -= skip;
+    }
+
+    m_kept_foreground = m_parser.foreground();
+    m_kept_background = m_parser.background();
+
+    if (unsent == 0)
+    {
+        return;
+    }
+
+    // The rest of the write must go out later, or the text and colors after it would be wrong.
+    // What fits in the buffer is kept as it is; a longer rest goes through the policy.
+    m_scratch.clear();
+    for (size_t i = 0; i < gather_count; ++i)
+    {
+        m_scratch.append(gather[i].data, gather[i].size);
+    }
+
+    if (unsent <= m_capacity)
+    {
+        _track(m_scratch.data(), m_scratch.size());
+        m_pending.append(m_scratch);
+        m_kept_foreground = m_parser.foreground();
+        m_kept_background = m_parser.background();
+    }
+    else
+    {
+        _push_split(m_scratch.data(), m_scratch.size(), true);
+    }
+#endif
+}
+
+void wincc::NonBlockingSink::flush()
+{
+    if (!m_line.empty())
+    {
+        std::string line;
+        line.swap(m_line);
+        _push(line.data(), line.size());
+    }
+
+    _end_repeats();
+    _send();
+}
+
+bool wincc::NonBlockingSink::is_terminal() const
+{
+#ifdef _WIN32
+    return _isatty(m_fd) != 0;
+#else
+    return isatty(m_fd) != 0;
+#endif
+}
+
+void wincc::NonBlockingSink::deadline(double seconds)
+{
+    m_deadline_ns = (int64_t)(seconds * 1e9);
+}
+
+bool wincc::NonBlockingSink::drain(double seconds)
+{
+    flush();
+
+    // Room for a full buffer means nothing is pending.
+    int64_t saved = m_deadline_ns;
+    m_deadline_ns = (int64_t)(seconds * 1e9);
+    bool empty = _wait_for_room(m_capacity) && _send();
+    m_deadline_ns = saved;
+
+    return empty;
+}
+
+void wincc::NonBlockingSink::_write_pressured(const char *data, size_t size)
+{
+    if (m_policy != BackpressurePolicy::Coalesce)
+    {
+        _push(data, size);
+        return;
+    }
+
+    // Lines are compared whole, so text is held until its newline. A line that does not fit in
+    // the buffer with what is pending is let through as far as it goes, and if that part is
+    // dropped, so is the rest of the line.
+    const char *end = data + size;
+    while (data < end)
+    {
+        const char *newline = detail::find_byte(data, end, '\n');
+        const char *piece_end = newline == end ? end : newline + 1;
+        size_t piece = (size_t)(piece_end - data);
+
+        if (m_skip_line)
+        {
+            _track(data, piece);
+            m_dropped_bytes += piece;
+            m_skip_line = newline == end;
+            data = piece_end;
+            continue;
+        }
+
+        m_line.append(data, piece);
+        data = piece_end;
+
+        if (newline != end || pending() > m_capacity)
+        {
+            uint64_t dropped = m_dropped;
+            _push(m_line.data(), m_line.size());
+            m_skip_line = newline == end && m_dropped != dropped;
+            m_line.clear();
+        }
+    }
+}
+
+void wincc::NonBlockingSink::_push(const char *data, size_t size)
+{
+    if (size + WINCC_MAX_COLORS_LENGTH > m_capacity)
+    {
+        _push_split(data, size, false);
+    }
+    else
+    {
+        _push_piece(data, size);
+    }
+}
+
+void wincc::NonBlockingSink::_push_piece(const char *data, size_t size)
+{
+    ConsoleColor foreground = m_parser.foreground();
+    ConsoleColor background = m_parser.background();
+    bool line_start = m_line_start;
+    _track(data, size);
+
+    if (m_policy == BackpressurePolicy::Coalesce)
+    {
+        // Writing a line again leaves the colors where the first copy did, so the colors kept
+        // stay right.
+        if (line_start && !m_last_line.empty() && size == m_last_line.size() &&
+            memcmp(data, m_last_line.data(), size) == 0)
+        {
+            ++m_repeats;
+            ++m_coalesced;
+            return;
+        }
+
+        _end_repeats();
+    }
+
+    size_t colors_size = foreground != m_kept_foreground || background != m_kept_background ? WINCC_MAX_COLORS_LENGTH : 0;
+    if (!_room_for(colors_size + size))
+    {
+        ++m_dropped;
+        m_dropped_bytes += size;
+        return;
+    }
+
+    _accept(data, size, foreground, background);
+
+    if (m_policy == BackpressurePolicy::Coalesce)
+    {
+        if (line_start && data[size - 1] == '\n')
+        {
+            m_last_line.assign(data, size);
+        }
+        else
+        {
+            m_last_line.clear();
+        }
+    }
+}
+
+void wincc::NonBlockingSink::_push_split(const char *data, size_t size, bool started)
+{
+    bool keep = started || m_pending.size() == m_sent || (_may_wait() && _wait_for_room(m_capacity));
+    if (!keep)
+    {
+        ++m_dropped;
+    }
+
+    size_t piece_size = std::max(m_capacity / 2, (size_t)1);
+    while (size > 0)
+    {
+        size_t piece = std::min(size, piece_size);
+
+        if (keep)
+        {
+            uint64_t dropped = m_dropped;
+            _push_piece(data, piece);
+            keep = m_dropped == dropped;
+            _send();
+        }
+        else
+        {
+            _track(data, piece);
+            m_dropped_bytes += piece;
+        }
+
+        data += piece;
+        size -= piece;
+    }
+}
+
+bool wincc::NonBlockingSink::_may_wait() const
+{
+    return m_policy == BackpressurePolicy::BlockUntilDeadline ||
+        (m_policy == BackpressurePolicy::DropLowPriority && m_severity >= Severity::Warning);
+}
+
+bool wincc::NonBlockingSink::_room_for(size_t size)
+{
+    // Low priority writes leave the last quarter of the buffer to the rest.
+    size_t limit = m_capacity;
+    if (m_policy == BackpressurePolicy::DropLowPriority && m_severity < Severity::Warning)
+    {
+        limit = m_capacity / 4 * 3;
+    }
+
+    return m_pending.size() - m_sent + size <= limit || (_may_wait() && _wait_for_room(size));
+}
+
+void wincc::NonBlockingSink::_accept(const char *data, size_t size, ConsoleColor foreground, ConsoleColor background)
+{
+    if (foreground != m_kept_foreground || background != m_kept_background)
+    {
+        char colors[WINCC_MAX_COLORS_LENGTH];
+        m_pending.append(colors, format_colors(foreground, background, colors));
+    }
+
+    m_pending.append(data, size);
+    m_kept_foreground = m_parser.foreground();
+    m_kept_background = m_parser.background();
+}
+
+void wincc::NonBlockingSink::_end_repeats()
+{
+    if (m_repeats == 0)
+    {
+        return;
+    }
+
+    // Written in whatever colors the repeated line left behind.
+    char note[48];
+    int size = snprintf(note, sizeof(note), "(repeated x%llu)\n", (unsigned long long)m_repeats);
+    m_pending.append(note, (size_t)size);
+    m_repeats = 0;
+}
+
+bool wincc::NonBlockingSink::_send()
+{
+#ifndef _WIN32
+    while (m_sent < m_pending.size())
+    {
+        ssize_t written = ::write(m_fd, m_pending.data() + m_sent, m_pending.size() - m_sent);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+
+            // The descriptor failed, so nothing pending will ever go out.
+            ++m_dropped;
+            m_dropped_bytes += m_pending.size() - m_sent;
+            m_sent = m_pending.size();
+            break;
+        }
+
+        m_sent += (size_t)written;
+    }
+#else
+    while (m_sent < m_pending.size())
+    {
+        size_t size = m_pending.size() - m_sent;
+        int written = _write(m_fd, m_pending.data() + m_sent, size > 0x40000000 ? 0x40000000u : (unsigned int)size);
+        if (written < 0)
+        {
+            ++m_dropped;
+            m_dropped_bytes += size;
+            m_sent = m_pending.size();
+            break;
+        }
+
+        m_sent += (size_t)written;
+    }
+#endif
+
+    if (m_sent == m_pending.size())
+    {
+        m_pending.clear();
+        m_sent = 0;
+        return true;
+    }
+
+    // Moving the unsent bytes to the front only once more has been sent than is left keeps the
+    // cost of moving them below the cost of sending them.
+    if (m_sent >= m_pending.size() - m_sent)
+    {
+        m_pending.erase(0, m_sent);
+        m_sent = 0;
+    }
+
+    return false;
+}
+
+bool wincc::NonBlockingSink::_wait_for_room(size_t size)
+{
+    int64_t deadline = detail::steady_ns() + m_deadline_ns;
+
+    while (true)
+    {
+        _send();
+        if (m_pending.size() - m_sent + size <= m_capacity)
+        {
+            return true;
+        }
+
+        int64_t remaining = deadline - detail::steady_ns();
+        if (remaining <= 0)
+        {
+            return false;
+        }
+
+#ifdef _WIN32
+        return false;
+#else
+        struct pollfd descriptor = { m_fd, POLLOUT, 0 };
+        int result = poll(&descriptor, 1, (int)((remaining + 999999) / 1000000));
+        if (result < 0 && errno != EINTR)
+        {
+            return false;
+        }
+#endif
+    }
+}
+
+void wincc::NonBlockingSink::_track(const char *data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    // Text without ESC cannot change the colors and need not be parsed, unless it ends an escape
+    // sequence split between pieces of a write.
+    if (m_parser.in_escape() || detail::find_byte(data, data + size, '\x1b') != data + size)
+    {
+        m_parser.feed(data, size);
+    }
+
+    m_line_start = data[size - 1] == '\n';
+}
@@ -0,0 +1,166 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_NONBLOCKING_HH
+#define _WIN_COLOR_NONBLOCKING_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "win_color_async.hh"
+#include "win_color_console.hh"
+#include "win_color_parser.hh"
+
+namespace wincc
+{
+    // What a NonBlockingSink does with a write that does not fit in its pending buffer.
+    enum class BackpressurePolicy
+    {
+        // While output is pending, a line identical to the one before it is counted rather than
+        // kept, and a "(repeated xN)" line is written in its place once a different line comes.
+        // Lines that still do not fit are dropped.
+        Coalesce,
+
+        // Once the buffer is three quarters full, drop writes below Severity::Warning to keep room
+        // for the rest. Warnings and errors wait up to the deadline for room, then are dropped.
+        DropLowPriority,
+
+        // Wait up to the deadline for the descriptor to take enough of the buffer, then drop.
+        BlockUntilDeadline
+    };
+
+    // Sink writing to a descriptor in non-blocking mode, for output that must not stall the program
+    // when it goes to a slow pipe or a stalled terminal. Whatever the descriptor does not take at
+    // once is kept in a pending buffer of fixed capacity and sent by later writes and flushes, and
+    // what does not fit is handled by the policy. Colors stay right across dropped writes: their
+    // escape sequences are parsed, and the next write that goes out is preceded by one setting the
+    // colors it expects. A write too big for the buffer goes through it in pieces, and is only
+    // started once nothing is pending; if a piece is dropped, the rest of the write is dropped
+    // with it, so the output never has a hole in the middle of a write.
+    //
+    // O_NONBLOCK is a property of the open file, shared with every process using it, so the
+    // sink restores the descriptor's flags when destroyed. Windows cannot make descriptors
+    // non-blocking, so there the sink writes through and never holds anything.
+    class NonBlockingSink : public OutputSink
+    {
+    public:
+        // Write to fd, which stays open after the sink is destroyed.
+        explicit NonBlockingSink(int fd, BackpressurePolicy policy = BackpressurePolicy::Coalesce,
+            size_t capacity = k_default_capacity);
+
+        NonBlockingSink(const NonBlockingSink &) = delete;
+
+        NonBlockingSink &operator=(const NonBlockingSink &) = delete;
+
+        // Wait up to the deadline for pending output to go out, then restore the descriptor.
+        ~NonBlockingSink();
+
+        void write(const char *data, size_t size) override;
+
+        // Goes to the descriptor as a single writev when nothing is pending.
+        void writev(const IoSlice *slices, size_t count) override;
+
+        // Send as much pending output as the descriptor takes without blocking.
+        void flush() override;
+
+        bool is_terminal() const override;
+
+        // Set the longest a write may wait for room under BlockUntilDeadline, or a warning or error
+        // under DropLowPriority. 0.05 seconds by default.
+        void deadline(double seconds);
+
+        // Set the severity of the writes that follow, for BackpressurePolicy::DropLowPriority.
+        // Severity::Info by default.
+        void severity(Severity value) { m_severity = value; }
+
+        // Wait up to the given number of seconds for pending output to go out. Returns true if
+        // nothing is left.
+        bool drain(double seconds);
+
+        // Bytes waiting for the descriptor, including a line held back for coalescing.
+        size_t pending() const { return m_pending.size() - m_sent + m_line.size(); }
+
+        // Writes, or lines under Coalesce, dropped by the policy, and the bytes in them.
+        uint64_t dropped_count() const { return m_dropped; }
+        uint64_t dropped_bytes() const { return m_dropped_bytes; }
+
+        // Lines folded into a "(repeated xN)" line.
+        uint64_t coalesced_count() const { return m_coalesced; }
+
+        static const size_t k_default_capacity = 256 * 1024;
+
+    private:
+        // Apply the policy to a write made while output is pending.
+        void _write_pressured(const char *data, size_t size);
+
+        // Keep a line or write in the pending buffer, or drop it, as the policy says.
+        void _push(const char *data, size_t size);
+
+        // Keep or drop one piece of a write, as the policy says.
+        void _push_piece(const char *data, size_t size);
+
+        // Push a write too big for the buffer in pieces of half the buffer, sending between them.
+        // A write the descriptor already took part of is started even if output is pending.
+        void _push_split(const char *data, size_t size, bool started);
+
+        // True if the policy makes the current write wait for room rather than dropping it.
+        bool _may_wait() const;
+
+        // True if there is room for size more bytes, after waiting if the policy allows it.
+        bool _room_for(size_t size);
+
+        // Add bytes to the pending buffer, after the escape sequence restoring the colors they
+        // expect if writes before them were dropped.
+        void _accept(const char *data, size_t size, ConsoleColor foreground, ConsoleColor background);
+
+        // Write the "(repeated xN)" line for the last line kept, if it repeated.
+        void _end_repeats();
+
+        // Write pending bytes until the descriptor would block. Returns true if nothing is left.
+        bool _send();
+
+        // Wait until the descriptor takes enough to leave room for size more bytes, or until the
+        // deadline. Returns true if there is room.
+        bool _wait_for_room(size_t size);
+
+        // Feed the escape sequences in data to the parser, which follows the colors the writer
+        // expects whether or not its writes go out.
+        void _track(const char *data, size_t size);
+
+        int m_fd;
+        int m_saved_flags;
+        BackpressurePolicy m_policy;
+        size_t m_capacity;
+        int64_t m_deadline_ns;
+        Severity m_severity;
+
+        // Bytes waiting for the descriptor, of which the first m_sent have gone out.
+        std::string m_pending;
+        size_t m_sent;
+
+        // Coalesce only: the line being put together from writes, and the last line kept with
+        // the times it has repeated since. The rest of a line whose start was dropped is skipped.
+        std::string m_line;
+        std::string m_last_line;
+        uint64_t m_repeats;
+        bool m_skip_line;
+
+        // True if the writes so far end with a newline, so the next one starts a line.
+        bool m_line_start;
+
+        // Colors the writer expects, and the colors in effect after the last byte kept.
+        AnsiParser m_parser;
+        ConsoleColor m_kept_foreground;
+        ConsoleColor m_kept_background;
+
+        // Slices of a write made while output is pending, put together.
+        std::string m_scratch;
+
+        uint64_t m_dropped;
+        uint64_t m_dropped_bytes;
+        uint64_t m_coalesced;
+    };
+}
+
+#endif /* _WIN_COLOR_NONBLOCKING_HH */
@@ -0,0 +1,270 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include "win_color_parser.hh"
+
+// Largest parameter value kept. Bigger ones are clamped so they cannot overflow.
+#define WINCC_MAX_PARAMETER_VALUE 65535
+
+// Color for each SGR foreground code from 30 to 37 and 90 to 97.
+static wincc::ConsoleColor color_from_sgr(unsigned int code)
+{
+    return wincc::Color::indexed((unsigned char)(code >= 90 ? code - 90 + 8 : code - 30)).console_color();
+}
+
+// Nearest color to an RGB value. Channels above 255 are clamped.
+static wincc::ConsoleColor color_from_rgb(unsigned int red, unsigned int green, unsigned int blue)
+{
+    auto channel = [](unsigned int value) { return (unsigned char)(value > 255 ? 255 : value); };
+    return wincc::Color::rgb(channel(red), channel(green), channel(blue)).console_color();
+}
+
+// Nearest color to an entry of the 256-color palette.
+static wincc::ConsoleColor color_from_index(unsigned int index)
+{
+    return wincc::Color::indexed((unsigned char)(index > 255 ? 255 : index)).console_color();
+}
+
+const std::vector<wincc::AnsiSpan> &wincc::AnsiParser::feed(const char *data, size_t size)
+{
+    const char *pos = data;
+    const char *end = data + size;
+
+    m_spans.clear();
+
+    while (pos != end)
+    {
+        if (m_state != State::Text)
+        {
+            pos = _parse_escape(pos, end);
+            continue;
+        }
+
+        const char *escape = detail::find_byte(pos, end, '\x1b');
+        if (escape != pos)
+        {
+            AnsiSpan span = { m_foreground, m_background, pos, (size_t)(escape - pos) };
+            m_spans.push_back(span);
+        }
+
+        if (escape != end)
+        {
+            m_state = State::Escape;
+            pos = escape + 1;
+        }
+        else
+        {
+            pos = end;
+        }
+    }
+
+    return m_spans;
+}
+
+void wincc::AnsiParser::relay(Console &console, const char *data, size_t size)
+{
+    m_frame.clear();
+
+    for (const AnsiSpan &span : feed(data, size))
+    {
+        m_frame.append(span.foreground, span.background, span.text, span.size);
+    }
+
+    console.commit(m_frame);
+}
+
+void wincc::AnsiParser::reset()
+{
+    m_state = State::Text;
+    m_foreground = ConsoleColor::Default;
+    m_background = ConsoleColor::Default;
+    m_parameter_count = 0;
+}
+
+const char *wincc::AnsiParser::_parse_escape(const char *pos, const char *end)
+{
+    while (pos != end && m_state != State::Text)
+    {
+        unsigned char c = (unsigned char)*pos++;
+
+        switch (m_state)
+        {
+        case State::Escape:
+            if (c < 0x20 && c != 0x1b)
+            {
+                // A control character is carried out, not swallowed, and ends the sequence.
+                m_state = State::Text;
+                --pos;
+            }
+            else if (c == '[')
+            {
+                m_state = State::Csi;
+                m_parameters[0] = 0;
+                m_subparameters[0] = false;
+                m_parameter_count = 0;
+            }
+            else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+            {
+                // Commands and strings, such as window titles and hyperlinks, run to a terminator.
+                m_state = State::Osc;
+            }
+            else if (c != 0x1b && c > 0x2F)
+            {
+                // Intermediate bytes, as in ESC ( B, continue the sequence; anything else ends it.
+                m_state = State::Text;
+            }
+            break;
+
+        case State::Csi:
+            if (c >= '0' && c <= '9')
+            {
+                unsigned int &value = m_parameters[m_parameter_count];
+                value = value * 10 + (c - '0');
+                if (value > WINCC_MAX_PARAMETER_VALUE)
+                {
+                    value = WINCC_MAX_PARAMETER_VALUE;
+                }
+            }
+            else if (c == ';' || c == ':')
+            {
+                if (m_parameter_count + 1 < k_max_parameters)
+                {
+                    ++m_parameter_count;
+                    m_parameters[m_parameter_count] = 0;
+                    m_subparameters[m_parameter_count] = c == ':';
+                }
+            }
+            else if (c >= 0x40 && c <= 0x7E)
+            {
+                if (c == 'm')
+                {
+                    _apply_sgr();
+                }
+
+                m_state = State::Text;
+            }
+            else if (c == 0x1b)
+            {
+                // A broken sequence followed by a new one.
+                m_state = State::Escape;
+            }
+            else if (c == 0x18 || c == 0x1A)
+            {
+                // CAN and SUB cancel the sequence.
+                m_state = State::Text;
+            }
+            else if (c < 0x20)
+            {
+                // Other control characters are carried out in the middle of the sequence.
+                AnsiSpan span = { m_foreground, m_background, pos - 1, 1 };
+                m_spans.push_back(span);
+            }
+            break;
+
+        case State::Osc:
+            if (c == 0x07)
+            {
+                m_state = State::Text;
+            }
+            else if (c == 0x1b)
+            {
+                m_state = State::OscEscape;
+            }
+            break;
+
+        case State::OscEscape:
+            m_state = c == '\\' ? State::Text : State::Osc;
+            break;
+
+        case State::Text:
+            break;
+        }
+    }
+
+    return pos;
+}
+
+void wincc::AnsiParser::_apply_sgr()
+{
+    size_t count = m_parameter_count + 1;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        unsigned int code = m_parameters[i];
+
+        // Sub-parameters after a colon belong to this code alone.
+        size_t group_end = i + 1;
+        while (group_end < count && m_subparameters[group_end])
+        {
+            ++group_end;
+        }
+
+        if (code == 0)
+        {
+            m_foreground = ConsoleColor::Default;
+            m_background = ConsoleColor::Default;
+        }
+        else if ((code >= 30 && code <= 37) || (code >= 90 && code <= 97))
+        {
+            m_foreground = color_from_sgr(code);
+        }
+        else if ((code >= 40 && code <= 47) || (code >= 100 && code <= 107))
+        {
+            m_background = color_from_sgr(code - 10);
+        }
+        else if (code == 39)
+        {
+            m_foreground = ConsoleColor::Default;
+        }
+        else if (code == 49)
+        {
+            m_background = ConsoleColor::Default;
+        }
+        else if ((code == 38 || code == 48) && group_end > i + 1)
+        {
+            // Colon form: 5:index, 2:red:green:blue, or 2:space:red:green:blue with a color space
+            // that is usually left empty and is ignored.
+            ConsoleColor &target = code == 38 ? m_foreground : m_background;
+            const unsigned int *group = m_parameters + i + 1;
+            size_t group_size = group_end - i - 1;
+
+            if (group[0] == 5 && group_size >= 2)
+            {
+                target = color_from_index(group[1]);
+            }
+            else if (group[0] == 2 && group_size >= 5)
+            {
+                target = color_from_rgb(group[2], group[3], group[4]);
+            }
+            else if (group[0] == 2 && group_size == 4)
+            {
+                target = color_from_rgb(group[1], group[2], group[3]);
+            }
+        }
+        else if (code == 38 || code == 48)
+        {
+            // Semicolon form: 5;index or 2;red;green;blue.
+            ConsoleColor &target = code == 38 ? m_foreground : m_background;
+
+            if (i + 2 < count && m_parameters[i + 1] == 5)
+            {
+                target = color_from_index(m_parameters[i + 2]);
+                i += 2;
+            }
+            else if (i + 4 < count && m_parameters[i + 1] == 2)
+            {
+                target = color_from_rgb(m_parameters[i + 2], m_parameters[i + 3], m_parameters[i + 4]);
+                i += 4;
+            }
+            else
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        // Other attributes, such as bold and underline, have no Console equivalent.
+        i = group_end - 1;
+    }
+}
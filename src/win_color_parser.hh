@@ -0,0 +1,99 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_PARSER_HH
+#define _WIN_COLOR_PARSER_HH
+
+#include <stddef.h>
+#include <vector>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // Run of text in one pair of colors found by AnsiParser. The text points into the chunk that
+    // was fed to the parser.
+    struct AnsiSpan
+    {
+        ConsoleColor foreground;
+        ConsoleColor background;
+        const char *text;
+        size_t size;
+    };
+
+    // Streaming parser for text carrying ANSI escape sequences, such as the output of a child
+    // process. SGR color codes, including 256-color and 24-bit ones in both their semicolon and
+    // colon forms, are mapped onto the nearest ConsoleColor; other escape sequences, such as cursor
+    // moves and window titles, are dropped. Control characters inside an escape sequence, such as
+    // a newline after a stray ESC, are kept as text, as terminals carry them out.
+    // Chunks can be split anywhere, even inside an escape sequence. Text between escapes is found
+    // with the same SSE2 byte scan as markup, so mostly plain output is parsed at memory speed.
+    class AnsiParser
+    {
+    public:
+        AnsiParser() { reset(); }
+
+        // Parse the next chunk and return the text it holds, in order, as colored spans. The spans
+        // are valid until the next call or until the chunk is freed.
+        const std::vector<AnsiSpan> &feed(const char *data, size_t size);
+
+        // Parse the next chunk and write its text to a console in its colors, in a single commit.
+        // A console with ConsoleBackend::Plain strips the colors instead.
+        void relay(Console &console, const char *data, size_t size);
+
+        // Go back to the default colors and forget any escape sequence in progress.
+        void reset();
+
+        // Foreground color in effect at the end of the last chunk.
+        ConsoleColor foreground() const { return m_foreground; }
+
+        // Background color in effect at the end of the last chunk.
+        ConsoleColor background() const { return m_background; }
+
+        // True if the last chunk ended inside an escape sequence.
+        bool in_escape() const { return m_state != State::Text; }
+
+    private:
+        // Where the parser is between chunks.
+        enum class State
+        {
+            Text,
+
+            // After ESC.
+            Escape,
+
+            // After ESC [, reading parameters up to the final byte.
+            Csi,
+
+            // Inside an operating system command, which ends with BEL or ESC backslash.
+            Osc,
+
+            // After ESC inside an operating system command.
+            OscEscape
+        };
+
+        // Parameters kept from one CSI sequence. Later ones are ignored.
+        static const size_t k_max_parameters = 16;
+
+        // Apply the parameters of an SGR sequence to the colors.
+        void _apply_sgr();
+
+        // Parse escape sequence bytes starting at pos. Returns where text resumes, or end.
+        const char *_parse_escape(const char *pos, const char *end);
+
+        State m_state;
+        ConsoleColor m_foreground;
+        ConsoleColor m_background;
+
+        // Parameters of the current CSI sequence, and for each whether it came after a colon, as a
+        // sub-parameter of the one before, as in 38:2::255:0:0.
+        unsigned int m_parameters[k_max_parameters];
+        bool m_subparameters[k_max_parameters];
+        size_t m_parameter_count;
+
+        std::vector<AnsiSpan> m_spans;
+        Frame m_frame;
+    };
+}
+
+#endif /* _WIN_COLOR_PARSER_HH */
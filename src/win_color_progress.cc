@@ -0,0 +1,297 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+
+#include "win_color_progress.hh"
+
+// Default redraws per second on a terminal.
+#define WINCC_PROGRESS_FRAME_RATE 15
+
+// Default seconds between plain text summaries.
+#define WINCC_PROGRESS_SUMMARY_SECONDS 5
+
+// Shortest wait of the redraw thread, so a tiny interval cannot make it spin.
+#define WINCC_PROGRESS_MIN_WAIT_NS 1000000
+
+// Spinner animation, one character per redraw.
+static const char k_spinner_frames[] = { '|', '/', '-', '\\' };
+
+// Append the label and a colon, for plain text summaries.
+static void append_summary_label(wincc::Frame &frame, const std::string &label)
+{
+    if (!label.empty())
+    {
+        frame.append(label.data(), label.size());
+        frame.append(": ", 2);
+    }
+}
+
+// Append a number to a frame.
+static void append_count(wincc::Frame &frame, uint64_t value)
+{
+    char text[24];
+    int size = snprintf(text, sizeof(text), "%llu", (unsigned long long)value);
+    frame.append(text, (size_t)size);
+}
+
+wincc::ProgressWidget::ProgressWidget(Console &console, std::string_view label)
+    : m_console(console), m_label(label), m_terminal(console.backend() != ConsoleBackend::Plain),
+      m_frame_interval_ns(1000000000 / WINCC_PROGRESS_FRAME_RATE),
+      m_summary_interval_ns((int64_t)WINCC_PROGRESS_SUMMARY_SECONDS * 1000000000), m_done(0), m_next_redraw_ns(0),
+      m_drawing(false), m_finished(false), m_frame_number(0), m_last_width(0), m_stopping(false)
+{
+    // A terminal shows the widget right away; a log gets its first summary one interval in.
+    if (!m_terminal)
+    {
+        m_next_redraw_ns.store(detail::steady_ns() + m_summary_interval_ns, std::memory_order_relaxed);
+    }
+}
+
+wincc::ProgressWidget::~ProgressWidget()
+{
+    _stop_thread();
+}
+
+void wincc::ProgressWidget::frame_rate(double frames_per_second)
+{
+    m_frame_interval_ns = (int64_t)(1e9 / std::max(frames_per_second, 0.001));
+}
+
+void wincc::ProgressWidget::summary_interval(double seconds)
+{
+    int64_t interval = (int64_t)(std::max(seconds, 0.0) * 1e9);
+
+    // Move a pending summary up if the new interval is shorter.
+    if (!m_terminal)
+    {
+        int64_t next = detail::steady_ns() + interval;
+        if (next < m_next_redraw_ns.load(std::memory_order_relaxed))
+        {
+            m_next_redraw_ns.store(next, std::memory_order_relaxed);
+        }
+    }
+
+    m_summary_interval_ns = interval;
+}
+
+bool wincc::ProgressWidget::tick()
+{
+    int64_t now = detail::steady_ns();
+    if (now < m_next_redraw_ns.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+
+    // Another thread is drawing, so this frame is taken care of.
+    if (m_drawing.exchange(true, std::memory_order_acquire))
+    {
+        return false;
+    }
+
+    bool drawn = !m_finished && now >= m_next_redraw_ns.load(std::memory_order_relaxed);
+    if (drawn)
+    {
+        _redraw(now, false);
+    }
+
+    m_drawing.store(false, std::memory_order_release);
+    return drawn;
+}
+
+void wincc::ProgressWidget::start()
+{
+    if (!m_thread.joinable())
+    {
+        m_stopping.store(false, std::memory_order_relaxed);
+        m_thread = std::thread(&ProgressWidget::_run, this);
+    }
+}
+
+void wincc::ProgressWidget::finish()
+{
+    _stop_thread();
+
+    // Wait out a tick drawing on another thread.
+    while (m_drawing.exchange(true, std::memory_order_acquire))
+    {
+        std::this_thread::yield();
+    }
+
+    if (!m_finished)
+    {
+        _redraw(detail::steady_ns(), true);
+        m_finished = true;
+    }
+
+    m_drawing.store(false, std::memory_order_release);
+}
+
+void wincc::ProgressWidget::_redraw(int64_t now_ns, bool final)
+{
+    m_frame.clear();
+
+    if (m_terminal)
+    {
+        // Back to the start of the line, then cover what the last redraw left with spaces.
+        m_frame.append("\r", 1);
+        _render(m_frame, true, m_frame_number);
+
+        size_t width = m_frame.size() - 1;
+        for (size_t i = width; i < m_last_width; ++i)
+        {
+            m_frame.append(" ", 1);
+        }
+
+        m_last_width = width;
+
+        if (final)
+        {
+            m_frame.append("\n", 1);
+        }
+    }
+    else
+    {
+        _render(m_frame, false, m_frame_number);
+        m_frame.append("\n", 1);
+    }
+
+    m_console.commit(m_frame);
+    m_console.flush();
+
+    ++m_frame_number;
+    m_next_redraw_ns.store(now_ns + _interval_ns(), std::memory_order_relaxed);
+}
+
+void wincc::ProgressWidget::_stop_thread()
+{
+    if (!m_thread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_stop_mutex);
+        m_stopping.store(true, std::memory_order_relaxed);
+    }
+
+    m_stop.notify_one();
+    m_thread.join();
+}
+
+void wincc::ProgressWidget::_run()
+{
+    std::unique_lock<std::mutex> lock(m_stop_mutex);
+
+    while (!m_stopping.load(std::memory_order_relaxed))
+    {
+        lock.unlock();
+        tick();
+        lock.lock();
+
+        int64_t wait = m_next_redraw_ns.load(std::memory_order_relaxed) - detail::steady_ns();
+        m_stop.wait_for(lock, std::chrono::nanoseconds(std::max<int64_t>(wait, WINCC_PROGRESS_MIN_WAIT_NS)),
+            [this]() { return m_stopping.load(std::memory_order_relaxed); });
+    }
+}
+
+int64_t wincc::ProgressWidget::_interval_ns() const
+{
+    return m_terminal ? m_frame_interval_ns : m_summary_interval_ns;
+}
+
+wincc::ProgressBar::ProgressBar(Console &console, std::string_view label, uint64_t total, int width)
+    : ProgressWidget(console, label), m_total(total), m_width(std::max(width, 1))
+{
+}
+
+wincc::ProgressBar::~ProgressBar()
+{
+    finish();
+}
+
+void wincc::ProgressBar::_render(Frame &frame, bool terminal, uint64_t)
+{
+    uint64_t total = this->total();
+    uint64_t done = std::min(this->done(), total);
+    double fraction = total ? (double)done / (double)total : 1.0;
+
+    // Padded on a terminal, so the counts after it stay put.
+    char percent[8];
+    int percent_size = snprintf(percent, sizeof(percent), terminal ? "%3d%%" : "%d%%", (int)(fraction * 100));
+
+    if (!terminal)
+    {
+        // "build: 500/1000 (50%)"
+        append_summary_label(frame, _label());
+        append_count(frame, done);
+        frame.append("/", 1);
+        append_count(frame, total);
+        frame.append(" (", 2);
+        frame.append(percent, (size_t)percent_size);
+        frame.append(")", 1);
+        return;
+    }
+
+    if (!_label().empty())
+    {
+        frame.append(_label().data(), _label().size());
+        frame.append(" ", 1);
+    }
+
+    int filled = (int)(fraction * m_width);
+
+    frame.append("[", 1);
+    for (int i = 0; i < m_width; ++i)
+    {
+        if (i < filled)
+        {
+            frame.append(ConsoleColor::Green, "=", 1);
+        }
+        else
+        {
+            frame.append(ConsoleColor::DarkGray, "-", 1);
+        }
+    }
+    frame.append("] ", 2);
+
+    frame.append(ConsoleColor::Cyan, percent, (size_t)percent_size);
+    frame.append(" ", 1);
+    append_count(frame, done);
+    frame.append("/", 1);
+    append_count(frame, total);
+}
+
+wincc::Spinner::Spinner(Console &console, std::string_view label) : ProgressWidget(console, label)
+{
+}
+
+wincc::Spinner::~Spinner()
+{
+    finish();
+}
+
+void wincc::Spinner::_render(Frame &frame, bool terminal, uint64_t frame_number)
+{
+    if (!terminal)
+    {
+        // "scanning: 1234"
+        append_summary_label(frame, _label());
+        append_count(frame, done());
+        return;
+    }
+
+    char spinner = k_spinner_frames[frame_number % sizeof(k_spinner_frames)];
+    frame.append(ConsoleColor::Cyan, &spinner, 1);
+
+    if (!_label().empty())
+    {
+        frame.append(" ", 1);
+        frame.append(_label().data(), _label().size());
+    }
+
+    frame.append(" ", 1);
+    append_count(frame, done());
+}
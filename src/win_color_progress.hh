@@ -0,0 +1,150 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_PROGRESS_HH
+#define _WIN_COLOR_PROGRESS_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // Line of progress output redrawn at a capped rate. Updates are relaxed atomic adds, safe from
+    // any thread and a few nanoseconds each; nothing is drawn until a redraw is due. Redraws come
+    // from tick() on the caller's thread, or from a thread of the widget's own after start(). On a
+    // terminal each redraw rewrites the line in place; with the Plain backend, such as a log file,
+    // a plain text summary line is written at a much lower rate instead. The console must not be
+    // written to by other means until finish().
+    class ProgressWidget
+    {
+    public:
+        ProgressWidget(const ProgressWidget &) = delete;
+
+        ProgressWidget &operator=(const ProgressWidget &) = delete;
+
+        // Stop the redraw thread. Widgets finish their line in their own destructors.
+        virtual ~ProgressWidget();
+
+        // Count n more units of work done.
+        void add(uint64_t n = 1) { m_done.fetch_add(n, std::memory_order_relaxed); }
+
+        // Get the units of work done so far.
+        uint64_t done() const { return m_done.load(std::memory_order_relaxed); }
+
+        // Set the most redraws per second on a terminal. 15 by default. Call before start().
+        void frame_rate(double frames_per_second);
+
+        // Set the seconds between summary lines when the console is not a terminal. 5 by default.
+        // Call before start().
+        void summary_interval(double seconds);
+
+        // Redraw now if the last redraw was long enough ago. Cheap enough to call from a hot loop,
+        // but add() is cheaper. Returns true if the widget was redrawn. Safe from any thread, also
+        // after start().
+        bool tick();
+
+        // Redraw from a thread of the widget's own until finish().
+        void start();
+
+        // Stop redrawing, draw the final state and end the line. Later calls do nothing.
+        void finish();
+
+    protected:
+        ProgressWidget(Console &console, std::string_view label);
+
+        // Append the widget's line to frame. terminal is false for plain text summaries.
+        // frame_number counts redraws, for animation.
+        virtual void _render(Frame &frame, bool terminal, uint64_t frame_number) = 0;
+
+        // Label given at construction.
+        const std::string &_label() const { return m_label; }
+
+    private:
+        // Draw the widget and schedule the next redraw. The final redraw ends the line. Only
+        // called while holding m_drawing.
+        void _redraw(int64_t now_ns, bool final);
+
+        // Stop the redraw thread, if it was started.
+        void _stop_thread();
+
+        // Body of the redraw thread.
+        void _run();
+
+        // Nanoseconds between redraws for the console's backend.
+        int64_t _interval_ns() const;
+
+        Console &m_console;
+        std::string m_label;
+        bool m_terminal;
+
+        int64_t m_frame_interval_ns;
+        int64_t m_summary_interval_ns;
+
+        // Kept on its own cache line, so adds from hot loops do not slow down the other fields.
+        char m_pad0[64];
+        std::atomic<uint64_t> m_done;
+        char m_pad1[64];
+
+        // Steady clock time before which tick() does nothing, and the flag held while drawing.
+        std::atomic<int64_t> m_next_redraw_ns;
+        std::atomic<bool> m_drawing;
+
+        // Only touched while holding m_drawing.
+        bool m_finished;
+        Frame m_frame;
+        uint64_t m_frame_number;
+        size_t m_last_width;
+
+        std::atomic<bool> m_stopping;
+        std::mutex m_stop_mutex;
+        std::condition_variable m_stop;
+        std::thread m_thread;
+    };
+
+    // Bar showing done() out of a known total, such as
+    // "build [==========----------]  50% 500/1000", with the filled part in green and the rest in
+    // dark gray.
+    class ProgressBar : public ProgressWidget
+    {
+    public:
+        ProgressBar(Console &console, std::string_view label, uint64_t total, int width = 30);
+
+        // Finish the line if finish() was not called.
+        ~ProgressBar();
+
+        // Get the total units of work.
+        uint64_t total() const { return m_total.load(std::memory_order_relaxed); }
+
+        // Change the total units of work, for work discovered along the way.
+        void total(uint64_t value) { m_total.store(value, std::memory_order_relaxed); }
+
+    protected:
+        void _render(Frame &frame, bool terminal, uint64_t frame_number) override;
+
+    private:
+        std::atomic<uint64_t> m_total;
+        int m_width;
+    };
+
+    // Spinner for work of unknown size, such as "| scanning 1234", turning once per redraw.
+    class Spinner : public ProgressWidget
+    {
+    public:
+        Spinner(Console &console, std::string_view label);
+
+        // Finish the line if finish() was not called.
+        ~Spinner();
+
+    protected:
+        void _render(Frame &frame, bool terminal, uint64_t frame_number) override;
+    };
+}
+
+#endif /* _WIN_COLOR_PROGRESS_HH */
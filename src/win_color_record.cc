@@ -0,0 +1,678 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "win_color_record.hh"
+
+// Version written in the header. Readers reject any other.
+#define WINCC_RECORD_VERSION 1
+
+// Header flag for recordings whose records may carry timestamps.
+#define WINCC_RECORD_TIMESTAMPS 0x01
+
+// Sizes of the header, the footer and an index entry in bytes.
+#define WINCC_RECORD_HEADER_SIZE 16
+#define WINCC_RECORD_FOOTER_SIZE 20
+#define WINCC_RECORD_ENTRY_SIZE 16
+
+// Opcode bits: a timestamp follows, the foreground is in the low five bits, a background follows.
+#define WINCC_RECORD_TIME 0x80
+#define WINCC_RECORD_FOREGROUND 0x40
+#define WINCC_RECORD_BACKGROUND 0x20
+#define WINCC_RECORD_COLOR_MASK 0x1F
+
+// Bytes of records buffered before they are handed to the output sink, and the longest run kept
+// in one record.
+#define WINCC_RECORD_BUFFER_SIZE (64 * 1024)
+#define WINCC_RECORD_MAX_RUN (64 * 1024)
+
+// Bytes of text a replay puts in one frame, and slices in one gather write of plain text.
+#define WINCC_REPLAY_FRAME_SIZE (64 * 1024)
+#define WINCC_REPLAY_SLICES 512
+
+// Append an integer as eight little endian bytes.
+static void append_u64(std::string &out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        out.push_back((char)(value >> (i * 8)));
+    }
+}
+
+// Read eight little endian bytes.
+static uint64_t load_u64(const char *data)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
+    {
+        value = (value << 8) | (unsigned char)data[i];
+    }
+
+    return value;
+}
+
+// Append an integer seven bits at a time, low bits first, with the high bit set on all but the
+// last byte.
+static void append_varint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+
+    out.push_back((char)value);
+}
+
+// Read an integer written by append_varint. Returns false if it runs past end.
+static bool read_varint(const char *&pos, const char *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; pos != end && shift < 64; shift += 7)
+    {
+        unsigned char byte = (unsigned char)*pos++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// One decoded record.
+struct Record
+{
+    unsigned char opcode;
+    wincc::ConsoleColor foreground;
+    wincc::ConsoleColor background;
+    uint64_t delta;
+    const char *text;
+    size_t size;
+};
+
+// Decode the record at pos and move pos past it. Returns false if it is damaged or cut short.
+static bool read_record(const char *&pos, const char *end, Record &record)
+{
+    if (pos == end)
+    {
+        return false;
+    }
+
+    record.opcode = (unsigned char)*pos++;
+    record.background = wincc::ConsoleColor::Default;
+    record.delta = 0;
+
+    unsigned foreground = record.opcode & WINCC_RECORD_COLOR_MASK;
+    if (foreground > (unsigned)wincc::ConsoleColor::Default || (foreground && !(record.opcode & WINCC_RECORD_FOREGROUND)))
+    {
+        return false;
+    }
+    record.foreground = (wincc::ConsoleColor)foreground;
+
+    if (record.opcode & WINCC_RECORD_BACKGROUND)
+    {
+        if (pos == end || (unsigned char)*pos > (unsigned char)wincc::ConsoleColor::Default)
+        {
+            return false;
+        }
+        record.background = (wincc::ConsoleColor)*pos++;
+    }
+
+    uint64_t size;
+    if (((record.opcode & WINCC_RECORD_TIME) && !read_varint(pos, end, record.delta)) || !read_varint(pos, end, size) ||
+        size > (uint64_t)(end - pos))
+    {
+        return false;
+    }
+
+    record.text = pos;
+    record.size = (size_t)size;
+    pos += size;
+    return true;
+}
+
+wincc::RecordSink::RecordSink(OutputSink &out, bool timestamps)
+    : m_out(out), m_timestamps(timestamps), m_finished(false), m_start_ns(detail::steady_ns()),
+      m_run_foreground(ConsoleColor::Default), m_run_background(ConsoleColor::Default), m_run_time(0), m_offset(0),
+      m_foreground(ConsoleColor::Default), m_background(ConsoleColor::Default), m_time(0), m_lines(0),
+      m_partial_line(false), m_checkpoint(true)
+{
+    uint64_t start_time = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    m_buffer.reserve(WINCC_RECORD_BUFFER_SIZE + WINCC_RECORD_MAX_RUN);
+    m_buffer.append("WCCR", 4);
+    m_buffer.push_back((char)WINCC_RECORD_VERSION);
+    m_buffer.push_back(timestamps ? (char)WINCC_RECORD_TIMESTAMPS : 0);
+    m_buffer.push_back((char)(k_lines_per_checkpoint & 0xFF));
+    m_buffer.push_back((char)(k_lines_per_checkpoint >> 8));
+    append_u64(m_buffer, start_time);
+}
+
+wincc::RecordSink::~RecordSink()
+{
+    finish();
+}
+
+void wincc::RecordSink::write(const char *data, size_t size)
+{
+    if (m_finished)
+    {
+        return;
+    }
+
+    for (const AnsiSpan &span : m_parser.feed(data, size))
+    {
+        _append(span.foreground, span.background, span.text, span.size);
+    }
+}
+
+void wincc::RecordSink::flush()
+{
+    if (!m_finished)
+    {
+        _end_run();
+        _push();
+    }
+
+    m_out.flush();
+}
+
+void wincc::RecordSink::finish()
+{
+    if (m_finished)
+    {
+        return;
+    }
+
+    _end_run();
+
+    uint64_t index_offset = m_offset + m_buffer.size();
+    for (uint64_t value : m_index)
+    {
+        append_u64(m_buffer, value);
+    }
+
+    append_u64(m_buffer, index_offset);
+    append_u64(m_buffer, m_lines + (m_partial_line ? 1 : 0));
+    m_buffer.append("WCCX", 4);
+
+    _push();
+    m_out.flush();
+    m_finished = true;
+}
+
+void wincc::RecordSink::_append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size)
+{
+    while (size > 0)
+    {
+        if (!m_run.empty() && (foreground != m_run_foreground || background != m_run_background))
+        {
+            _end_run();
+        }
+
+        if (m_run.empty())
+        {
+            m_run_foreground = foreground;
+            m_run_background = background;
+            m_run_time = m_timestamps ? (uint64_t)((detail::steady_ns() - m_start_ns) / 1000) : 0;
+        }
+
+        // Take text up to the newline that completes a checkpoint's worth of lines, if there is
+        // one, so the next line starts a record.
+        const char *end = text + size;
+        const char *pos = text;
+        size_t take = size;
+        bool checkpoint = false;
+
+        while (true)
+        {
+            const char *newline = detail::find_byte(pos, end, '\n');
+            if (newline == end)
+            {
+                break;
+            }
+
+            pos = newline + 1;
+            if (++m_lines % k_lines_per_checkpoint == 0)
+            {
+                take = (size_t)(pos - text);
+                checkpoint = true;
+                break;
+            }
+        }
+
+        m_partial_line = text[take - 1] != '\n';
+        m_run.append(text, take);
+
+        if (checkpoint)
+        {
+            _end_run();
+            m_checkpoint = true;
+        }
+        else if (m_run.size() >= WINCC_RECORD_MAX_RUN)
+        {
+            _end_run();
+        }
+
+        text += take;
+        size -= take;
+    }
+}
+
+void wincc::RecordSink::_end_run()
+{
+    if (m_run.empty())
+    {
+        return;
+    }
+
+    // A checkpoint sets both colors, so reading can start there.
+    bool full = m_checkpoint;
+    if (m_checkpoint)
+    {
+        m_index.push_back(m_offset + m_buffer.size());
+        m_index.push_back(m_time);
+        m_checkpoint = false;
+    }
+
+    uint64_t delta = m_run_time - m_time;
+    unsigned char opcode = 0;
+
+    if (delta > 0)
+    {
+        opcode |= WINCC_RECORD_TIME;
+    }
+
+    if (full || m_run_foreground != m_foreground)
+    {
+        opcode |= WINCC_RECORD_FOREGROUND | (unsigned char)m_run_foreground;
+    }
+
+    if (full || m_run_background != m_background)
+    {
+        opcode |= WINCC_RECORD_BACKGROUND;
+    }
+
+    m_buffer.push_back((char)opcode);
+
+    if (opcode & WINCC_RECORD_BACKGROUND)
+    {
+        m_buffer.push_back((char)m_run_background);
+    }
+
+    if (opcode & WINCC_RECORD_TIME)
+    {
+        append_varint(m_buffer, delta);
+    }
+
+    append_varint(m_buffer, m_run.size());
+    m_buffer.append(m_run);
+
+    m_foreground = m_run_foreground;
+    m_background = m_run_background;
+    m_time = m_run_time;
+    m_run.clear();
+
+    if (m_buffer.size() >= WINCC_RECORD_BUFFER_SIZE)
+    {
+        _push();
+    }
+}
+
+void wincc::RecordSink::_push()
+{
+    if (!m_buffer.empty())
+    {
+        m_out.write(m_buffer.data(), m_buffer.size());
+        m_offset += m_buffer.size();
+        m_buffer.clear();
+    }
+}
+
+wincc::Recording::Recording(const char *path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+
+    const void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view)
+    {
+        if (mapping)
+        {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        return;
+    }
+
+    m_file = file;
+    m_mapping = mapping;
+    m_data = (const char *)view;
+    m_size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat info;
+    void *view = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+
+    if (view == MAP_FAILED)
+    {
+        return;
+    }
+
+    m_mapping = view;
+    m_data = (const char *)view;
+    m_size = (size_t)info.st_size;
+#endif
+
+    _load();
+}
+
+wincc::Recording::Recording(const char *data, size_t size) : m_data(data), m_size(size)
+{
+    _load();
+}
+
+wincc::Recording::~Recording()
+{
+    _unmap();
+}
+
+void wincc::Recording::replay(Console &console, size_t first_line, size_t count) const
+{
+    Frame frame;
+
+    for_each(first_line, count, [&](const RecordedRun &run)
+    {
+        frame.append(run.foreground, run.background, run.text, run.size);
+
+        if (frame.size() >= WINCC_REPLAY_FRAME_SIZE)
+        {
+            console.commit(frame);
+            frame.clear();
+        }
+    });
+
+    console.commit(frame);
+}
+
+void wincc::Recording::write_text(OutputSink &sink, size_t first_line, size_t count) const
+{
+    std::vector<IoSlice> slices;
+    slices.reserve(WINCC_REPLAY_SLICES);
+
+    for_each(first_line, count, [&](const RecordedRun &run)
+    {
+        IoSlice slice = { run.text, run.size };
+        slices.push_back(slice);
+
+        if (slices.size() == WINCC_REPLAY_SLICES)
+        {
+            sink.writev(slices.data(), slices.size());
+            slices.clear();
+        }
+    });
+
+    if (!slices.empty())
+    {
+        sink.writev(slices.data(), slices.size());
+    }
+}
+
+void wincc::Recording::_load()
+{
+    if (!m_data || m_size < WINCC_RECORD_HEADER_SIZE || memcmp(m_data, "WCCR", 4) != 0 ||
+        m_data[4] != WINCC_RECORD_VERSION)
+    {
+        _unmap();
+        return;
+    }
+
+    m_timestamps = (m_data[5] & WINCC_RECORD_TIMESTAMPS) != 0;
+    m_lines_per_checkpoint = (unsigned char)m_data[6] | ((size_t)(unsigned char)m_data[7] << 8);
+    m_start_time = load_u64(m_data + 8);
+
+    if (m_lines_per_checkpoint == 0)
+    {
+        _unmap();
+        return;
+    }
+
+    // A footer is only trusted if its index fits between the header and the footer and starts
+    // with the first record.
+    if (m_size >= WINCC_RECORD_HEADER_SIZE + WINCC_RECORD_FOOTER_SIZE &&
+        memcmp(m_data + m_size - 4, "WCCX", 4) == 0)
+    {
+        const char *footer = m_data + m_size - WINCC_RECORD_FOOTER_SIZE;
+        uint64_t index_offset = load_u64(footer);
+        uint64_t index_end = m_size - WINCC_RECORD_FOOTER_SIZE;
+
+        if (index_offset >= WINCC_RECORD_HEADER_SIZE && index_offset <= index_end &&
+            (index_end - index_offset) % WINCC_RECORD_ENTRY_SIZE == 0 &&
+            (index_offset == index_end || load_u64(m_data + index_offset) == WINCC_RECORD_HEADER_SIZE))
+        {
+            m_finished = true;
+            m_records_end = (size_t)index_offset;
+            m_index = m_data + index_offset;
+            m_checkpoint_count = (size_t)(index_end - index_offset) / WINCC_RECORD_ENTRY_SIZE;
+            m_line_count = (size_t)load_u64(footer + 8);
+            return;
+        }
+    }
+
+    _rebuild_index();
+}
+
+void wincc::Recording::_rebuild_index()
+{
+    const char *pos = m_data + WINCC_RECORD_HEADER_SIZE;
+    const char *end = m_data + m_size;
+    uint64_t time = 0;
+    size_t lines = 0;
+    bool partial_line = false;
+
+    m_rebuilt.clear();
+
+    while (pos != end)
+    {
+        const char *start = pos;
+
+        // The recorder starts a checkpoint with the first record after every
+        // m_lines_per_checkpoint newlines.
+        if (lines >= m_checkpoint_count * m_lines_per_checkpoint)
+        {
+            append_u64(m_rebuilt, (uint64_t)(start - m_data));
+            append_u64(m_rebuilt, time);
+            ++m_checkpoint_count;
+        }
+
+        Record record;
+        if (!read_record(pos, end, record))
+        {
+            // A record cut short by the end of an unfinished recording, or damage: stop before it.
+            pos = start;
+            break;
+        }
+
+        time += record.delta;
+
+        const char *text = record.text;
+        const char *text_end = record.text + record.size;
+        while ((text = detail::find_byte(text, text_end, '\n')) != text_end)
+        {
+            ++lines;
+            ++text;
+        }
+
+        if (record.size > 0)
+        {
+            partial_line = text_end[-1] != '\n';
+        }
+    }
+
+    // A checkpoint added for the record that turned out to be cut short is dropped.
+    m_records_end = (size_t)(pos - m_data);
+    if (m_checkpoint_count > 0 && load_u64(m_rebuilt.data() + m_rebuilt.size() - WINCC_RECORD_ENTRY_SIZE) >= m_records_end)
+    {
+        m_rebuilt.resize(m_rebuilt.size() - WINCC_RECORD_ENTRY_SIZE);
+        --m_checkpoint_count;
+    }
+
+    m_index = m_rebuilt.data();
+    m_line_count = lines + (partial_line ? 1 : 0);
+}
+
+wincc::Recording::Cursor wincc::Recording::_seek(size_t first_line, size_t count) const
+{
+    Cursor cursor = { m_records_end, ConsoleColor::Default, ConsoleColor::Default, 0, 0, 0 };
+
+    if (first_line >= m_line_count || count == 0 || m_checkpoint_count == 0)
+    {
+        return cursor;
+    }
+
+    size_t checkpoint = std::min(first_line / m_lines_per_checkpoint, m_checkpoint_count - 1);
+    const char *entry = m_index + checkpoint * WINCC_RECORD_ENTRY_SIZE;
+    uint64_t offset = load_u64(entry);
+
+    if (offset < WINCC_RECORD_HEADER_SIZE || offset > m_records_end)
+    {
+        return cursor;
+    }
+
+    cursor.offset = (size_t)offset;
+    cursor.time = load_u64(entry + 8);
+    cursor.skip = first_line - checkpoint * m_lines_per_checkpoint;
+    cursor.remaining = count;
+    return cursor;
+}
+
+bool wincc::Recording::_next(Cursor &cursor, RecordedRun &run) const
+{
+    const char *records_end = m_data + m_records_end;
+
+    while (cursor.remaining > 0 && cursor.offset < m_records_end)
+    {
+        const char *pos = m_data + cursor.offset;
+        Record record;
+        if (!read_record(pos, records_end, record))
+        {
+            cursor.offset = m_records_end;
+            return false;
+        }
+
+        cursor.offset = (size_t)(pos - m_data);
+        cursor.time += record.delta;
+
+        if (record.opcode & WINCC_RECORD_FOREGROUND)
+        {
+            cursor.foreground = record.foreground;
+        }
+
+        if (record.opcode & WINCC_RECORD_BACKGROUND)
+        {
+            cursor.background = record.background;
+        }
+
+        const char *text = record.text;
+        const char *end = record.text + record.size;
+
+        // Lines between the checkpoint and the first line wanted.
+        while (cursor.skip > 0 && text != end)
+        {
+            const char *newline = detail::find_byte(text, end, '\n');
+            text = newline == end ? end : newline + 1;
+            cursor.skip -= newline != end;
+        }
+
+        if (text == end)
+        {
+            continue;
+        }
+
+        // Cut the run after the last line wanted. Nothing is counted when every line is wanted.
+        if (cursor.remaining != k_all_lines)
+        {
+            const char *line = text;
+            while ((line = detail::find_byte(line, end, '\n')) != end)
+            {
+                ++line;
+                if (--cursor.remaining == 0)
+                {
+                    end = line;
+                    break;
+                }
+            }
+        }
+
+        run.foreground = cursor.foreground;
+        run.background = cursor.background;
+        run.time = cursor.time;
+        run.text = text;
+        run.size = (size_t)(end - text);
+        return true;
+    }
+
+    return false;
+}
+
+void wincc::Recording::_unmap()
+{
+#ifdef _WIN32
+    if (m_mapping)
+    {
+        UnmapViewOfFile(m_data);
+        CloseHandle((HANDLE)m_mapping);
+        CloseHandle((HANDLE)m_file);
+    }
+#else
+    if (m_mapping)
+    {
+        munmap(m_mapping, m_size);
+    }
+#endif
+
+    m_mapping = nullptr;
+    m_file = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+}
@@ -0,0 +1,230 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_RECORD_HH
+#define _WIN_COLOR_RECORD_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "win_color_console.hh"
+#include "win_color_parser.hh"
+
+namespace wincc
+{
+    // Sink recording colored output in a compact binary form, for archiving the output of long
+    // jobs and replaying it later through any backend. Give it to a console with the ANSI backend,
+    // or to Auto, since it reports being a terminal. The escape sequences the console sends are
+    // parsed back into colors, and each run of text in one pair of colors is stored as a record:
+    // an opcode byte with the colors that changed, an optional timestamp, and the text with its
+    // length in front. Every k_lines_per_checkpoint lines a record starts with the full colors and
+    // its offset goes into an index written by finish(), so a Recording can seek to any line.
+    //
+    // File layout, integers little endian:
+    //   header   "WCCR", version, flags (1: timestamps), lines per checkpoint (u16), start time in
+    //            microseconds since the Unix epoch (u64)
+    //   records  opcode: 0x80 timestamp follows, 0x40 foreground in the low five bits,
+    //                    0x20 background byte follows
+    //            [background] [microseconds since the last timestamp, varint] text length (varint)
+    //            text
+    //   index    per checkpoint: record offset (u64), time before its timestamp (u64)
+    //   footer   index offset (u64), line count (u64), "WCCX"
+    class RecordSink : public OutputSink
+    {
+    public:
+        // Record into out, such as an FdSink on a file. With timestamps, each record carries the
+        // time since the previous one, in microseconds.
+        explicit RecordSink(OutputSink &out, bool timestamps = false);
+
+        RecordSink(const RecordSink &) = delete;
+
+        RecordSink &operator=(const RecordSink &) = delete;
+
+        // Finish the recording if finish() was not called.
+        ~RecordSink();
+
+        void write(const char *data, size_t size) override;
+
+        // Store the text held so far and flush the output sink. The recording stays open.
+        void flush() override;
+
+        // Recordings keep colors, so a console with ConsoleBackend::Auto should send them.
+        bool is_terminal() const override { return true; }
+
+        // Store the text held so far, write the index and footer and flush. Later writes are
+        // dropped. A recording that was never finished can still be read, more slowly.
+        void finish();
+
+        // Bytes of the recording written so far, including text not yet stored.
+        uint64_t size() const { return m_offset + m_buffer.size() + m_run.size(); }
+
+        static const size_t k_lines_per_checkpoint = 64;
+
+    private:
+        // Add text in the given colors to the current run, ending runs at color changes and at
+        // checkpoints.
+        void _append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size);
+
+        // Encode the current run as a record.
+        void _end_run();
+
+        // Hand the encoded records to the output sink.
+        void _push();
+
+        OutputSink &m_out;
+        AnsiParser m_parser;
+        bool m_timestamps;
+        bool m_finished;
+        int64_t m_start_ns;
+
+        // Text of the current run, its colors, and when it started in microseconds.
+        std::string m_run;
+        ConsoleColor m_run_foreground;
+        ConsoleColor m_run_background;
+        uint64_t m_run_time;
+
+        // Encoded records not yet handed to the output sink, and the bytes handed to it.
+        std::string m_buffer;
+        uint64_t m_offset;
+
+        // Colors and time as of the last record, which the next one changes.
+        ConsoleColor m_foreground;
+        ConsoleColor m_background;
+        uint64_t m_time;
+
+        // Newlines recorded, whether text follows the last one, and whether the next record is a
+        // checkpoint.
+        uint64_t m_lines;
+        bool m_partial_line;
+        bool m_checkpoint;
+
+        // Offset and time of each checkpoint record.
+        std::vector<uint64_t> m_index;
+    };
+
+    // Run of text in one pair of colors read from a Recording. The text points into the recording.
+    struct RecordedRun
+    {
+        ConsoleColor foreground;
+        ConsoleColor background;
+
+        // Microseconds from the start of the recording to when the run was written. Always 0 in a
+        // recording without timestamps.
+        uint64_t time;
+
+        const char *text;
+        size_t size;
+    };
+
+    // Recording made by RecordSink, memory mapped from a file or read from memory. Any range of
+    // lines can be replayed through a console of any backend, or written out as plain text,
+    // starting from the nearest checkpoint before the first line rather than from the start. The
+    // text is never copied out of the mapping except into a console's frames.
+    class Recording
+    {
+    public:
+        // Map the file at path.
+        explicit Recording(const char *path);
+
+        // Read a recording held in memory, which must outlive this object.
+        Recording(const char *data, size_t size);
+
+        Recording(const Recording &) = delete;
+
+        Recording &operator=(const Recording &) = delete;
+
+        ~Recording();
+
+        // False if the file could not be mapped or does not hold a recording.
+        bool is_open() const { return m_data != nullptr; }
+
+        // False if the recording was not finished, in which case the index was rebuilt by reading
+        // every record once.
+        bool is_finished() const { return m_finished; }
+
+        // True if records carry timestamps.
+        bool has_timestamps() const { return m_timestamps; }
+
+        // Microseconds since the Unix epoch when recording started.
+        uint64_t start_time() const { return m_start_time; }
+
+        // Lines in the recording, counting text after the last newline as a line.
+        size_t line_count() const { return m_line_count; }
+
+        // Call fn with each run of text in lines [first_line, first_line + count), in order.
+        template <class Fn>
+        void for_each(size_t first_line, size_t count, Fn fn) const
+        {
+            Cursor cursor = _seek(first_line, count);
+            RecordedRun run;
+
+            while (_next(cursor, run))
+            {
+                fn(run);
+            }
+        }
+
+        // Write lines [first_line, first_line + count) to a console in their colors, in frames of
+        // up to 64 KB. A console with ConsoleBackend::Plain strips the colors.
+        void replay(Console &console, size_t first_line = 0, size_t count = k_all_lines) const;
+
+        // Write the text of lines [first_line, first_line + count) to a sink without any colors,
+        // as gather writes straight from the recording.
+        void write_text(OutputSink &sink, size_t first_line = 0, size_t count = k_all_lines) const;
+
+        // Line count standing for every line to the end.
+        static const size_t k_all_lines = (size_t)-1;
+
+    private:
+        // Position within the records while reading a range of lines.
+        struct Cursor
+        {
+            size_t offset;
+            ConsoleColor foreground;
+            ConsoleColor background;
+            uint64_t time;
+
+            // Newlines still to skip before the range starts, and lines left in it.
+            size_t skip;
+            size_t remaining;
+        };
+
+        // Check the header and footer and find the index, rebuilding it if there is no footer.
+        void _load();
+
+        // Read every record to count the lines and find the checkpoints, for unfinished recordings.
+        void _rebuild_index();
+
+        // Cursor at the checkpoint before first_line, set to skip to it.
+        Cursor _seek(size_t first_line, size_t count) const;
+
+        // Read the next run of the range. Returns false at its end or at a damaged record.
+        bool _next(Cursor &cursor, RecordedRun &run) const;
+
+        // Unmap the file, if one was mapped.
+        void _unmap();
+
+        const char *m_data = nullptr;
+        size_t m_size = 0;
+
+        // Mapping to release, if the recording came from a file.
+        void *m_mapping = nullptr;
+        void *m_file = nullptr;
+
+        bool m_finished = false;
+        bool m_timestamps = false;
+        uint64_t m_start_time = 0;
+        size_t m_line_count = 0;
+        size_t m_lines_per_checkpoint = 0;
+
+        // End of the records, and the index: in the recording when finished, or in m_rebuilt.
+        size_t m_records_end = 0;
+        const char *m_index = nullptr;
+        size_t m_checkpoint_count = 0;
+        std::string m_rebuilt;
+    };
+}
+
+#endif /* _WIN_COLOR_RECORD_HH */
@@ -0,0 +1,306 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include "win_color_screen.hh"
+
+#include <algorithm>
+#include <string.h>
+
+#include "win_color_table.hh"
+
+// Code point stored in the front buffer for cells whose contents on the terminal are unknown. It
+// is not a valid code point, so it never matches a cell of the back buffer.
+#define WINCC_UNKNOWN_CELL ((char32_t)0xFFFFFFFF)
+
+// Code point of the cell covered by the right half of a wide character. Control characters are
+// never stored, so it cannot be confused with a real cell.
+#define WINCC_CONTINUATION_CELL ((char32_t)0)
+
+// Unchanged cells between two changed runs of a row that are rewritten rather than skipped with a
+// cursor move. A cursor move takes six to eight bytes, about the same as four plain cells.
+#define WINCC_MAX_REWRITE_GAP 4
+
+// Pack two colors into a cell style.
+static uint16_t pack_style(wincc::ConsoleColor foreground, wincc::ConsoleColor background)
+{
+    return (uint16_t)((unsigned)foreground | ((unsigned)background << 8));
+}
+
+// Code point to store for one the caller asked for, and the cells it takes. Characters that would
+// move the terminal's cursor away from where the screen thinks it is become spaces: control
+// characters, and zero-width ones, which would share a cell with the character before them.
+// Surrogates and values beyond Unicode become U+FFFD.
+static char32_t printable_codepoint(char32_t codepoint, int &width)
+{
+    width = 1;
+
+    if (codepoint >= 0x20 && codepoint < 0x7F)
+    {
+        return codepoint;
+    }
+
+    if (codepoint < 0x20 || (codepoint >= 0x7F && codepoint <= 0x9F))
+    {
+        return U' ';
+    }
+
+    if ((codepoint >= 0xD800 && codepoint <= 0xDFFF) || codepoint > 0x10FFFF)
+    {
+        return U'\uFFFD';
+    }
+
+    width = wincc::detail::codepoint_width(codepoint);
+    if (width == 0)
+    {
+        width = 1;
+        return U' ';
+    }
+
+    return codepoint;
+}
+
+// Append a code point to dst as UTF-8.
+static void append_codepoint(char32_t cp, std::string &dst)
+{
+    if (cp < 0x80)
+    {
+        dst += (char)cp;
+    }
+    else if (cp < 0x800)
+    {
+        dst += (char)(0xC0 | (cp >> 6));
+        dst += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        dst += (char)(0xE0 | (cp >> 12));
+        dst += (char)(0x80 | ((cp >> 6) & 0x3F));
+        dst += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        dst += (char)(0xF0 | (cp >> 18));
+        dst += (char)(0x80 | ((cp >> 12) & 0x3F));
+        dst += (char)(0x80 | ((cp >> 6) & 0x3F));
+        dst += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+wincc::Screen::Screen(int width, int height) :
+    m_width(0),
+    m_height(0),
+    m_last_changed_cells(0)
+{
+    resize(width, height);
+}
+
+void wincc::Screen::resize(int width, int height)
+{
+    m_width = width > 0 ? width : 0;
+    m_height = height > 0 ? height : 0;
+
+    size_t cells = (size_t)m_width * (size_t)m_height;
+    m_codepoints.assign(cells, U' ');
+    m_styles.assign(cells, pack_style(ConsoleColor::Default, ConsoleColor::Default));
+    m_front_codepoints.assign(cells, WINCC_UNKNOWN_CELL);
+    m_front_styles.assign(cells, 0);
+}
+
+void wincc::Screen::clear(ConsoleColor foreground, ConsoleColor background)
+{
+    std::fill(m_codepoints.begin(), m_codepoints.end(), U' ');
+    std::fill(m_styles.begin(), m_styles.end(), pack_style(foreground, background));
+}
+
+void wincc::Screen::put(int row, int column, char32_t codepoint, ConsoleColor foreground, ConsoleColor background)
+{
+    if (row < 0 || row >= m_height || column < 0 || column >= m_width)
+    {
+        return;
+    }
+
+    int width;
+    codepoint = printable_codepoint(codepoint, width);
+
+    // Half a wide character is no use, so one that does not fit before the right edge is dropped.
+    if (width == 2 && column + 1 >= m_width)
+    {
+        codepoint = U' ';
+        width = 1;
+    }
+
+    _break_wide(row, column);
+    if (width == 2)
+    {
+        _break_wide(row, column + 1);
+    }
+
+    size_t index = _index(row, column);
+    uint16_t style = pack_style(foreground, background);
+    m_codepoints[index] = codepoint;
+    m_styles[index] = style;
+
+    if (width == 2)
+    {
+        m_codepoints[index + 1] = WINCC_CONTINUATION_CELL;
+        m_styles[index + 1] = style;
+    }
+}
+
+int wincc::Screen::write(int row, int column, std::string_view text, ConsoleColor foreground, ConsoleColor background)
+{
+    if (row < 0 || row >= m_height)
+    {
+        return 0;
+    }
+
+    int written = 0;
+    size_t pos = 0;
+
+    while (pos < text.size() && column < m_width)
+    {
+        int width;
+        char32_t codepoint = printable_codepoint(detail::decode_utf8(text, pos), width);
+
+        if (column >= 0)
+        {
+            put(row, column, codepoint, foreground, background);
+            written += std::min(width, m_width - column);
+        }
+        else if (column + width > 0)
+        {
+            // The right half of a wide character starting left of the screen.
+            put(row, 0, U' ', foreground, background);
+            ++written;
+        }
+
+        column += width;
+    }
+
+    return written;
+}
+
+void wincc::Screen::invalidate()
+{
+    std::fill(m_front_codepoints.begin(), m_front_codepoints.end(), WINCC_UNKNOWN_CELL);
+}
+
+void wincc::Screen::present(Console &console)
+{
+    m_frame.clear();
+    m_last_changed_cells = 0;
+
+    if (m_width == 0)
+    {
+        return;
+    }
+
+    // Where the terminal's cursor is, or -1 when it is not known.
+    int cursor_row = -1;
+    int cursor_column = -1;
+
+    for (int row = 0; row < m_height; ++row)
+    {
+        size_t row_start = _index(row, 0);
+
+        if (memcmp(&m_codepoints[row_start], &m_front_codepoints[row_start], m_width * sizeof(char32_t)) == 0 &&
+            memcmp(&m_styles[row_start], &m_front_styles[row_start], m_width * sizeof(uint16_t)) == 0)
+        {
+            continue;
+        }
+
+        int column = 0;
+
+        while (column < m_width)
+        {
+            if (!_changed(row_start + column))
+            {
+                ++column;
+                continue;
+            }
+
+            // Extend the run over changed cells and over short gaps of unchanged ones.
+            int begin = column;
+            int end = column + 1;
+            int probe = end;
+
+            while (probe < m_width && probe - end <= WINCC_MAX_REWRITE_GAP)
+            {
+                if (_changed(row_start + probe))
+                {
+                    end = probe + 1;
+                }
+
+                ++probe;
+            }
+
+            // A wide character is always sent whole.
+            if (m_codepoints[row_start + begin] == WINCC_CONTINUATION_CELL)
+            {
+                --begin;
+            }
+
+            if (end < m_width && m_codepoints[row_start + end] == WINCC_CONTINUATION_CELL)
+            {
+                ++end;
+            }
+
+            if (cursor_row != row || cursor_column != begin)
+            {
+                m_frame.move_cursor(row, begin);
+            }
+
+            _append_cells(row_start + begin, row_start + end);
+            m_last_changed_cells += (size_t)(end - begin);
+
+            // Terminals differ in where the cursor goes after the last column, so forget it there.
+            cursor_row = row;
+            cursor_column = end < m_width ? end : -1;
+            column = end;
+        }
+
+        memcpy(&m_front_codepoints[row_start], &m_codepoints[row_start], m_width * sizeof(char32_t));
+        memcpy(&m_front_styles[row_start], &m_styles[row_start], m_width * sizeof(uint16_t));
+    }
+
+    if (!m_frame.empty())
+    {
+        console.commit(m_frame);
+    }
+}
+
+void wincc::Screen::_append_cells(size_t begin, size_t end)
+{
+    while (begin < end)
+    {
+        uint16_t style = m_styles[begin];
+        m_utf8.clear();
+
+        while (begin < end && m_styles[begin] == style)
+        {
+            char32_t codepoint = m_codepoints[begin++];
+            if (codepoint != WINCC_CONTINUATION_CELL)
+            {
+                append_codepoint(codepoint, m_utf8);
+            }
+        }
+
+        m_frame.append((ConsoleColor)(style & 0xFF), (ConsoleColor)(style >> 8), m_utf8.data(), m_utf8.size());
+    }
+}
+
+void wincc::Screen::_break_wide(int row, int column)
+{
+    size_t index = _index(row, column);
+
+    // Overwriting either half of a wide character leaves a space in the other half.
+    if (m_codepoints[index] == WINCC_CONTINUATION_CELL)
+    {
+        m_codepoints[index - 1] = U' ';
+    }
+
+    if (column + 1 < m_width && m_codepoints[index + 1] == WINCC_CONTINUATION_CELL)
+    {
+        m_codepoints[index + 1] = U' ';
+    }
+}
@@ -0,0 +1,103 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_SCREEN_HH
+#define _WIN_COLOR_SCREEN_HH
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // Full-screen buffer of colored cells for dashboards that redraw often. Drawing only touches
+    // the back buffer. present() compares it with what was last presented and sends just the runs
+    // of cells that changed, with cursor moves in between, as one Frame. Each cell holds one code
+    // point, and a wide character, as measured by detail::codepoint_width, takes two cells.
+    class Screen
+    {
+    public:
+        // Create a screen of the given size filled with spaces in the default colors.
+        Screen(int width, int height);
+
+        // Change the size. The back buffer is cleared and the next present redraws everything.
+        void resize(int width, int height);
+
+        // Get the number of columns.
+        int width() const { return m_width; }
+
+        // Get the number of rows.
+        int height() const { return m_height; }
+
+        // Fill the back buffer with spaces in the given colors.
+        void clear(ConsoleColor foreground = ConsoleColor::Default, ConsoleColor background = ConsoleColor::Default);
+
+        // Set one cell, or two for a wide character. Cells outside the screen are ignored, and a
+        // wide character in the last column becomes a space. Control characters and zero-width
+        // characters become spaces, and surrogates U+FFFD.
+        void put(int row, int column, char32_t codepoint, ConsoleColor foreground,
+            ConsoleColor background = ConsoleColor::Default);
+
+        // Write UTF-8 text starting at a cell, clipped at the right edge. Returns the number of
+        // cells written.
+        int write(int row, int column, std::string_view text, ConsoleColor foreground,
+            ConsoleColor background = ConsoleColor::Default);
+
+        // Get the code point of a cell in the back buffer. The cell covered by the right half of a
+        // wide character holds 0.
+        char32_t codepoint(int row, int column) const { return m_codepoints[_index(row, column)]; }
+
+        // Get the foreground color of a cell in the back buffer.
+        ConsoleColor foreground(int row, int column) const { return (ConsoleColor)(m_styles[_index(row, column)] & 0xFF); }
+
+        // Get the background color of a cell in the back buffer.
+        ConsoleColor background(int row, int column) const { return (ConsoleColor)(m_styles[_index(row, column)] >> 8); }
+
+        // Send the cells that changed since the last present to the console.
+        void present(Console &console);
+
+        // Forget what was presented, so the next present redraws every cell. Use after something
+        // else has written to the terminal.
+        void invalidate();
+
+        // Number of cells sent by the last present.
+        size_t last_changed_cells() const { return m_last_changed_cells; }
+
+    private:
+        // Index of a cell in the arrays.
+        size_t _index(int row, int column) const { return (size_t)row * (size_t)m_width + (size_t)column; }
+
+        // True if the cell differs from what was last presented.
+        bool _changed(size_t index) const
+        {
+            return m_codepoints[index] != m_front_codepoints[index] || m_styles[index] != m_front_styles[index];
+        }
+
+        // Turn a wide character covering the cell into a space, before the cell is overwritten.
+        void _break_wide(int row, int column);
+
+        // Append cells [begin, end) of the back buffer to the frame, one segment per color run.
+        void _append_cells(size_t begin, size_t end);
+
+        int m_width;
+        int m_height;
+
+        // Back buffer, as separate arrays of code points and packed colors (foreground in the low
+        // byte, background in the high byte) so whole rows compare with memcmp.
+        std::vector<char32_t> m_codepoints;
+        std::vector<uint16_t> m_styles;
+
+        // What the terminal is showing, as of the last present.
+        std::vector<char32_t> m_front_codepoints;
+        std::vector<uint16_t> m_front_styles;
+
+        Frame m_frame;
+        std::string m_utf8;
+        size_t m_last_changed_cells;
+    };
+}
+
+#endif /* _WIN_COLOR_SCREEN_HH */
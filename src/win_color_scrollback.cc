@@ -0,0 +1,233 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <algorithm>
+#include <string.h>
+
+#include "win_color_scrollback.hh"
+
+// Most bytes of text and runs a replay puts in one frame, which bound the memory it uses on top
+// of the rings.
+#define WINCC_SCROLLBACK_FRAME_SIZE (64 * 1024)
+#define WINCC_SCROLLBACK_FRAME_RUNS 1024
+
+// Largest text ring, so run sizes fit in 32 bits.
+#define WINCC_SCROLLBACK_MAX_TEXT 0xFFFFFFFFu
+
+wincc::Scrollback::Scrollback(size_t max_lines)
+    : Scrollback(max_lines, max_lines * k_default_line_bytes, max_lines * k_default_runs_per_line)
+{
+}
+
+wincc::Scrollback::Scrollback(size_t max_lines, size_t text_capacity, size_t run_capacity)
+    : m_text_capacity(std::min(std::max(text_capacity, (size_t)2), (size_t)WINCC_SCROLLBACK_MAX_TEXT)),
+      m_text_begin(0), m_text_end(0), m_run_capacity(std::max(run_capacity, (size_t)4)), m_run_begin(0), m_run_end(0),
+      m_line_capacity(std::max(max_lines, (size_t)1)), m_line_begin(0), m_line_end(0), m_line_open(false),
+      m_truncating(false)
+{
+    m_text.reset(new char[m_text_capacity]);
+    m_runs.reset(new Run[m_run_capacity]);
+    m_lines.reset(new uint64_t[m_line_capacity]);
+}
+
+void wincc::Scrollback::append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size)
+{
+    const char *end = text + size;
+
+    while (text < end)
+    {
+        const char *newline = detail::find_byte(text, end, '\n');
+        const char *piece_end = newline == end ? end : newline + 1;
+        _append_piece((unsigned char)foreground, (unsigned char)background, text, (size_t)(piece_end - text));
+        text = piece_end;
+    }
+}
+
+void wincc::Scrollback::clear()
+{
+    m_text_begin = m_text_end = 0;
+    m_run_begin = m_run_end = 0;
+    m_line_begin = m_line_end = 0;
+    m_line_open = false;
+    m_truncating = false;
+}
+
+size_t wincc::Scrollback::memory_usage() const
+{
+    return sizeof(*this) + m_text_capacity + m_run_capacity * sizeof(Run) + m_line_capacity * sizeof(uint64_t);
+}
+
+void wincc::Scrollback::replay(Console &console, size_t first_line, size_t count) const
+{
+    if (first_line >= line_count())
+    {
+        return;
+    }
+
+    count = std::min(count, line_count() - first_line);
+
+    uint64_t first = m_line_begin + first_line;
+    uint64_t last = first + count;
+    uint64_t run = m_lines[first % m_line_capacity];
+    uint64_t run_end = last < m_line_end ? m_lines[last % m_line_capacity] : m_run_end;
+
+    // A console recording into this scrollback would otherwise add the lines again.
+    Scrollback *attached = console.scrollback();
+    if (attached == this)
+    {
+        console.scrollback(nullptr);
+    }
+
+    // A frame of its own keeps concurrent replays apart. Runs longer than the frame are split.
+    Frame frame;
+    size_t frame_runs = 0;
+    for (; run < run_end; ++run)
+    {
+        const Run &entry = m_runs[run % m_run_capacity];
+        const char *text = m_text.get() + entry.offset % m_text_capacity;
+        size_t size = entry.size;
+
+        while (size > 0)
+        {
+            size_t piece = std::min(size, (size_t)WINCC_SCROLLBACK_FRAME_SIZE - frame.size());
+            frame.append((ConsoleColor)entry.foreground, (ConsoleColor)entry.background, text, piece);
+            text += piece;
+            size -= piece;
+            ++frame_runs;
+
+            if (frame.size() == WINCC_SCROLLBACK_FRAME_SIZE || frame_runs == WINCC_SCROLLBACK_FRAME_RUNS)
+            {
+                console.commit(frame);
+                frame.clear();
+                frame_runs = 0;
+            }
+        }
+    }
+
+    console.commit(frame);
+
+    console.scrollback(attached);
+}
+
+void wincc::Scrollback::replay_last(Console &console, size_t count) const
+{
+    count = std::min(count, line_count());
+    replay(console, line_count() - count, count);
+}
+
+void wincc::Scrollback::_append_piece(unsigned char foreground, unsigned char background, const char *text, size_t size)
+{
+    bool ends_line = text[size - 1] == '\n';
+    size_t content = size - (ends_line ? 1 : 0);
+
+    if (!m_line_open)
+    {
+        if (line_count() == m_line_capacity)
+        {
+            _drop_line();
+        }
+
+        m_lines[m_line_end % m_line_capacity] = m_run_end;
+        ++m_line_end;
+        m_line_open = true;
+        m_truncating = false;
+    }
+
+    if (content > 0 && !m_truncating)
+    {
+        _append_run(foreground, background, text, content);
+    }
+
+    if (ends_line)
+    {
+        // Room for the newline is always kept, so a cut line still ends.
+        _append_run(foreground, background, text + content, 1);
+        m_line_open = false;
+        m_truncating = false;
+    }
+}
+
+void wincc::Scrollback::_append_run(unsigned char foreground, unsigned char background, const char *text, size_t size)
+{
+    // Text that leaves the line open keeps a byte and a run spare for the newline ending it. Text
+    // crossing the end of the ring takes two runs.
+    size_t spare = text[size - 1] == '\n' ? 0 : 1;
+    size_t runs = (size > 1 ? 2 : 1) + spare;
+
+    while ((text_size() + size + spare > m_text_capacity || (size_t)(m_run_end - m_run_begin) + runs > m_run_capacity) &&
+        line_count() > 1)
+    {
+        _drop_line();
+    }
+
+    // Only the open line is left, so whatever does not fit is cut off.
+    if ((size_t)(m_run_end - m_run_begin) + runs > m_run_capacity)
+    {
+        m_truncating = true;
+        return;
+    }
+
+    if (text_size() + size + spare > m_text_capacity)
+    {
+        size = m_text_capacity - text_size() - spare;
+        m_truncating = true;
+
+        if (size == 0)
+        {
+            return;
+        }
+    }
+
+    size_t position = (size_t)(m_text_end % m_text_capacity);
+    size_t first = std::min(size, m_text_capacity - position);
+    memcpy(m_text.get() + position, text, first);
+    memcpy(m_text.get(), text + first, size - first);
+
+    // Extend the last run if it belongs to this line, has the same colors and ends right here
+    // without the ring wrapping in between.
+    bool extended = false;
+    if (m_run_end > m_lines[(m_line_end - 1) % m_line_capacity] && position != 0)
+    {
+        Run &last = m_runs[(m_run_end - 1) % m_run_capacity];
+        if (last.foreground == foreground && last.background == background && last.offset + last.size == m_text_end)
+        {
+            last.size += (uint32_t)first;
+            extended = true;
+        }
+    }
+
+    if (!extended)
+    {
+        m_runs[m_run_end % m_run_capacity] = Run{ m_text_end, (uint32_t)first, foreground, background };
+        ++m_run_end;
+    }
+
+    if (size > first)
+    {
+        m_runs[m_run_end % m_run_capacity] = Run{ m_text_end + first, (uint32_t)(size - first), foreground, background };
+        ++m_run_end;
+    }
+
+    m_text_end += size;
+}
+
+void wincc::Scrollback::_drop_line()
+{
+    if (line_count() == 0)
+    {
+        return;
+    }
+
+    ++m_line_begin;
+
+    if (m_line_begin == m_line_end)
+    {
+        m_run_begin = m_run_end;
+        m_text_begin = m_text_end;
+        m_line_open = false;
+        return;
+    }
+
+    m_run_begin = m_lines[m_line_begin % m_line_capacity];
+    m_text_begin = m_run_begin == m_run_end ? m_text_end : m_runs[m_run_begin % m_run_capacity].offset;
+}
@@ -0,0 +1,116 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_SCROLLBACK_HH
+#define _WIN_COLOR_SCROLLBACK_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    // The last lines written to a console, in their colors, kept in a fixed amount of memory so
+    // they can be drawn again after the terminal is resized or when the user asks for history.
+    // Attach it with Console::scrollback. Text is copied into a ring of bytes allocated up front,
+    // and a second ring holds a run per stretch of text in one pair of colors, split at newlines
+    // so every line starts a run. A third ring holds the first run of each line. When any of
+    // them is full, the oldest line is dropped by moving the start of each ring past it, so
+    // nothing is freed or moved. Cursor moves are not kept.
+    class Scrollback
+    {
+    public:
+        // Keep up to max_lines lines, with k_default_line_bytes of text and
+        // k_default_runs_per_line runs for each on average.
+        explicit Scrollback(size_t max_lines);
+
+        // Keep up to max_lines lines, text_capacity bytes of text and run_capacity runs, whichever
+        // runs out first.
+        Scrollback(size_t max_lines, size_t text_capacity, size_t run_capacity);
+
+        Scrollback(const Scrollback &) = delete;
+
+        Scrollback &operator=(const Scrollback &) = delete;
+
+        // Add text in the given colors. Consoles call this for everything they write. A line
+        // longer than the whole text ring is cut short.
+        void append(ConsoleColor foreground, ConsoleColor background, const char *text, size_t size);
+
+        // Forget every line, keeping the memory.
+        void clear();
+
+        // Lines held, counting text after the last newline as a line.
+        size_t line_count() const { return (size_t)(m_line_end - m_line_begin); }
+
+        // Lines dropped to make room since the scrollback was created or cleared. Adding it to a
+        // line number held now gives a number that stays the same as older lines are dropped.
+        uint64_t dropped_line_count() const { return m_line_begin; }
+
+        // Bytes of text held.
+        size_t text_size() const { return (size_t)(m_text_end - m_text_begin); }
+
+        // Bytes allocated, which never changes after construction. A replay also holds a frame of
+        // at most 64 KB of text and 1024 runs while it runs.
+        size_t memory_usage() const;
+
+        // Write lines [first_line, first_line + count) through a console, in their colors, where
+        // line 0 is the oldest held. Neighboring runs in the same colors are merged and the lines
+        // go out as one frame for every 64 KB of text or 1024 runs. The console's own scrollback,
+        // if it is this one, does not record the replay. Replays may run at the same time, but not
+        // at the same time as an append.
+        void replay(Console &console, size_t first_line, size_t count) const;
+
+        // Write the last count lines through a console, such as a screen's worth after a resize.
+        void replay_last(Console &console, size_t count) const;
+
+        static const size_t k_default_line_bytes = 128;
+        static const size_t k_default_runs_per_line = 4;
+
+    private:
+        // Run of text in one pair of colors, contiguous in the text ring.
+        struct Run
+        {
+            uint64_t offset;
+            uint32_t size;
+            unsigned char foreground;
+            unsigned char background;
+        };
+
+        // Add text holding no newline, or ending with one, to the open line.
+        void _append_piece(unsigned char foreground, unsigned char background, const char *text, size_t size);
+
+        // Add a run of text to the open line, extending the last run if it can.
+        void _append_run(unsigned char foreground, unsigned char background, const char *text, size_t size);
+
+        // Drop the oldest line. The open line is only dropped if it is the only one.
+        void _drop_line();
+
+        // Positions are counted from the start and never wrap; the index into a ring is the
+        // position modulo its capacity.
+        std::unique_ptr<char[]> m_text;
+        size_t m_text_capacity;
+        uint64_t m_text_begin;
+        uint64_t m_text_end;
+
+        std::unique_ptr<Run[]> m_runs;
+        size_t m_run_capacity;
+        uint64_t m_run_begin;
+        uint64_t m_run_end;
+
+        // First run of each line.
+        std::unique_ptr<uint64_t[]> m_lines;
+        size_t m_line_capacity;
+        uint64_t m_line_begin;
+        uint64_t m_line_end;
+
+        // True while the newest line has not ended with a newline, so text extends it.
+        bool m_line_open;
+
+        // True while the rest of the open line is dropped because it outgrew the text ring.
+        bool m_truncating;
+    };
+}
+
+#endif /* _WIN_COLOR_SCROLLBACK_HH */
@@ -0,0 +1,227 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_STYLED_HH
+#define _WIN_COLOR_STYLED_HH
+
+#include <stddef.h>
+#include <string_view>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    namespace detail
+    {
+        // String literal usable as a template argument.
+        template <size_t N>
+        struct FixedString
+        {
+            constexpr FixedString(const char (&text)[N])
+            {
+                for (size_t i = 0; i < N; ++i)
+                {
+                    data[i] = text[i];
+                }
+            }
+
+            constexpr std::string_view view() const { return std::string_view(data, N - 1); }
+
+            char data[N];
+        };
+
+        // Styled text compiled into fixed-size arrays. Arrays have one spare element so none is empty.
+        template <size_t TextSize, size_t SpanCount, size_t AnsiSize>
+        struct CompiledStyled
+        {
+            char text[TextSize + 1] = {};
+            StyledSpan spans[SpanCount + 1] = {};
+            char ansi[AnsiSize + 1] = {};
+            size_t text_size = 0;
+            size_t span_count = 0;
+            size_t ansi_size = 0;
+            size_t ansi_lead_size = 0;
+            bool valid = true;
+        };
+
+        // Append an SGR parameter to the ANSI form.
+        template <class Compiled>
+        constexpr void append_sgr_code(Compiled &out, int code)
+        {
+            char digits[4] = {};
+            size_t count = 0;
+
+            do
+            {
+                digits[count++] = (char)('0' + code % 10);
+                code /= 10;
+            } while (code);
+
+            while (count)
+            {
+                out.ansi[out.ansi_size++] = digits[--count];
+            }
+        }
+
+        // Append text in the given colors, merging with the previous span when the colors match.
+        // The ANSI form gets an escape sequence for whatever part of the colors changed.
+        template <class Compiled>
+        constexpr void append_styled(Compiled &out, ConsoleColor foreground, ConsoleColor background, std::string_view text)
+        {
+            if (text.empty())
+            {
+                return;
+            }
+
+            StyledSpan *previous = out.span_count ? &out.spans[out.span_count - 1] : nullptr;
+
+            if (!previous || previous->foreground != foreground || previous->background != background)
+            {
+                // The first span sets both colors since the terminal could be in any state.
+                bool set_foreground = !previous || previous->foreground != foreground;
+                bool set_background = !previous || previous->background != background;
+
+                out.ansi[out.ansi_size++] = '\x1b';
+                out.ansi[out.ansi_size++] = '[';
+
+                if (set_foreground)
+                {
+                    append_sgr_code(out, k_sgr_color_codes[(int)foreground]);
+                }
+
+                if (set_background)
+                {
+                    if (set_foreground)
+                    {
+                        out.ansi[out.ansi_size++] = ';';
+                    }
+
+                    append_sgr_code(out, k_sgr_color_codes[(int)background] + 10);
+                }
+
+                out.ansi[out.ansi_size++] = 'm';
+
+                if (!previous)
+                {
+                    out.ansi_lead_size = out.ansi_size;
+                }
+
+                out.spans[out.span_count++] = StyledSpan{ foreground, background, out.text_size, 0 };
+            }
+
+            for (char c : text)
+            {
+                out.text[out.text_size++] = c;
+                out.ansi[out.ansi_size++] = c;
+            }
+
+            out.spans[out.span_count - 1].size += text.size();
+        }
+
+        // Compile markup into arrays big enough for any markup of that length.
+        template <size_t N>
+        constexpr auto compile_styled(std::string_view markup)
+        {
+            // Each character adds at most one byte of text, one span, and one escape sequence.
+            CompiledStyled<N, N, N * 16> out;
+            ConsoleColor foreground = ConsoleColor::Default;
+            ConsoleColor background = ConsoleColor::Default;
+            size_t literal_start = 0;
+
+            for (size_t i = 0; i < markup.size(); ++i)
+            {
+                if (markup[i] != '{' && markup[i] != '}')
+                {
+                    continue;
+                }
+
+                append_styled(out, foreground, background, markup.substr(literal_start, i - literal_start));
+
+                if (i + 1 < markup.size() && markup[i + 1] == markup[i])
+                {
+                    // {{ and }} are literal braces.
+                    append_styled(out, foreground, background, markup.substr(i, 1));
+                    ++i;
+                }
+                else if (markup[i] == '{')
+                {
+                    size_t end = markup.find('}', i);
+                    if (end == std::string_view::npos || !parse_color_tag(markup.substr(i + 1, end - i - 1), foreground, background))
+                    {
+                        out.valid = false;
+                        return out;
+                    }
+
+                    i = end;
+                }
+                else
+                {
+                    out.valid = false;
+                    return out;
+                }
+
+                literal_start = i + 1;
+            }
+
+            append_styled(out, foreground, background, markup.substr(literal_start));
+            return out;
+        }
+
+        // Copy compiled markup into arrays of exactly the right size.
+        template <size_t TextSize, size_t SpanCount, size_t AnsiSize, class Compiled>
+        constexpr auto shrink_styled(const Compiled &big)
+        {
+            CompiledStyled<TextSize, SpanCount, AnsiSize> out;
+
+            for (size_t i = 0; i < TextSize; ++i)
+            {
+                out.text[i] = big.text[i];
+            }
+
+            for (size_t i = 0; i < SpanCount; ++i)
+            {
+                out.spans[i] = big.spans[i];
+            }
+
+            for (size_t i = 0; i < AnsiSize; ++i)
+            {
+                out.ansi[i] = big.ansi[i];
+            }
+
+            out.text_size = TextSize;
+            out.span_count = SpanCount;
+            out.ansi_size = AnsiSize;
+            out.ansi_lead_size = big.ansi_lead_size;
+            return out;
+        }
+
+        // Storage for one compiled markup string.
+        template <FixedString Markup>
+        struct StyledStorage
+        {
+            static constexpr auto big = compile_styled<sizeof(Markup.data)>(Markup.view());
+            static_assert(big.valid, "malformed styled markup: use {color}, {color on color} or {/}, with {{ and }} for braces");
+
+            static constexpr auto exact = shrink_styled<big.text_size, big.span_count, big.ansi_size>(big);
+
+            static constexpr StyledText value =
+            {
+                exact.text, exact.spans, exact.span_count, exact.ansi, exact.ansi_size, exact.ansi_lead_size
+            };
+        };
+    }
+
+    // Colored text compiled from markup at compile time. Tags name colors from ConsoleColor,
+    // ignoring case: {red} sets the foreground, {white on blue} sets both, and {/} goes back to the
+    // defaults, which is also where the text starts. {{ and }} are literal braces. Write the result
+    // with Console::write.
+    //
+    //     console.write(wincc::styled<"{red}[ERROR]{/} ">());
+    template <detail::FixedString Markup>
+    constexpr const StyledText &styled()
+    {
+        return detail::StyledStorage<Markup>::value;
+    }
+}
+
+#endif /* _WIN_COLOR_STYLED_HH */
@@ -0,0 +1,467 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#include <algorithm>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WINCC_HAVE_SSE2 1
+#endif
+
+#include "win_color_table.hh"
+
+// Width codes in the BMP width table, two bits per code point.
+#define WINCC_WIDTH_NARROW 0
+#define WINCC_WIDTH_WIDE 1
+#define WINCC_WIDTH_ZERO 2
+
+// Range of code points of one width.
+struct WidthRange
+{
+    char32_t first;
+    char32_t last;
+};
+
+// East Asian wide and fullwidth characters, and emoji shown as two columns. Sorted and not
+// overlapping, so ranges above U+FFFF can be binary searched.
+static const WidthRange k_wide_ranges[] =
+{
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+    { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267F, 0x267F },
+    { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+    { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B }, { 0x2728, 0x2728 },
+    { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+    { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+    { 0x2E80, 0x303E }, { 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+    { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F },
+    { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 },
+    { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CFF }, { 0x1B000, 0x1B2FF }, { 0x1F004, 0x1F004 },
+    { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 },
+    { 0x1F210, 0x1F23B }, { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 }, { 0x1F260, 0x1F265 },
+    { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 },
+    { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 },
+    { 0x1F3F8, 0x1F3FA }, { 0x1F400, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC },
+    { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A },
+    { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 },
+    { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6DC, 0x1F6DF },
+    { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7EB }, { 0x1F7F0, 0x1F7F0 },
+    { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FAFF },
+    { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD }
+};
+
+// Combining marks, joiners, variation selectors and other characters that take no column of their
+// own. Sorted and not overlapping.
+static const WidthRange k_zero_ranges[] =
+{
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 },
+    { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x064B, 0x065F }, { 0x0670, 0x0670 },
+    { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0900, 0x0902 },
+    { 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A },
+    { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+    { 0x2060, 0x2064 }, { 0x20D0, 0x20FF }, { 0x302A, 0x302D }, { 0x3099, 0x309A }, { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF },
+    { 0x1F3FB, 0x1F3FF }, { 0xE0000, 0xE007F }, { 0xE0100, 0xE01EF }
+};
+
+// Width codes for every code point below U+10000, two bits each.
+struct BmpWidths
+{
+    unsigned char codes[0x10000 / 4];
+
+    BmpWidths()
+    {
+        memset(codes, 0, sizeof(codes));
+
+        // Zero width last, since a few zero-width marks sit inside wide blocks.
+        set(k_wide_ranges, sizeof(k_wide_ranges) / sizeof(k_wide_ranges[0]), WINCC_WIDTH_WIDE);
+        set(k_zero_ranges, sizeof(k_zero_ranges) / sizeof(k_zero_ranges[0]), WINCC_WIDTH_ZERO);
+    }
+
+    void set(const WidthRange *ranges, size_t count, unsigned code)
+    {
+        for (size_t i = 0; i < count && ranges[i].first < 0x10000; ++i)
+        {
+            for (char32_t cp = ranges[i].first; cp <= ranges[i].last; ++cp)
+            {
+                unsigned shift = (cp & 3) * 2;
+                codes[cp >> 2] = (unsigned char)((codes[cp >> 2] & ~(3u << shift)) | (code << shift));
+            }
+        }
+    }
+
+    unsigned get(char32_t cp) const
+    {
+        return (codes[cp >> 2] >> ((cp & 3) * 2)) & 3;
+    }
+};
+
+// BMP width table, built on first use.
+static const BmpWidths &bmp_widths()
+{
+    static const BmpWidths widths;
+    return widths;
+}
+
+// True if cp is in one of the sorted ranges.
+static bool in_ranges(const WidthRange *ranges, size_t count, char32_t cp)
+{
+    const WidthRange *end = ranges + count;
+    const WidthRange *found = std::upper_bound(ranges, end, cp,
+        [](char32_t value, const WidthRange &range) { return value < range.first; });
+
+    return found != ranges && cp <= found[-1].last;
+}
+
+// Spaces appended as padding, in chunks of up to this many.
+static const char k_spaces[] = "                                                                ";
+
+// Append count spaces to a frame in the given colors.
+static void append_spaces(wincc::Frame &frame, unsigned char foreground, unsigned char background, size_t count)
+{
+    while (count > 0)
+    {
+        size_t chunk = std::min(count, sizeof(k_spaces) - 1);
+        frame.append(foreground, background, k_spaces, chunk);
+        count -= chunk;
+    }
+}
+
+int wincc::detail::codepoint_width(char32_t codepoint)
+{
+    if (codepoint < 0x10000)
+    {
+        unsigned code = bmp_widths().get(codepoint);
+        return code == WINCC_WIDTH_WIDE ? 2 : code == WINCC_WIDTH_ZERO ? 0 : 1;
+    }
+
+    if (in_ranges(k_zero_ranges, sizeof(k_zero_ranges) / sizeof(k_zero_ranges[0]), codepoint))
+    {
+        return 0;
+    }
+
+    return in_ranges(k_wide_ranges, sizeof(k_wide_ranges) / sizeof(k_wide_ranges[0]), codepoint) ? 2 : 1;
+}
+
+size_t wincc::detail::display_width(std::string_view text)
+{
+    size_t width = 0;
+    size_t pos = 0;
+
+    while (pos < text.size())
+    {
+#ifdef WINCC_HAVE_SSE2
+        // ASCII takes one column per byte, so whole blocks without a high bit need no decoding.
+        if (text.size() - pos >= 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)(text.data() + pos));
+            unsigned mask = (unsigned)_mm_movemask_epi8(block);
+
+            if (mask == 0)
+            {
+                width += 16;
+                pos += 16;
+                continue;
+            }
+
+#ifdef _MSC_VER
+            unsigned long ascii;
+            _BitScanForward(&ascii, mask);
+#else
+            unsigned ascii = (unsigned)__builtin_ctz(mask);
+#endif
+            width += ascii;
+            pos += ascii;
+        }
+#endif
+
+        if ((unsigned char)text[pos] < 0x80)
+        {
+            ++width;
+            ++pos;
+            continue;
+        }
+
+        width += (size_t)codepoint_width(decode_utf8(text, pos));
+    }
+
+    return width;
+}
+
+size_t wincc::detail::fit_width(std::string_view text, size_t width, size_t &used)
+{
+    size_t pos = 0;
+    used = 0;
+
+    while (pos < text.size())
+    {
+        size_t next = pos;
+        size_t cp_width = (size_t)codepoint_width(decode_utf8(text, next));
+
+        if (used + cp_width > width)
+        {
+            break;
+        }
+
+        used += cp_width;
+        pos = next;
+    }
+
+    return pos;
+}
+
+void wincc::Table::add_column(std::string_view header, Align align)
+{
+    Column column;
+    column.header_offset = m_headers.size();
+    column.header_size = header.size();
+    column.header_width = detail::display_width(header);
+    column.width = column.header_width;
+    column.align = align;
+
+    m_headers.append(header.data(), header.size());
+    m_columns.push_back(column);
+}
+
+void wincc::Table::add_row()
+{
+    if (m_streaming && !m_rows.empty())
+    {
+        if (!m_widths_fixed && m_rows.size() >= m_sample_rows)
+        {
+            // The sample is complete: fix the widths and write everything held so far.
+            m_widths_fixed = true;
+            _render_header();
+        }
+
+        if (m_widths_fixed)
+        {
+            _render_rows(0, m_rows.size());
+            _drop_rows();
+        }
+    }
+
+    m_rows.push_back(m_cells.size());
+}
+
+void wincc::Table::add_cell(std::string_view text)
+{
+    _add_cell(Frame::k_current_color, Frame::k_current_color, k_column_align, text);
+}
+
+void wincc::Table::add_cell(ConsoleColor foreground, std::string_view text)
+{
+    _add_cell((unsigned char)foreground, Frame::k_current_color, k_column_align, text);
+}
+
+void wincc::Table::add_cell(ConsoleColor foreground, ConsoleColor background, std::string_view text)
+{
+    _add_cell((unsigned char)foreground, (unsigned char)background, k_column_align, text);
+}
+
+void wincc::Table::add_cell(ConsoleColor foreground, ConsoleColor background, Align align, std::string_view text)
+{
+    _add_cell((unsigned char)foreground, (unsigned char)background, align, text);
+}
+
+void wincc::Table::render(Console &console)
+{
+    m_console = &console;
+
+    _render_header();
+    _render_rows(0, m_rows.size());
+    _commit();
+    _drop_rows();
+
+    m_console = nullptr;
+}
+
+void wincc::Table::stream(Console &console, size_t sample_rows)
+{
+    m_console = &console;
+    m_streaming = true;
+    m_sample_rows = std::max<size_t>(sample_rows, 1);
+    m_widths_fixed = false;
+}
+
+void wincc::Table::finish()
+{
+    if (!m_streaming)
+    {
+        return;
+    }
+
+    // Fewer rows than the sample, so the widths were never fixed.
+    if (!m_widths_fixed)
+    {
+        _render_header();
+    }
+
+    _render_rows(0, m_rows.size());
+    _commit();
+    _drop_rows();
+
+    m_console = nullptr;
+    m_streaming = false;
+    m_widths_fixed = false;
+}
+
+void wincc::Table::clear()
+{
+    m_columns.clear();
+    m_headers.clear();
+    _drop_rows();
+    m_frame.clear();
+
+    m_console = nullptr;
+    m_streaming = false;
+    m_widths_fixed = false;
+}
+
+void wincc::Table::_add_cell(unsigned char foreground, unsigned char background, Align align, std::string_view text)
+{
+    if (m_rows.empty())
+    {
+        add_row();
+    }
+
+    // Cells past the last column are dropped.
+    size_t column = m_cells.size() - m_rows.back();
+    if (column >= m_columns.size())
+    {
+        return;
+    }
+
+    if (align == k_column_align)
+    {
+        align = m_columns[column].align;
+    }
+
+    Cell cell;
+    cell.offset = m_text.size();
+    cell.size = text.size();
+    cell.width = detail::display_width(text);
+    cell.foreground = foreground;
+    cell.background = background;
+    cell.align = align;
+
+    m_text.append(text.data(), text.size());
+    m_cells.push_back(cell);
+
+    if (!m_widths_fixed)
+    {
+        m_columns[column].width = std::max(m_columns[column].width, cell.width);
+    }
+}
+
+void wincc::Table::_render_header()
+{
+    for (size_t c = 0; c < m_columns.size(); ++c)
+    {
+        const Column &column = m_columns[c];
+
+        Cell cell = { column.header_offset, column.header_size, column.header_width, Frame::k_current_color, Frame::k_current_color,
+            column.align };
+        _append_cell(cell, std::string_view(m_headers.data() + column.header_offset, column.header_size), column.width,
+            c + 1 == m_columns.size());
+
+        if (c + 1 < m_columns.size())
+        {
+            append_spaces(m_frame, Frame::k_current_color, Frame::k_current_color, k_column_gap);
+        }
+    }
+
+    m_frame.append("\n", 1);
+
+    for (size_t c = 0; c < m_columns.size(); ++c)
+    {
+        for (size_t i = 0; i < m_columns[c].width; ++i)
+        {
+            m_frame.append(ConsoleColor::DarkGray, "-", 1);
+        }
+
+        if (c + 1 < m_columns.size())
+        {
+            append_spaces(m_frame, Frame::k_current_color, Frame::k_current_color, k_column_gap);
+        }
+    }
+
+    m_frame.append("\n", 1);
+}
+
+void wincc::Table::_render_rows(size_t begin, size_t end)
+{
+    for (size_t r = begin; r < end; ++r)
+    {
+        size_t first = m_rows[r];
+        size_t count = (r + 1 < m_rows.size() ? m_rows[r + 1] : m_cells.size()) - first;
+
+        // The line ends after its last cell that shows anything, so it has no trailing spaces.
+        while (count > 0 && m_cells[first + count - 1].size == 0 && m_cells[first + count - 1].background == Frame::k_current_color)
+        {
+            --count;
+        }
+
+        for (size_t c = 0; c < count; ++c)
+        {
+            const Cell &cell = m_cells[first + c];
+            _append_cell(cell, std::string_view(m_text.data() + cell.offset, cell.size), m_columns[c].width,
+                c + 1 == count);
+
+            if (c + 1 < count)
+            {
+                append_spaces(m_frame, Frame::k_current_color, Frame::k_current_color, k_column_gap);
+            }
+        }
+
+        m_frame.append("\n", 1);
+
+        if (m_frame.size() >= k_commit_size)
+        {
+            _commit();
+        }
+    }
+}
+
+void wincc::Table::_append_cell(const Cell &cell, std::string_view text, size_t width, bool last)
+{
+    size_t used = cell.width;
+    size_t size = text.size();
+
+    // Only a stream fixes widths, so only a stream cuts cells.
+    if (used > width)
+    {
+        size = detail::fit_width(text, width, used);
+    }
+
+    size_t padding = width - used;
+    size_t left = cell.align == Align::Right ? padding : cell.align == Align::Center ? padding / 2 : 0;
+    size_t right = padding - left;
+
+    // Trailing spaces are only worth writing if they show a background.
+    if (last && cell.background == Frame::k_current_color)
+    {
+        right = 0;
+    }
+
+    append_spaces(m_frame, cell.foreground, cell.background, left);
+    m_frame.append(cell.foreground, cell.background, text.data(), size);
+    append_spaces(m_frame, cell.foreground, cell.background, right);
+}
+
+void wincc::Table::_commit()
+{
+    if (!m_frame.empty())
+    {
+        m_console->commit(m_frame);
+        m_frame.clear();
+    }
+}
+
+void wincc::Table::_drop_rows()
+{
+    m_cells.clear();
+    m_text.clear();
+    m_rows.clear();
+}
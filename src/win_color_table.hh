@@ -0,0 +1,162 @@
+/******************************************************************************
+See win_color_console.hh for license details.
+*******************************************************************************/
+#ifndef _WIN_COLOR_TABLE_HH
+#define _WIN_COLOR_TABLE_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "win_color_console.hh"
+
+namespace wincc
+{
+    namespace detail
+    {
+        // Terminal columns taken by a code point: 2 for East Asian wide and fullwidth characters
+        // and emoji, 0 for combining marks and other zero-width characters, 1 for the rest. Code
+        // points below U+10000 are looked up in a table of two bits each, built on first use.
+        int codepoint_width(char32_t codepoint);
+
+        // Terminal columns taken by UTF-8 text. Runs of ASCII are counted sixteen bytes at a time
+        // with SSE2 without decoding them.
+        size_t display_width(std::string_view text);
+
+        // Number of bytes from the start of UTF-8 text that fit in width columns, never splitting
+        // a character. The columns those bytes take are stored in used.
+        size_t fit_width(std::string_view text, size_t width, size_t &used);
+    }
+
+    // How a cell's text is placed within its column.
+    enum class Align
+    {
+        Left,
+        Right,
+        Center
+    };
+
+    // Table of colored text aligned in columns, measured in terminal columns so CJK text and emoji
+    // line up. Cells are kept in one buffer with their widths computed once, as they are added, and
+    // rendered into frames sent to the console in large writes, with neighboring cells in the same
+    // colors merged. render() writes a whole table; stream() writes rows as they come, fixing the
+    // column widths from the first rows so a huge table is never held in memory.
+    class Table
+    {
+    public:
+        // Add a column with a header. Cells in it use the given alignment unless they set their own.
+        void add_column(std::string_view header, Align align = Align::Left);
+
+        // Start a new row. Cells are added to it left to right; missing cells are left blank.
+        void add_row();
+
+        // Add a cell to the current row in the console's current colors.
+        void add_cell(std::string_view text);
+
+        // Add a cell with the given foreground color.
+        void add_cell(ConsoleColor foreground, std::string_view text);
+
+        // Add a cell with the given foreground and background color. The background fills the
+        // whole cell, padding included.
+        void add_cell(ConsoleColor foreground, ConsoleColor background, std::string_view text);
+
+        // Add a cell with the given colors and alignment.
+        void add_cell(ConsoleColor foreground, ConsoleColor background, Align align, std::string_view text);
+
+        // Write the header, a separator and every row, then remove the rows. Columns are kept.
+        void render(Console &console);
+
+        // Write rows to the console as they are added. The first sample_rows rows are held to fix
+        // the column widths; from then on each row is written when the next one starts, and cells
+        // wider than their column are cut off. Call finish() after the last row.
+        void stream(Console &console, size_t sample_rows);
+
+        // Write whatever rows a stream still holds and end it.
+        void finish();
+
+        // Remove every column and row.
+        void clear();
+
+        // Width in terminal columns of a column, from the header and cells added so far or fixed by
+        // stream().
+        size_t column_width(size_t column) const { return m_columns[column].width; }
+
+        // Rows held and not yet written.
+        size_t row_count() const { return m_rows.size(); }
+
+        // Columns between neighboring cells.
+        static const size_t k_column_gap = 2;
+
+    private:
+        // Alignment meaning the column's own.
+        static constexpr Align k_column_align = (Align)-1;
+
+        // Bytes of rendered output at which a frame is committed to the console.
+        static const size_t k_commit_size = 64 * 1024;
+
+        struct Column
+        {
+            // Header text in m_headers.
+            size_t header_offset;
+            size_t header_size;
+            size_t header_width;
+
+            // Widest of the header and the cells measured so far.
+            size_t width;
+            Align align;
+        };
+
+        struct Cell
+        {
+            size_t offset;
+            size_t size;
+            size_t width;
+            unsigned char foreground;
+            unsigned char background;
+            Align align;
+        };
+
+        // Add a cell to the current row, measuring its text.
+        void _add_cell(unsigned char foreground, unsigned char background, Align align, std::string_view text);
+
+        // Write the header and separator lines.
+        void _render_header();
+
+        // Write rows [begin, end).
+        void _render_rows(size_t begin, size_t end);
+
+        // Append one cell's text, padded or cut to its column's width. The last cell of a line is
+        // not padded on the right unless it has a background color.
+        void _append_cell(const Cell &cell, std::string_view text, size_t width, bool last);
+
+        // Send the frame to the console and start a new one.
+        void _commit();
+
+        // Remove the rows and the cell text, keeping the headers and allocated memory.
+        void _drop_rows();
+
+        std::vector<Column> m_columns;
+        std::string m_headers;
+
+        // Cells of the rows held, and their text.
+        std::vector<Cell> m_cells;
+        std::string m_text;
+
+        // Index of the first cell of each row held.
+        std::vector<size_t> m_rows;
+
+        // Console written to while rendering or streaming.
+        Console *m_console = nullptr;
+
+        // Rows held when streaming before the widths are fixed.
+        bool m_streaming = false;
+        size_t m_sample_rows = 0;
+        bool m_widths_fixed = false;
+
+        Frame m_frame;
+    };
+}
+
+#endif /* _WIN_COLOR_TABLE_HH */